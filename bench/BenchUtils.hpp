@@ -0,0 +1,171 @@
+#pragma once
+
+// fixtures shared by the benchmarks: deterministic synthetic torrents, temp dirs and a
+// way to keep the engine's console chatter out of the benchmark output
+
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <cstring>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <openssl/sha.h>
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <Bencode.hpp>
+#include <TorrentFile.hpp>
+#include <PieceManager.hpp>
+#include <ThreadPool.hpp>
+#include <Stats.hpp>
+
+namespace bench {
+
+// same seed, same bytes, so runs are comparable across machines and commits
+inline std::string random_bytes(size_t length, uint32_t seed) {
+    std::mt19937_64 rng(seed);
+    std::string out(length, '\0');
+
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        auto word = rng();
+        std::memcpy(out.data() + i, &word, 8);
+    }
+    for (; i < length; ++i) out[i] = (char)rng();
+    return out;
+}
+
+// bencoded .torrent for the given files. pieces are hashed from `data` when it's given,
+// otherwise they're random, which is all a parser benchmark needs
+inline std::string make_torrent(const std::string& name, size_t piece_length, const std::vector<size_t>& file_lengths,
+                                std::string_view data = {}, const std::string& announce = "http://127.0.0.1:6969/announce") {
+    size_t total{};
+    for (auto length : file_lengths) total += length;
+    size_t num_pieces = (total + piece_length - 1) / piece_length;
+
+    std::string pieces;
+    if (data.empty()) pieces = random_bytes(num_pieces * 20, 1);
+    else {
+        pieces.resize(num_pieces * 20);
+        for (size_t i = 0; i < num_pieces; ++i) {
+            auto length = std::min(piece_length, total - i * piece_length);
+            SHA1(reinterpret_cast<const unsigned char*>(data.data() + i * piece_length), length,
+                 reinterpret_cast<unsigned char*>(pieces.data() + i * 20));
+        }
+    }
+
+    BEncodeValue::Dict info;
+    info["name"] = BEncodeValue{ name };
+    info["piece length"] = BEncodeValue{ (int64_t)piece_length };
+    info["pieces"] = BEncodeValue{ std::move(pieces) };
+
+    if (file_lengths.size() == 1) info["length"] = BEncodeValue{ (int64_t)file_lengths[0] };
+    else {
+        BEncodeValue::List files;
+        for (size_t i = 0; i < file_lengths.size(); ++i) {
+            BEncodeValue::Dict file;
+            file["length"] = BEncodeValue{ (int64_t)file_lengths[i] };
+            file["path"] = BEncodeValue{ BEncodeValue::List{ BEncodeValue{ "dir" + std::to_string(i % 16) }, BEncodeValue{ "file" + std::to_string(i) + ".bin" } } };
+            files.push_back(BEncodeValue{ std::move(file) });
+        }
+        info["files"] = BEncodeValue{ std::move(files) };
+    }
+
+    BEncodeValue::Dict root;
+    root["announce"] = BEncodeValue{ announce };
+    root["created by"] = BEncodeValue{ std::string("ctorrent_bench") };
+    root["info"] = BEncodeValue{ std::move(info) };
+    return bencode(BEncodeValue{ std::move(root) });
+}
+
+// fresh directory under the system temp dir, gone again with the object
+class TempDir {
+public:
+    TempDir() {
+        auto base = std::filesystem::temp_directory_path();
+        std::mt19937_64 rng(std::random_device{}());
+        do path_ = base / ("ctorrent-bench-" + std::to_string(rng()));
+        while (!std::filesystem::create_directory(path_));
+    }
+
+    ~TempDir() {
+        std::error_code ec;
+        std::filesystem::remove_all(path_, ec);
+    }
+
+    TempDir(const TempDir&) = delete;
+    TempDir& operator=(const TempDir&) = delete;
+
+    const std::filesystem::path& path() const { return path_; }
+
+private:
+    std::filesystem::path path_;
+};
+
+// swallows everything written to stdout for its lifetime, both std::cout and std::print.
+// the engine likes to talk and the benchmark reporter only writes once we're done
+class QuietStdout {
+public:
+    QuietStdout() {
+        std::cout.flush();
+        std::fflush(stdout);
+#ifdef __unix__
+        saved_fd_ = ::dup(STDOUT_FILENO);
+        int null_fd = ::open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            ::dup2(null_fd, STDOUT_FILENO);
+            ::close(null_fd);
+        }
+#endif
+        old_ = std::cout.rdbuf(&null_);
+    }
+
+    ~QuietStdout() {
+        std::cout.rdbuf(old_);
+        std::fflush(stdout);
+#ifdef __unix__
+        if (saved_fd_ >= 0) {
+            ::dup2(saved_fd_, STDOUT_FILENO);
+            ::close(saved_fd_);
+        }
+#endif
+    }
+
+    QuietStdout(const QuietStdout&) = delete;
+    QuietStdout& operator=(const QuietStdout&) = delete;
+
+private:
+    struct NullBuf : std::streambuf {
+        int overflow(int c) override { return c; }
+    } null_;
+    std::streambuf* old_{};
+    int saved_fd_{ -1 };
+};
+
+// a piece manager with its own pools. the pools are declared first so they outlive it
+struct Engine {
+    Stats stats;
+    ThreadPool disk_pool{ 1 };
+    ThreadPool hash_pool{ 1 };
+    std::unique_ptr<PieceManager> pm;
+
+    Engine(const Metadata& metadata, const std::string& name) {
+        QuietStdout quiet;
+        pm = std::make_unique<PieceManager>(metadata.total_size, metadata.piece_hashes.size(), metadata.piece_length,
+                                            metadata.piece_hashes, name, stats, disk_pool, hash_pool);
+    }
+
+    ~Engine() {
+        QuietStdout quiet;
+        pm.reset();
+    }
+};
+
+}
@@ -0,0 +1,100 @@
+#include <benchmark/benchmark.h>
+
+#include <BenchUtils.hpp>
+#include <Peer.hpp>
+
+// a single file torrent with `pieces` 16 KiB pieces, i.e. a 20 * pieces byte "pieces" string
+static void BM_BencodeParse(benchmark::State& state) {
+    auto pieces = (size_t)state.range(0);
+    auto torrent = bench::make_torrent("big.bin", 16384, { pieces * 16384 });
+
+    for (auto _ : state) {
+        BEncodeParser parser(torrent);
+        auto root = parser.parse();
+        benchmark::DoNotOptimize(root);
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)torrent.size());
+}
+BENCHMARK(BM_BencodeParse)->Arg(1 << 12)->Arg(1 << 16)->Arg(1 << 18);
+
+// lots of small dicts and lists instead of one big string
+static void BM_BencodeParseManyFiles(benchmark::State& state) {
+    std::vector<size_t> files((size_t)state.range(0), 100000);
+    auto torrent = bench::make_torrent("many", 262144, files);
+
+    for (auto _ : state) {
+        BEncodeParser parser(torrent);
+        auto root = parser.parse();
+        benchmark::DoNotOptimize(root);
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)torrent.size());
+}
+BENCHMARK(BM_BencodeParseManyFiles)->Arg(1000)->Arg(10000);
+
+// everything load_torrent does after mapping the file, including the info hash
+static void BM_ParseTorrent(benchmark::State& state) {
+    auto pieces = (size_t)state.range(0);
+    auto torrent = bench::make_torrent("big.bin", 16384, { pieces * 16384 });
+    bench::QuietStdout quiet;
+
+    for (auto _ : state) {
+        auto meta = parse_torrent(torrent);
+        benchmark::DoNotOptimize(meta);
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)torrent.size());
+}
+BENCHMARK(BM_ParseTorrent)->Arg(1 << 12)->Arg(1 << 16);
+
+// decode + re-encode, that it gives back the same bytes is checked by tests/BencodeTest.cpp
+static void BM_BencodeRoundTrip(benchmark::State& state) {
+    std::vector<size_t> files((size_t)state.range(0), 100000);
+    auto torrent = bench::make_torrent("many", 262144, files);
+
+    for (auto _ : state) {
+        auto encoded = bencode(BEncodeParser(torrent).parse());
+        benchmark::DoNotOptimize(encoded);
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)torrent.size());
+}
+BENCHMARK(BM_BencodeRoundTrip)->Arg(1)->Arg(1000);
+
+// encoding alone, an already parsed tree into a buffer that is reused like a resume save would
+static void BM_BencodeEncode(benchmark::State& state) {
+    std::vector<size_t> files((size_t)state.range(0), 100000);
+    auto root = BEncodeParser(bench::make_torrent("many", 262144, files)).parse();
+
+    std::string out;
+    for (auto _ : state) {
+        out.clear();
+        BEncodeWriter(out).write(root);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)out.size());
+}
+BENCHMARK(BM_BencodeEncode)->Arg(1)->Arg(1000)->Arg(10000);
+
+// compact tracker response, 6 bytes per peer
+static void BM_ParseCompactPeers(benchmark::State& state) {
+    auto count = (size_t)state.range(0);
+    BEncodeValue blob{ bench::random_bytes(count * 6, 2) };
+
+    for (auto _ : state) {
+        auto peers = parse_compact_peers(blob);
+        benchmark::DoNotOptimize(peers);
+    }
+    state.SetItemsProcessed((int64_t)state.iterations() * (int64_t)count);
+}
+BENCHMARK(BM_ParseCompactPeers)->Arg(50)->Arg(200)->Arg(2000)->Arg(10000);
+
+// "peers6", 18 bytes per peer
+static void BM_ParseCompactPeers6(benchmark::State& state) {
+    auto count = (size_t)state.range(0);
+    BEncodeValue blob{ bench::random_bytes(count * 18, 3) };
+
+    for (auto _ : state) {
+        auto peers = parse_compact_peers6(blob);
+        benchmark::DoNotOptimize(peers);
+    }
+    state.SetItemsProcessed((int64_t)state.iterations() * (int64_t)count);
+}
+BENCHMARK(BM_ParseCompactPeers6)->Arg(200)->Arg(2000)->Arg(10000);
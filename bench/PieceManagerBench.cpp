@@ -0,0 +1,421 @@
+#include <benchmark/benchmark.h>
+
+#include <BenchUtils.hpp>
+#include <PeerConnection.hpp>
+
+#include <atomic>
+#include <cstdlib>
+#include <future>
+#include <new>
+#include <numeric>
+#include <thread>
+
+// every heap allocation in the process, for the benchmarks that must not make any. all the
+// replaceable forms go through malloc/aligned_alloc and free, so any new pairs with any delete
+static std::atomic<size_t> allocations{};
+
+static void* counted_alloc(size_t size, size_t alignment = 0) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    size = size ? size : 1;
+    void* p = alignment ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) : std::malloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size) { return counted_alloc(size); }
+void* operator new[](size_t size) { return counted_alloc(size); }
+void* operator new(size_t size, std::align_val_t al) { return counted_alloc(size, (size_t)al); }
+void* operator new[](size_t size, std::align_val_t al) { return counted_alloc(size, (size_t)al); }
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+
+namespace {
+    // torrent bytes plus the metadata parsed from them, which points into the bytes
+    struct Fixture {
+        std::string data;
+        std::string torrent;
+        Metadata metadata;
+
+        Fixture(size_t piece_length, size_t num_pieces, bool with_data) {
+            auto total = piece_length * num_pieces;
+            if (with_data) data = bench::random_bytes(total, 3);
+            torrent = bench::make_torrent("bench.bin", piece_length, { total }, data);
+
+            bench::QuietStdout quiet;
+            metadata = parse_torrent(torrent);
+        }
+
+        std::vector<unsigned char> piece(size_t index) const {
+            auto begin = data.begin() + (ptrdiff_t)(index * metadata.piece_length);
+            return { begin, begin + (ptrdiff_t)metadata.piece_length };
+        }
+    };
+
+    Bitfield random_bitfield(size_t bits, uint32_t seed) {
+        std::mt19937 rng(seed);
+        Bitfield out(bits);
+        for (size_t i = 0; i < bits; ++i) if (rng() & 1) out.set(i);
+        return out;
+    }
+}
+
+// one block per piece, so every call walks further into the piece list. peers have a random
+// half of the pieces each and take turns, like a busy io thread would
+static void BM_NextBlockRequest(benchmark::State& state) {
+    auto num_pieces = (size_t)state.range(0);
+    auto num_peers = (size_t)state.range(1);
+
+    Fixture fixture(16384, num_pieces, false);
+    bench::TempDir dir;
+    auto name = (dir.path() / "bench.bin").string();
+
+    std::vector<Bitfield> bitfields;
+    for (size_t i = 0; i < num_peers; ++i) bitfields.push_back(random_bitfield(num_pieces, (uint32_t)i));
+
+    auto engine = std::make_unique<bench::Engine>(fixture.metadata, name);
+    auto now = std::chrono::steady_clock::now();
+    size_t peer{};
+
+    for (auto _ : state) {
+        auto request = engine->pm->next_block_request(bitfields[peer], now, {});
+        benchmark::DoNotOptimize(request);
+
+        // this peer has nothing left for us, start over with a fresh torrent
+        if (!request) {
+            state.PauseTiming();
+            engine.reset();
+            engine = std::make_unique<bench::Engine>(fixture.metadata, name);
+            state.ResumeTiming();
+        }
+        peer = (peer + 1) % num_peers;
+    }
+    state.SetItemsProcessed((int64_t)state.iterations());
+}
+BENCHMARK(BM_NextBlockRequest)->Args({ 1024, 1 })->Args({ 1024, 50 })->Args({ 16384, 1 })->Args({ 16384, 50 });
+
+// a whole piece arriving block by block, ending in the SHA1 check on the hash pool and the hand
+// off to the writer. no files are set up, so the writer's disk work is a no-op here, see BM_WritePiece
+static void BM_AddBlockVerify(benchmark::State& state) {
+    auto piece_length = (size_t)state.range(0);
+    const size_t num_pieces = std::max<size_t>(4, (16 << 20) / piece_length);
+
+    Fixture fixture(piece_length, num_pieces, true);
+    bench::TempDir dir;
+    auto name = (dir.path() / "bench.bin").string();
+
+    auto engine = std::make_unique<bench::Engine>(fixture.metadata, name);
+    size_t index{};
+
+    for (auto _ : state) {
+        if (index == num_pieces) {
+            state.PauseTiming();
+            engine.reset();
+            engine = std::make_unique<bench::Engine>(fixture.metadata, name);
+            index = 0;
+            state.ResumeTiming();
+        }
+
+        engine->pm->maybe_init((int)index);
+
+        auto piece = std::span(reinterpret_cast<const unsigned char*>(fixture.data.data()) + index * piece_length, piece_length);
+        for (size_t begin = 0; begin < piece_length; begin += 16384) {
+            engine->pm->add_block((int)index, (int)begin, piece.subspan(begin, 16384));
+        }
+        while (!engine->pm->is_complete((int)index)) std::this_thread::yield();
+        ++index;
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)piece_length);
+}
+BENCHMARK(BM_AddBlockVerify)->Arg(256 * 1024)->Arg(4 * 1024 * 1024)->UseRealTime();
+
+// verified pieces going out to a real file in a temp dir
+static void BM_WritePiece(benchmark::State& state) {
+    auto piece_length = (size_t)state.range(0);
+    const size_t num_pieces = std::max<size_t>(4, (16 << 20) / piece_length);
+
+    Fixture fixture(piece_length, num_pieces, true);
+    bench::TempDir dir;
+    auto path = (dir.path() / "bench.bin").string();
+
+    bench::Engine engine(fixture.metadata, path);
+    {
+        bench::QuietStdout quiet;
+        engine.pm->init_files({ TorrentFile{ path, fixture.metadata.total_size } });
+    }
+
+    std::vector<std::vector<unsigned char>> pieces;
+    for (size_t i = 0; i < num_pieces; ++i) pieces.push_back(fixture.piece(i));
+
+    size_t index{};
+    for (auto _ : state) {
+        engine.pm->write_piece((int)index, pieces[index]);
+        index = (index + 1) % num_pieces;
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)piece_length);
+}
+BENCHMARK(BM_WritePiece)->Arg(256 * 1024)->Arg(4 * 1024 * 1024);
+
+// the writer catching up on a backlog: 16 MiB of verified pieces, completed in random order while
+// the disk pool was busy, from the moment it's free until the last one is on disk
+static void BM_FlushCompleted(benchmark::State& state) {
+    auto piece_length = (size_t)state.range(0);
+    const size_t num_pieces = (16 << 20) / piece_length;
+
+    Fixture fixture(piece_length, num_pieces, true);
+    bench::TempDir dir;
+    auto path = (dir.path() / "bench.bin").string();
+
+    std::vector<int> order(num_pieces);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), std::mt19937(5));
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto engine = std::make_unique<bench::Engine>(fixture.metadata, path);
+        {
+            bench::QuietStdout quiet;
+            engine->pm->init_files({ TorrentFile{ path, fixture.metadata.total_size } });
+        }
+
+        std::promise<void> busy;
+        engine->disk_pool.post([done = busy.get_future().share()] { done.wait(); });
+        for (auto index : order) {
+            engine->pm->maybe_init(index);
+            auto piece = std::span(reinterpret_cast<const unsigned char*>(fixture.data.data()) + (size_t)index * piece_length, piece_length);
+            for (size_t begin = 0; begin < piece_length; begin += 16384) engine->pm->add_block(index, (int)begin, piece.subspan(begin, 16384));
+        }
+        for (auto index : order)
+            while (!engine->pm->is_complete(index)) std::this_thread::yield();
+        state.ResumeTiming();
+
+        busy.set_value();
+        for (size_t i = 0; i < num_pieces; ++i) engine->pm->wait_for_piece((int)i, std::chrono::seconds(10));
+
+        state.PauseTiming();
+        engine.reset();
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)(num_pieces * piece_length));
+}
+BENCHMARK(BM_FlushCompleted)->Arg(16 * 1024)->Arg(256 * 1024)->UseRealTime();
+
+// serving 16 KiB blocks to peers, mostly out of the page cache
+static void BM_FetchBlock(benchmark::State& state) {
+    const size_t piece_length = 256 * 1024;
+    const size_t num_pieces = 64;
+
+    Fixture fixture(piece_length, num_pieces, true);
+    bench::TempDir dir;
+    auto path = (dir.path() / "bench.bin").string();
+
+    bench::Engine engine(fixture.metadata, path);
+    {
+        bench::QuietStdout quiet;
+        engine.pm->init_files({ TorrentFile{ path, fixture.metadata.total_size } });
+    }
+    for (size_t i = 0; i < num_pieces; ++i) engine.pm->write_piece((int)i, fixture.piece(i));
+
+    const size_t blocks = num_pieces * piece_length / 16384;
+    size_t block{};
+
+    for (auto _ : state) {
+        auto offset = block * 16384;
+        auto data = engine.pm->fetch_block((uint32_t)(offset / piece_length), (uint32_t)(offset % piece_length), 16384);
+        benchmark::DoNotOptimize(data);
+        block = (block + 1) % blocks;
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * 16384);
+}
+BENCHMARK(BM_FetchBlock);
+
+// decoding a peer's BITFIELD message
+static void BM_SetBitfield(benchmark::State& state) {
+    auto num_pieces = (size_t)state.range(0);
+
+    Fixture fixture(16384, num_pieces, false);
+    bench::TempDir dir;
+    bench::Engine engine(fixture.metadata, (dir.path() / "bench.bin").string());
+
+    // a random payload with the spare bits at the end left clear, as the protocol requires
+    auto raw = bench::random_bytes((num_pieces + 7) / 8, 4);
+    std::vector<unsigned char> payload(raw.begin(), raw.end());
+    if (num_pieces % 8) payload.back() &= (unsigned char)(0xFF << (8 - num_pieces % 8));
+
+    boost::asio::io_context io;
+    auto conn = std::make_shared<PeerConnection>(io, Peer(boost::asio::ip::make_address("127.0.0.1"), 6881),
+                                                 fixture.metadata.info_hash, "-CT0001-benchbenchbe", engine.pm.get());
+
+    for (auto _ : state) {
+        conn->set_bitfield(payload);
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)payload.size());
+}
+BENCHMARK(BM_SetBitfield)->Arg(1024)->Arg(1 << 16)->Arg(1 << 20);
+
+// what decides interest on every BITFIELD: how many of the peer's pieces we still want
+static void BM_CountNeeded(benchmark::State& state) {
+    auto num_pieces = (size_t)state.range(0);
+
+    Fixture fixture(16384, num_pieces, false);
+    bench::TempDir dir;
+    bench::Engine engine(fixture.metadata, (dir.path() / "bench.bin").string());
+
+    auto peer = random_bitfield(num_pieces, 5);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(engine.pm->count_needed(peer));
+    }
+    state.SetItemsProcessed((int64_t)state.iterations() * (int64_t)num_pieces);
+}
+BENCHMARK(BM_CountNeeded)->Arg(1024)->Arg(1 << 20);
+
+namespace {
+    // our PeerConnections over loopback, each with a plain socket on the far end that the
+    // benchmark drives synchronously while an io thread runs the connections
+    struct LoopbackPeers {
+        boost::asio::io_context io;
+        boost::asio::io_context remote_io;
+        std::vector<tcp::socket> remotes;
+        std::vector<std::shared_ptr<PeerConnection>> conns;
+        std::thread io_thread;
+        std::vector<uint8_t> in;
+
+        LoopbackPeers(const Metadata& metadata, PieceManager& pm, size_t count) {
+            tcp::acceptor acceptor(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+
+            // the handshake the session would have read off the socket before handing it over
+            std::array<char, 68> handshake{};
+            handshake[0] = 19;
+            std::memcpy(&handshake[1], "BitTorrent protocol", 19);
+            std::memcpy(&handshake[28], metadata.info_hash.data(), 20);
+            std::memcpy(&handshake[48], "-XX0001-remoteremote", 20);
+
+            for (size_t i = 0; i < count; ++i) {
+                // room for a whole round's answer, the far ends are drained one after another
+                auto& remote = remotes.emplace_back(remote_io);
+                remote.open(tcp::v4());
+                remote.set_option(boost::asio::socket_base::receive_buffer_size(1 << 20));
+                remote.connect(acceptor.local_endpoint());
+                conns.push_back(std::make_shared<PeerConnection>(PeerSocket(acceptor.accept()), handshake, metadata.info_hash,
+                                                                 "-CT0001-benchbenchbe", &pm));
+                conns.back()->start();
+            }
+            io_thread = std::thread([this] { io.run(); });
+
+            // their handshake back
+            in.resize(68);
+            for (auto& remote : remotes) boost::asio::read(remote, boost::asio::buffer(in));
+        }
+
+        ~LoopbackPeers() {
+            boost::asio::post(io, [this] { for (auto& conn : conns) conn->stop(); });
+            io_thread.join();
+        }
+
+        // messages from the connection, up to and including one with this id. returns how many
+        size_t read_until(tcp::socket& remote, uint8_t id) {
+            for (size_t count = 1;; ++count) {
+                std::array<uint8_t, 4> length{};
+                boost::asio::read(remote, boost::asio::buffer(length));
+                in.resize(boost::endian::load_big_u32(length.data()));
+                boost::asio::read(remote, boost::asio::buffer(in));
+                if (!in.empty() && in[0] == id) return count;
+            }
+        }
+    };
+}
+
+// connected peers, each sent batches of HAVEs closed by an INTERESTED whose UNCHOKE answer ends
+// its round. what a small message costs in the connections' read loops, syscalls included, and
+// what the connections allocate once they're warm (should be nothing)
+static void BM_PeerMessages(benchmark::State& state) {
+    auto batch = (size_t)state.range(0);
+    auto num_peers = (size_t)state.range(1);
+
+    Fixture fixture(16384, 1024, false);
+    bench::TempDir dir;
+    bench::Engine engine(fixture.metadata, (dir.path() / "bench.bin").string());
+    LoopbackPeers peers(fixture.metadata, *engine.pm, num_peers);
+
+    std::vector<uint8_t> out(batch * 9 + 5);
+    for (size_t i = 0; i < batch; ++i) {
+        boost::endian::store_big_u32(&out[i * 9], 5);
+        out[i * 9 + 4] = 4;                                     // HAVE
+        boost::endian::store_big_u32(&out[i * 9 + 5], (uint32_t)(i % 1024));
+    }
+    boost::endian::store_big_u32(&out[batch * 9], 1);
+    out[batch * 9 + 4] = 2;                                     // INTERESTED
+
+    auto round = [&] {
+        for (auto& remote : peers.remotes) boost::asio::write(remote, boost::asio::buffer(out));
+        for (auto& remote : peers.remotes) peers.read_until(remote, 1);    // UNCHOKE
+    };
+
+    // a few rounds to warm the buffers and caches up, steady state is what counts
+    for (int i = 0; i < 16; ++i) round();
+
+    auto allocated = allocations.load();
+    for (auto _ : state) round();
+    state.SetItemsProcessed((int64_t)state.iterations() * (int64_t)((batch + 1) * num_peers));
+    state.counters["allocs_per_round"] = benchmark::Counter((double)(allocations.load() - allocated) / (double)state.iterations());
+}
+BENCHMARK(BM_PeerMessages)->Args({ 1, 1 })->Args({ 64, 1 })->Args({ 1024, 1 })->Args({ 64, 8 })->UseRealTime();
+
+// serving: a piece's worth of 16 KiB REQUESTs per round and peer, answered from the page cache
+static void BM_PeerUploads(benchmark::State& state) {
+    const size_t piece_length = 256 * 1024;
+    const size_t num_pieces = 16;
+    auto num_peers = (size_t)state.range(0);
+
+    Fixture fixture(piece_length, num_pieces, true);
+    bench::TempDir dir;
+    auto path = (dir.path() / "bench.bin").string();
+    bench::Engine engine(fixture.metadata, path);
+    {
+        bench::QuietStdout quiet;
+        engine.pm->init_files({ TorrentFile{ path, fixture.metadata.total_size } });
+    }
+    for (size_t i = 0; i < num_pieces; ++i) engine.pm->write_piece((int)i, fixture.piece(i));
+
+    LoopbackPeers peers(fixture.metadata, *engine.pm, num_peers);
+
+    // INTERESTED first, the UNCHOKE it gets back is the last thing before the PIECEs
+    std::array<uint8_t, 5> interested{ 0, 0, 0, 1, 2 };
+    for (auto& remote : peers.remotes) {
+        boost::asio::write(remote, boost::asio::buffer(interested));
+        peers.read_until(remote, 1);
+    }
+
+    const size_t blocks = piece_length / 16384;
+    std::vector<uint8_t> out(blocks * 17);
+    size_t piece{};
+    auto round = [&] {
+        for (size_t i = 0; i < blocks; ++i) {
+            boost::endian::store_big_u32(&out[i * 17], 13);
+            out[i * 17 + 4] = 6;                                // REQUEST
+            boost::endian::store_big_u32(&out[i * 17 + 5], (uint32_t)piece);
+            boost::endian::store_big_u32(&out[i * 17 + 9], (uint32_t)(i * 16384));
+            boost::endian::store_big_u32(&out[i * 17 + 13], 16384);
+        }
+        piece = (piece + 1) % num_pieces;
+
+        for (auto& remote : peers.remotes) boost::asio::write(remote, boost::asio::buffer(out));
+        for (auto& remote : peers.remotes)
+            for (size_t i = 0; i < blocks; ++i) peers.read_until(remote, 7);   // PIECE
+    };
+
+    for (int i = 0; i < 16; ++i) round();
+
+    auto allocated = allocations.load();
+    for (auto _ : state) round();
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)(piece_length * num_peers));
+    state.counters["allocs_per_block"] = benchmark::Counter((double)(allocations.load() - allocated) / (double)(state.iterations() * blocks * num_peers));
+}
+BENCHMARK(BM_PeerUploads)->Arg(1)->Arg(4)->UseRealTime();
@@ -0,0 +1,770 @@
+// loopback swarm simulator: a mock tracker, N seeding and M leeching sessions in one process,
+// every peer listener fronted by a userspace link shaper that adds latency and caps bandwidth.
+//
+//   ctorrent_swarm [--seeders=N] [--leechers=M] [--size=<MiB>] [--piece=<KiB>] [--latency=<ms>]
+//                  [--bandwidth=<KiB/s>] [--tracker=http|udp|dht|lsd] [--transport=tcp|utp] [--tracker-peers=N]
+//                  [--magnet] [--timeout=<s>] [--json]
+//
+// --tracker=dht points the torrent at a dead tracker and lets the sessions find each other through
+// their DHT nodes, bootstrapped off one extra node. DHT peers dial the sessions directly, so the
+// link shapers only see traffic in the tracker modes. --tracker=lsd does the same with local service
+// discovery, the sessions multicast their announces to each other on this host.
+// --transport=utp lets the peers connect over uTP, the shapers relay their datagrams on the same
+// port number through the same kind of link.
+// --tracker-peers caps how many peers an announce returns, the rest of the swarm has to come through
+// PEX. peers learned from an inbound connection's listen port are dialed directly, like DHT peers.
+// --magnet starts the leechers from a magnet link, so their time to complete includes fetching the
+// info dictionary from the swarm, reported separately as the time to metadata
+
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/endian/conversion.hpp>
+
+#include <sys/resource.h>
+
+#include <deque>
+#include <format>
+#include <fstream>
+#include <future>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <set>
+#include <thread>
+
+#include <BenchUtils.hpp>
+#include <Session.hpp>
+
+namespace beast = boost::beast;
+namespace http  = beast::http;
+using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+
+namespace {
+
+struct SwarmOptions {
+    size_t seeders{ 2 };
+    size_t leechers{ 4 };
+    size_t size_mib{ 64 };
+    size_t piece_kib{ 256 };
+    std::chrono::milliseconds latency{ 0 };
+    size_t bandwidth_kib{ 0 };          // per link and direction, 0 is unlimited
+    bool udp_tracker{ false };
+    bool dht{ false };
+    bool lsd{ false };
+    bool utp{ false };
+    size_t tracker_peers{ 0 };          // most peers one announce returns, 0 is everyone
+    bool magnet{ false };               // leechers start without the info dictionary
+    std::chrono::seconds timeout{ 300 };
+    bool json{ false };
+};
+
+// -- mock tracker --
+
+// remembers who announced and hands everyone else's shaped port back, http and udp flavours
+class MockTracker {
+public:
+    // maps a session's real listen port to the port other peers should dial
+    using Advertise = std::function<uint16_t(uint16_t)>;
+
+    MockTracker(boost::asio::io_context& io, Advertise advertise, size_t max_peers)
+        : io_(io), advertise_(std::move(advertise)), max_peers_(max_peers),
+          http_acceptor_(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+          udp_socket_(io, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)) {}
+
+    void start() {
+        accept_http();
+        receive_udp();
+    }
+
+    std::string http_url() const { return std::format("http://127.0.0.1:{}/announce", http_acceptor_.local_endpoint().port()); }
+    std::string udp_url() const { return std::format("udp://127.0.0.1:{}", udp_socket_.local_endpoint().port()); }
+
+    size_t peer_count(const std::string& info_hash) {
+        std::scoped_lock<std::mutex> lock(mutex_);
+        auto it = swarms_.find(info_hash);
+        return it == swarms_.end() ? 0 : it->second.size();
+    }
+
+private:
+    // registers the announcing peer and returns the others as compact peers
+    std::string announce(const std::string& info_hash, uint16_t port) {
+        std::scoped_lock<std::mutex> lock(mutex_);
+        auto& swarm = swarms_[info_hash];
+
+        std::string compact;
+        size_t count{};
+        for (auto other : swarm) {
+            if (other == port) continue;
+            if (max_peers_ && count++ == max_peers_) break;
+            auto advertised = advertise_(other);
+            compact += std::string{ 127, 0, 0, 1 };
+            compact += (char)(advertised >> 8);
+            compact += (char)(advertised & 0xFF);
+        }
+        swarm.insert(port);
+        return compact;
+    }
+
+    static std::string percent_decode(std::string_view in) {
+        std::string out;
+        for (size_t i = 0; i < in.size(); ++i) {
+            if (in[i] == '%' && i + 2 < in.size()) {
+                out += (char)std::stoi(std::string(in.substr(i + 1, 2)), nullptr, 16);
+                i += 2;
+            }
+            else out += in[i];
+        }
+        return out;
+    }
+
+    void accept_http() {
+        http_acceptor_.async_accept([this](boost::system::error_code ec, tcp::socket socket) {
+            if (ec == boost::asio::error::operation_aborted) return;
+            if (!ec) serve_http(std::make_shared<tcp::socket>(std::move(socket)));
+            accept_http();
+        });
+    }
+
+    void serve_http(std::shared_ptr<tcp::socket> socket) {
+        auto buffer = std::make_shared<beast::flat_buffer>();
+        auto req = std::make_shared<http::request<http::empty_body>>();
+
+        http::async_read(*socket, *buffer, *req, [this, socket, buffer, req](beast::error_code ec, size_t) {
+            if (ec) return;
+
+            // the client sends the info hash percent encoded and the peer id raw
+            std::string_view target(req->target().data(), req->target().size());
+            std::string info_hash;
+            uint16_t port{};
+
+            auto query = target.substr(std::min(target.find('?') + 1, target.size()));
+            while (!query.empty()) {
+                auto amp = query.find('&');
+                auto pair = query.substr(0, amp);
+                query = amp == std::string_view::npos ? std::string_view{} : query.substr(amp + 1);
+
+                auto eq = pair.find('=');
+                if (eq == std::string_view::npos) continue;
+                auto key = pair.substr(0, eq);
+                auto value = pair.substr(eq + 1);
+
+                if (key == "info_hash") info_hash = percent_decode(value);
+                else if (key == "port") port = (uint16_t)std::stoi(std::string(value));
+            }
+
+            BEncodeValue::Dict body;
+            body["interval"] = BEncodeValue{ (int64_t)1800 };
+            body["peers"] = BEncodeValue{ announce(info_hash, port) };
+
+            auto res = std::make_shared<http::response<http::string_body>>(http::status::ok, req->version());
+            res->body() = bencode(BEncodeValue{ std::move(body) });
+            res->keep_alive(false);
+            res->prepare_payload();
+
+            http::async_write(*socket, *res, [socket, res](beast::error_code ec, size_t) {
+                socket->shutdown(tcp::socket::shutdown_both, ec);
+            });
+        });
+    }
+
+    // BEP 15, connect and announce only
+    void receive_udp() {
+        udp_socket_.async_receive_from(boost::asio::buffer(udp_buf_), udp_sender_, [this](boost::system::error_code ec, size_t len) {
+            if (ec == boost::asio::error::operation_aborted) return;
+            if (!ec && len >= 16) handle_udp(len);
+            receive_udp();
+        });
+    }
+
+    void handle_udp(size_t len) {
+        auto be32 = [&](size_t at) { return boost::endian::load_big_u32(udp_buf_.data() + at); };
+        uint32_t action = be32(8);
+        uint32_t tx = be32(12);
+
+        auto reply = std::make_shared<std::vector<unsigned char>>();
+        auto put32 = [&](uint32_t v) { for (int s = 24; s >= 0; s -= 8) reply->push_back((unsigned char)(v >> s)); };
+
+        if (action == 0) {
+            put32(0); put32(tx);
+            put32(0x5157494d); put32(0x4d4f434b);    // any connection id will do
+        }
+        else if (action == 1 && len >= 98) {
+            std::string info_hash(reinterpret_cast<const char*>(udp_buf_.data() + 16), 20);
+            uint16_t port = boost::endian::load_big_u16(udp_buf_.data() + 96);
+
+            auto peers = announce(info_hash, port);
+            put32(1); put32(tx); put32(1800); put32(0); put32(0);
+            reply->insert(reply->end(), peers.begin(), peers.end());
+        }
+        else return;
+
+        udp_socket_.async_send_to(boost::asio::buffer(*reply), udp_sender_, [reply](boost::system::error_code, size_t) {});
+    }
+
+    boost::asio::io_context& io_;
+    Advertise advertise_;
+    size_t max_peers_;
+
+    tcp::acceptor http_acceptor_;
+    udp::socket udp_socket_;
+    udp::endpoint udp_sender_;
+    std::array<unsigned char, 1500> udp_buf_{};
+
+    std::mutex mutex_;
+    std::map<std::string, std::set<uint16_t>> swarms_;
+};
+
+// -- link shaping --
+
+// one direction of a shaped connection. every chunk read leaves the sender no earlier than
+// the link is free again (bandwidth) and is delivered `latency` after that
+class Pipe : public std::enable_shared_from_this<Pipe> {
+public:
+    Pipe(tcp::socket& from, tcp::socket& to, std::chrono::milliseconds latency, size_t bytes_per_sec)
+        : from_(from), to_(to), timer_(from.get_executor()), latency_(latency), bytes_per_sec_(bytes_per_sec) {}
+
+    void start() { read(); }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct Chunk {
+        clock::time_point deliver_at;
+        std::vector<char> data;
+    };
+
+    // stop reading once this much is in flight on the link, like a socket buffer would
+    static constexpr size_t max_queued_ = 1 << 20;
+
+    void read() {
+        if (reading_ || eof_ || queued_ >= max_queued_) return;
+        reading_ = true;
+
+        auto self = shared_from_this();
+        from_.async_read_some(boost::asio::buffer(buf_), [self](boost::system::error_code ec, size_t len) {
+            self->reading_ = false;
+            if (ec) {
+                self->eof_ = true;
+                if (self->queue_.empty() && !self->writing_) self->finish();
+                return;
+            }
+            self->enqueue(len);
+            self->read();
+        });
+    }
+
+    void enqueue(size_t len) {
+        auto now = clock::now();
+        auto depart = std::max(now, link_free_at_);
+        if (bytes_per_sec_) {
+            depart += std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>((double)len / (double)bytes_per_sec_));
+        }
+        link_free_at_ = depart;
+
+        queue_.push_back({ depart + latency_, std::vector<char>(buf_.begin(), buf_.begin() + len) });
+        queued_ += len;
+        if (!writing_) write_next();
+    }
+
+    void write_next() {
+        if (queue_.empty()) {
+            writing_ = false;
+            if (eof_) finish();
+            return;
+        }
+        writing_ = true;
+
+        auto self = shared_from_this();
+        timer_.expires_at(queue_.front().deliver_at);
+        timer_.async_wait([self](boost::system::error_code ec) {
+            if (ec) return;
+            boost::asio::async_write(self->to_, boost::asio::buffer(self->queue_.front().data), [self](boost::system::error_code ec, size_t len) {
+                if (ec) {
+                    self->abort();
+                    return;
+                }
+                self->queued_ -= len;
+                self->queue_.pop_front();
+                self->write_next();
+                self->read();
+            });
+        });
+    }
+
+    // sender is done and everything it sent is delivered, pass the half close on
+    void finish() {
+        boost::system::error_code ec;
+        to_.shutdown(tcp::socket::shutdown_send, ec);
+    }
+
+    void abort() {
+        boost::system::error_code ec;
+        from_.close(ec);
+        to_.close(ec);
+    }
+
+    tcp::socket& from_;
+    tcp::socket& to_;
+    boost::asio::steady_timer timer_;
+    std::chrono::milliseconds latency_;
+    size_t bytes_per_sec_;
+
+    std::array<char, 16384> buf_{};
+    std::deque<Chunk> queue_;
+    size_t queued_{};
+    clock::time_point link_free_at_{};
+    bool reading_{ false }, writing_{ false }, eof_{ false };
+};
+
+// one direction of a shaped datagram flow, the same link model as Pipe. a full queue drops
+// instead of pushing back, the way a router's would
+class DatagramPipe {
+public:
+    using Deliver = std::function<void(const std::vector<uint8_t>&)>;
+
+    DatagramPipe(boost::asio::io_context& io, std::chrono::milliseconds latency, size_t bytes_per_sec, Deliver deliver)
+        : timer_(io), latency_(latency), bytes_per_sec_(bytes_per_sec), deliver_(std::move(deliver)) {}
+
+    void push(std::span<const uint8_t> packet) {
+        if (queued_ + packet.size() > max_queued_) return;
+
+        auto now = clock::now();
+        auto depart = std::max(now, link_free_at_);
+        if (bytes_per_sec_) {
+            depart += std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>((double)packet.size() / (double)bytes_per_sec_));
+        }
+        link_free_at_ = depart;
+
+        queue_.push_back({ depart + latency_, std::vector<uint8_t>(packet.begin(), packet.end()) });
+        queued_ += packet.size();
+        if (!waiting_) next();
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct Datagram {
+        clock::time_point deliver_at;
+        std::vector<uint8_t> data;
+    };
+
+    static constexpr size_t max_queued_ = 256 << 10;
+
+    void next() {
+        if (queue_.empty()) {
+            waiting_ = false;
+            return;
+        }
+        waiting_ = true;
+
+        timer_.expires_at(queue_.front().deliver_at);
+        timer_.async_wait([this](boost::system::error_code ec) {
+            if (ec) return;
+            // everything that's due goes at once, the timer only paces what isn't
+            auto now = clock::now();
+            while (!queue_.empty() && queue_.front().deliver_at <= now) {
+                deliver_(queue_.front().data);
+                queued_ -= queue_.front().data.size();
+                queue_.pop_front();
+            }
+            next();
+        });
+    }
+
+    boost::asio::steady_timer timer_;
+    std::chrono::milliseconds latency_;
+    size_t bytes_per_sec_;
+    Deliver deliver_;
+
+    std::deque<Datagram> queue_;
+    size_t queued_{};
+    clock::time_point link_free_at_{};
+    bool waiting_{ false };
+};
+
+// listens on its own port and relays every connection to `target` through a pair of pipes.
+// datagrams to the same port number get a flow per sender, relayed from a socket of its own
+class LinkShaper {
+public:
+    LinkShaper(boost::asio::io_context& io, uint16_t target, std::chrono::milliseconds latency, size_t bytes_per_sec)
+        : io_(io), acceptor_(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+          udp_(io, udp::endpoint(boost::asio::ip::address_v4::loopback(), acceptor_.local_endpoint().port())),
+          target_(target), latency_(latency), bytes_per_sec_(bytes_per_sec) {}
+
+    uint16_t port() const { return acceptor_.local_endpoint().port(); }
+
+    void start() {
+        accept();
+        receive();
+    }
+
+private:
+    struct Flow {
+        explicit Flow(boost::asio::io_context& io) : upstream(io, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)) {}
+
+        udp::socket upstream;
+        std::unique_ptr<DatagramPipe> up, down;
+        std::array<uint8_t, 2048> buf{};
+    };
+
+    void accept() {
+        acceptor_.async_accept([this](boost::system::error_code ec, tcp::socket socket) {
+            if (ec == boost::asio::error::operation_aborted) return;
+            if (!ec) relay(std::move(socket));
+            accept();
+        });
+    }
+
+    void receive() {
+        udp_.async_receive_from(boost::asio::buffer(udp_buf_), udp_from_, [this](boost::system::error_code ec, size_t len) {
+            if (ec == boost::asio::error::operation_aborted) return;
+            if (!ec) flow(udp_from_).up->push({ udp_buf_.data(), len });
+            receive();
+        });
+    }
+
+    Flow& flow(const udp::endpoint& client) {
+        auto& flow = flows_[client];
+        if (flow) return *flow;
+
+        flow = std::make_unique<Flow>(io_);
+        auto* f = flow.get();
+        udp::endpoint target(boost::asio::ip::address_v4::loopback(), target_);
+
+        f->up = std::make_unique<DatagramPipe>(io_, latency_, bytes_per_sec_, [f, target](const std::vector<uint8_t>& data) {
+            boost::system::error_code ignored;
+            f->upstream.send_to(boost::asio::buffer(data), target, 0, ignored);
+        });
+        f->down = std::make_unique<DatagramPipe>(io_, latency_, bytes_per_sec_, [this, client](const std::vector<uint8_t>& data) {
+            boost::system::error_code ignored;
+            udp_.send_to(boost::asio::buffer(data), client, 0, ignored);
+        });
+        receive_upstream(*f);
+        return *f;
+    }
+
+    void receive_upstream(Flow& f) {
+        f.upstream.async_receive(boost::asio::buffer(f.buf), [this, &f](boost::system::error_code ec, size_t len) {
+            if (ec == boost::asio::error::operation_aborted) return;
+            if (!ec) f.down->push({ f.buf.data(), len });
+            receive_upstream(f);
+        });
+    }
+
+    struct Link {
+        tcp::socket inbound, outbound;
+        std::shared_ptr<Pipe> up, down;
+    };
+
+    void relay(tcp::socket socket) {
+        auto link = std::make_shared<Link>(Link{ .inbound = std::move(socket), .outbound = tcp::socket(io_), .up = {}, .down = {} });
+
+        link->outbound.async_connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), target_),
+            [this, link](boost::system::error_code ec) {
+                if (ec) return;
+                boost::system::error_code ignored;
+                link->inbound.set_option(tcp::no_delay(true), ignored);
+                link->outbound.set_option(tcp::no_delay(true), ignored);
+
+                // the pipes reference the sockets, the handlers below keep the link alive
+                link->up = std::make_shared<Pipe>(link->inbound, link->outbound, latency_, bytes_per_sec_);
+                link->down = std::make_shared<Pipe>(link->outbound, link->inbound, latency_, bytes_per_sec_);
+                links_.push_back(link);
+                link->up->start();
+                link->down->start();
+            });
+    }
+
+    boost::asio::io_context& io_;
+    tcp::acceptor acceptor_;
+    udp::socket udp_;
+    uint16_t target_;
+    std::chrono::milliseconds latency_;
+    size_t bytes_per_sec_;
+    std::vector<std::shared_ptr<Link>> links_;
+
+    std::array<uint8_t, 2048> udp_buf_{};
+    udp::endpoint udp_from_;
+    std::map<udp::endpoint, std::unique_ptr<Flow>> flows_;
+};
+
+// -- engines --
+
+struct Engine {
+    bench::TempDir dir;
+    std::unique_ptr<Session> session;
+    std::shared_ptr<Torrent> torrent;
+    std::unique_ptr<LinkShaper> shaper;
+    std::thread thread;
+
+    std::chrono::steady_clock::time_point started, finished, got_metadata;
+    bool done{ false };
+    bool has_metadata{ false };
+
+    ~Engine() { stop(); }
+
+    bool complete() {
+        auto& stats = torrent->stats();
+        return !stats.checking.load() && !stats.fetching_metadata.load() && stats.completed_pieces.load() >= stats.total_pieces.load();
+    }
+
+    void stop() {
+        if (!session) return;
+        session->stop();
+        if (thread.joinable()) thread.join();
+        torrent.reset();
+        session.reset();
+    }
+};
+
+double cpu_seconds() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6 +
+           (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+}
+
+size_t peak_rss_kib() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return (size_t)usage.ru_maxrss;
+}
+
+bool parse_args(int argc, char* argv[], SwarmOptions& o) {
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        auto value = [&](size_t prefix) { return (size_t)std::stoull(std::string(arg.substr(prefix))); };
+
+        if (arg.starts_with("--seeders=")) o.seeders = value(10);
+        else if (arg.starts_with("--leechers=")) o.leechers = value(11);
+        else if (arg.starts_with("--size=")) o.size_mib = value(7);
+        else if (arg.starts_with("--piece=")) o.piece_kib = value(8);
+        else if (arg.starts_with("--latency=")) o.latency = std::chrono::milliseconds(value(10));
+        else if (arg.starts_with("--bandwidth=")) o.bandwidth_kib = value(12);
+        else if (arg == "--tracker=http") o.udp_tracker = false;
+        else if (arg == "--tracker=udp") o.udp_tracker = true;
+        else if (arg == "--tracker=dht") o.dht = true;
+        else if (arg == "--tracker=lsd") o.lsd = true;
+        else if (arg == "--transport=tcp") o.utp = false;
+        else if (arg == "--transport=utp") o.utp = true;
+        else if (arg.starts_with("--tracker-peers=")) o.tracker_peers = value(16);
+        else if (arg.starts_with("--timeout=")) o.timeout = std::chrono::seconds(value(10));
+        else if (arg == "--magnet") o.magnet = true;
+        else if (arg == "--json") o.json = true;
+        else return false;
+    }
+    return o.seeders > 0 && o.leechers > 0 && o.size_mib > 0 && o.piece_kib >= 16;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    SwarmOptions o;
+    if (!parse_args(argc, argv, o)) {
+        std::cerr << "Usage: " << argv[0] << " [--seeders=N] [--leechers=M] [--size=<MiB>] [--piece=<KiB>] [--latency=<ms>]"
+                     " [--bandwidth=<KiB/s>] [--tracker=http|udp|dht|lsd] [--transport=tcp|utp] [--tracker-peers=N]"
+                     " [--magnet] [--timeout=<s>] [--json]\n";
+        return 1;
+    }
+
+    // the sessions chat on stdout, keep it for the results. progress goes to stderr
+    std::optional<bench::QuietStdout> quiet;
+    quiet.emplace();
+
+    // tracker and shapers share one io thread, the sessions each get their own
+    boost::asio::io_context net;
+    std::map<uint16_t, uint16_t> shaped_ports;  // session port -> shaper port, filled before anyone announces
+    std::mutex shaped_mutex;
+
+    MockTracker tracker(net, [&](uint16_t port) {
+        std::scoped_lock<std::mutex> lock(shaped_mutex);
+        auto it = shaped_ports.find(port);
+        return it == shaped_ports.end() ? port : it->second;
+    }, o.tracker_peers);
+    tracker.start();
+
+    // every session's DHT node bootstraps off this one, which also ends up storing the announces
+    std::unique_ptr<UdpSocket> router_socket;
+    std::unique_ptr<Dht> router;
+    if (o.dht) {
+        router_socket = std::make_unique<UdpSocket>(net, 0);
+        router = std::make_unique<Dht>(net, *router_socket, DhtOptions{});
+        router->start();
+        router_socket->start();
+    }
+    auto router_peers = [&](const NodeId& info_hash) {
+        std::promise<size_t> count;
+        boost::asio::post(net, [&] { count.set_value(router->stored_peers(info_hash)); });
+        return count.get_future().get();
+    };
+
+    auto work = boost::asio::make_work_guard(net);
+    std::thread net_thread([&] { net.run(); });
+
+    // the synthetic torrent, same bytes every run
+    size_t total = o.size_mib << 20;
+    auto data = bench::random_bytes(total, 5);
+    auto announce_url = o.dht || o.lsd ? std::string("http://127.0.0.1:1/announce") : o.udp_tracker ? tracker.udp_url() : tracker.http_url();
+    auto torrent_bytes = bench::make_torrent("swarm.bin", o.piece_kib << 10, { total }, data, announce_url);
+
+    auto metadata = parse_torrent(torrent_bytes);
+    std::string info_hash(reinterpret_cast<const char*>(metadata.info_hash.data()), 20);
+
+    std::string magnet_uri = "magnet:?xt=urn:btih:";
+    for (auto byte : metadata.info_hash) magnet_uri += std::format("{:02x}", (unsigned)byte);
+    magnet_uri += "&dn=swarm.bin&tr=" + announce_url;
+
+    auto launch = [&](size_t index, bool seeder) {
+        auto engine = std::make_unique<Engine>();
+
+        if (seeder) std::ofstream(engine->dir.path() / "swarm.bin", std::ios::binary).write(data.data(), (std::streamsize)data.size());
+
+        SessionOptions so;
+        so.listen_port = 0;
+        so.peer_id = std::format("-CT0001-{:012}", index);
+        so.disk_threads = 1;
+        so.tracker_threads = 1;
+        so.utp = o.utp;
+        so.dht = o.dht;
+        so.lsd = o.lsd;
+        so.dht_state.clear();
+        if (router) so.dht_bootstrap = { std::format("127.0.0.1:{}", router->port()) };
+
+        TorrentOptions to;
+        to.save_path = engine->dir.path();
+
+        engine->session = std::make_unique<Session>(so);
+
+        engine->shaper = std::make_unique<LinkShaper>(net, engine->session->listen_port(), o.latency, o.bandwidth_kib << 10);
+        {
+            std::scoped_lock<std::mutex> lock(shaped_mutex);
+            shaped_ports[engine->session->listen_port()] = engine->shaper->port();
+        }
+        boost::asio::post(net, [shaper = engine->shaper.get()] { shaper->start(); });
+
+        // seeders hash their copy in here, before they announce
+        engine->torrent = engine->session->add_torrent(seeder || !o.magnet ? metadata : parse_magnet(magnet_uri), to);
+        engine->started = std::chrono::steady_clock::now();
+        engine->thread = std::thread([session = engine->session.get()] { session->run(); });
+        return engine;
+    };
+
+    auto wait_for = [&](auto done, std::chrono::seconds limit) {
+        auto deadline = std::chrono::steady_clock::now() + limit;
+        while (!done()) {
+            if (std::chrono::steady_clock::now() > deadline) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        return true;
+    };
+
+    std::vector<std::unique_ptr<Engine>> seeders, leechers;
+    std::cerr << std::format("swarm: {} seeders, {} leechers, {} MiB in {} KiB pieces, latency {} ms, bandwidth {}, {} tracker, {}{}\n",
+        o.seeders, o.leechers, o.size_mib, o.piece_kib, o.latency.count(),
+        o.bandwidth_kib ? std::format("{} KiB/s", o.bandwidth_kib) : std::string("unlimited"), o.dht ? "dht" : o.lsd ? "lsd" : o.udp_tracker ? "udp" : "http",
+        o.utp ? "utp" : "tcp", o.magnet ? ", magnet" : "");
+
+    for (size_t i = 0; i < o.seeders; ++i) seeders.push_back(launch(i, true));
+
+    // leechers only announce once, so the seeders have to be known to the tracker (or the DHT) first
+    bool seeded = wait_for([&] {
+        // nobody keeps track of LSD announces, the leechers hear the seeders' next ones or get dialed by them
+        auto announced = o.dht ? router_peers(metadata.info_hash) : o.lsd ? o.seeders : tracker.peer_count(info_hash);
+        return std::ranges::all_of(seeders, [](auto& e) { return e->complete(); }) && announced >= o.seeders;
+    }, std::chrono::seconds(60));
+
+    auto shutdown = [&] {
+        for (auto& e : leechers) e->stop();
+        for (auto& e : seeders) e->stop();
+        work.reset();
+        net.stop();
+        net_thread.join();
+        if (router) router->stop();
+        if (router_socket) router_socket->close();
+        quiet.reset();
+    };
+
+    if (!seeded) {
+        shutdown();
+        std::cerr << "seeders never came up\n";
+        return 1;
+    }
+
+    auto cpu_before = cpu_seconds();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < o.leechers; ++i) leechers.push_back(launch(o.seeders + i, false));
+
+    auto last_report = start;
+    bool finished = wait_for([&] {
+        auto now = std::chrono::steady_clock::now();
+        size_t done{}, pieces{};
+        for (auto& e : leechers) {
+            if (!e->has_metadata && !e->torrent->stats().fetching_metadata.load()) {
+                e->has_metadata = true;
+                e->got_metadata = now;
+            }
+            if (!e->done && e->complete()) {
+                e->done = true;
+                e->finished = now;
+            }
+            done += e->done;
+            pieces += (size_t)e->torrent->stats().completed_pieces.load();
+        }
+
+        if (now - last_report > std::chrono::seconds(1)) {
+            last_report = now;
+            std::cerr << std::format("\r{}/{} leechers done, {:.1f}% of all pieces", done, o.leechers,
+                100.0 * (double)pieces / (double)(metadata.piece_hashes.size() * o.leechers));
+        }
+        return done == o.leechers;
+    }, o.timeout);
+    std::cerr << "\n";
+
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto cpu = cpu_seconds() - cpu_before;
+
+    // make sure what landed on disk is what the seeders have
+    for (auto& e : leechers) e->stop();
+    size_t verified{};
+    for (auto& e : leechers) {
+        std::ifstream in(e->dir.path() / "swarm.bin", std::ios::binary);
+        std::string got((std::istreambuf_iterator<char>(in)), {});
+        verified += got == data;
+    }
+    shutdown();
+
+    std::vector<double> times, metadata_times;
+    for (auto& e : leechers) if (e->done) times.push_back(std::chrono::duration<double>(e->finished - e->started).count());
+    for (auto& e : leechers) if (o.magnet && e->has_metadata) metadata_times.push_back(std::chrono::duration<double>(e->got_metadata - e->started).count());
+    std::ranges::sort(times);
+    std::ranges::sort(metadata_times);
+
+    auto gib = (double)(total * o.leechers) / (double)(1ull << 30);
+    auto throughput = (double)(total * o.leechers) / (1 << 20) / elapsed;
+    auto mean = times.empty() ? 0.0 : std::accumulate(times.begin(), times.end(), 0.0) / (double)times.size();
+
+    if (o.json) {
+        std::cout << std::format("{{\"seeders\":{},\"leechers\":{},\"size_mib\":{},\"piece_kib\":{},\"latency_ms\":{},\"bandwidth_kib\":{},\"transport\":\"{}\",\"magnet\":{},"
+                                 "\"ttm_max_s\":{:.3f},"
+                                 "\"completed\":{},\"verified\":{},\"elapsed_s\":{:.3f},\"ttc_min_s\":{:.3f},\"ttc_mean_s\":{:.3f},\"ttc_max_s\":{:.3f},"
+                                 "\"throughput_mib_s\":{:.2f},\"cpu_s_per_gib\":{:.3f},\"peak_rss_mib\":{:.1f}}}\n",
+            o.seeders, o.leechers, o.size_mib, o.piece_kib, o.latency.count(), o.bandwidth_kib, o.utp ? "utp" : "tcp", o.magnet,
+            metadata_times.empty() ? 0.0 : metadata_times.back(), times.size(), verified, elapsed, times.empty() ? 0.0 : times.front(), mean, times.empty() ? 0.0 : times.back(),
+            throughput, cpu / gib, (double)peak_rss_kib() / 1024.0);
+    }
+    else {
+        std::cout << std::format("completed:        {}/{} ({} verified)\n", times.size(), o.leechers, verified);
+        if (!times.empty())
+            std::cout << std::format("time to complete: min {:.2f} s, mean {:.2f} s, max {:.2f} s\n", times.front(), mean, times.back());
+        if (!metadata_times.empty())
+            std::cout << std::format("time to metadata: min {:.3f} s, max {:.3f} s\n", metadata_times.front(), metadata_times.back());
+        std::cout << std::format("throughput:       {:.1f} MiB/s aggregate\n", throughput);
+        std::cout << std::format("cpu:              {:.2f} s per GiB delivered (whole process, includes the shapers)\n", cpu / gib);
+        std::cout << std::format("peak rss:         {:.1f} MiB\n", (double)peak_rss_kib() / 1024.0);
+    }
+
+    return finished && verified == o.leechers ? 0 : 2;
+}
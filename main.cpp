@@ -1,14 +1,78 @@
-#include <TorrentClient.hpp>
+#include <Session.hpp>
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <torrent-file>\n";
+    auto usage = [&] {
+        std::cerr << "Usage: " << argv[0] << " [--port=<port>] [--save-path=<dir>] [--recheck] [--alloc=sparse|full|lazy] [--disk-queue=<MiB>] [--max-peers=<n>] [--max-connections=<n>] [--stream=<port>] [--metrics=<port>|unix:<path>] [--trace=<file.json>] [--no-utp] [--no-dht] [--no-lsd] [--dht-bootstrap=<host>:<port>]... [--file-priority=<index>:skip|normal|high]... <torrent-file|magnet-uri>...\n";
         return 1;
+    };
+
+    SessionOptions session_options;
+    TorrentOptions options;
+    std::vector<std::string> torrent_files;
+    bool custom_bootstrap{ false };
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--recheck") options.force_recheck = true;
+        else if (arg.starts_with("--port=")) session_options.listen_port = (uint16_t)std::stoi(std::string(arg.substr(7)));
+        else if (arg == "--alloc=sparse") options.allocation = AllocationMode::Sparse;
+        else if (arg == "--alloc=full") options.allocation = AllocationMode::Full;
+        else if (arg == "--alloc=lazy") options.allocation = AllocationMode::Lazy;
+        else if (arg.starts_with("--disk-queue=")) options.max_write_queue_bytes = std::stoull(std::string(arg.substr(13))) << 20;
+        else if (arg.starts_with("--max-peers=")) options.max_connections = std::stoull(std::string(arg.substr(12)));
+        else if (arg.starts_with("--max-connections=")) session_options.max_connections = std::stoull(std::string(arg.substr(18)));
+        else if (arg.starts_with("--stream=")) options.stream_port = (uint16_t)std::stoi(std::string(arg.substr(9)));
+        else if (arg.starts_with("--metrics=")) session_options.metrics = arg.substr(10);
+        else if (arg.starts_with("--trace=")) session_options.trace = arg.substr(8);
+        else if (arg == "--no-utp") session_options.utp = false;
+        else if (arg == "--no-dht") session_options.dht = false;
+        else if (arg == "--no-lsd") session_options.lsd = false;
+        else if (arg.starts_with("--dht-bootstrap=")) {
+            // the first one replaces the public routers
+            if (!custom_bootstrap) session_options.dht_bootstrap.clear();
+            custom_bootstrap = true;
+            session_options.dht_bootstrap.emplace_back(arg.substr(16));
+        }
+        else if (arg.starts_with("--save-path=")) options.save_path = std::string(arg.substr(12));
+        else if (arg.starts_with("--file-priority=")) {
+            auto spec = arg.substr(16);
+            auto colon = spec.find(':');
+            if (colon == std::string_view::npos) return usage();
+
+            auto index = (size_t)std::stoul(std::string(spec.substr(0, colon)));
+            auto level = spec.substr(colon + 1);
+
+            if (level == "skip") options.file_priorities[index] = FilePriority::Skip;
+            else if (level == "normal") options.file_priorities[index] = FilePriority::Normal;
+            else if (level == "high") options.file_priorities[index] = FilePriority::High;
+            else return usage();
+        }
+        else if (!arg.starts_with("--")) torrent_files.emplace_back(arg);
+        else return usage();
     }
 
-    TorrentClient tc(argv[1]);
+    if (torrent_files.empty()) return usage();
 
-    tc.run();
+    // per file options only make sense for a single torrent
+    if (torrent_files.size() > 1 && (options.stream_port || !options.file_priorities.empty())) return usage();
+
+    Session session(session_options);
+
+    for (const auto& path : torrent_files) {
+        try {
+            // a magnet starts from its info hash and trackers, the rest comes from the peers
+            session.add_torrent(path.starts_with("magnet:") ? parse_magnet(path) : load_torrent(path), options);
+        } catch (const std::exception& e) {
+            std::cerr << "Failed to add " << path << ": " << e.what() << "\n";
+        }
+    }
+
+    boost::asio::signal_set signals(session.io(), SIGINT, SIGTERM);
+    signals.async_wait([&](const boost::system::error_code& ec, int) {
+        if (!ec) session.stop();
+    });
+
+    session.run();
 }
 
 // std::atomic<bool> stop_signal{ false };
@@ -19,7 +19,7 @@ public:
     BaseTracker(const std::string& url): trackerUrl(url), parsed(parse_url(trackerUrl)) {}
     virtual ~BaseTracker() = default;
 
-    virtual TrackerResponse announce(const std::array<uint8_t, 20>& infoHash, const std::string& peerId, const std::atomic<size_t>& uploaded, const std::atomic<size_t>& downloaded, const std::atomic<size_t>& total) = 0;
+    virtual TrackerResponse announce(const std::array<uint8_t, 20>& infoHash, const std::string& peerId, uint16_t port, size_t uploaded, size_t downloaded, size_t total) = 0;
 
     virtual std::string protocol() const = 0;
 
@@ -2,6 +2,7 @@
 
 #include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <variant>
 #include <stdexcept>
@@ -26,11 +27,17 @@ struct BEncodeValue {
 
 class BEncodeParser {
 public:
-	explicit BEncodeParser(const std::string& input);
+	// with reference_pieces the info dictionary's "pieces" comes back as an empty string instead of
+	// a copy of what can be megabytes of hashes, get_pieces_start_end() says where it is in the input
+	explicit BEncodeParser(std::string_view input, bool reference_pieces = false);
 
 	BEncodeValue parse();
 
 	std::pair<size_t, size_t> get_info_start_end() { return { _info_start, _info_end }; }
+	std::pair<size_t, size_t> get_pieces_start_end() { return { _pieces_start, _pieces_end }; }
+
+	// bytes consumed so far, where whatever follows the parsed value starts
+	size_t position() const { return pos; }
 
 private:
 	BEncodeValue parse_value();
@@ -38,9 +45,46 @@ private:
 	std::string parse_string();
 	BEncodeValue::List parse_list();
 	BEncodeValue::Dict parse_dict();
+	std::pair<size_t, size_t> skip_string();
 
-	const std::string& _data;
+	std::string_view _data;
 	size_t pos{};
+	bool _reference_pieces{ false };
+	int _depth{};			// of the list or dict being parsed, the root dict is 1
+	bool _in_info{ false };	// parsing the root's "info" value
 
 	size_t _info_start{}, _info_end{}; // positions of the "info" dictionary in the original bencoded string
-};
\ No newline at end of file
+	size_t _pieces_start{}, _pieces_end{}; // raw bytes of the info dictionary's "pieces" string (without the length prefix)
+};
+
+// appends bencoded data to a caller provided buffer
+class BEncodeWriter {
+public:
+	explicit BEncodeWriter(std::string& out) : _out(out) {}
+
+	// exact number of bytes write() appends for this value
+	static size_t encoded_size(const BEncodeValue& value);
+
+	// reserves the exact size up front, then encodes in a single pass.
+	// dict keys come out in canonical (raw byte) order since Dict is an ordered map,
+	// so re-encoding a parsed info dictionary reproduces it byte for byte
+	void write(const BEncodeValue& value);
+
+	// streaming interface for hot paths that don't want to build a BEncodeValue tree,
+	// dict keys have to be written in sorted order by the caller
+	void write_int(int64_t value);
+	void write_string(std::string_view value);
+	void begin_list() { _out.push_back('l'); }
+	void begin_dict() { _out.push_back('d'); }
+	void end() { _out.push_back('e'); }
+
+	static size_t int_size(int64_t value);
+	static size_t string_size(size_t length);
+
+private:
+	void write_value(const BEncodeValue& value);
+
+	std::string& _out;
+};
+
+std::string bencode(const BEncodeValue& value);
\ No newline at end of file
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <boost/endian/conversion.hpp>
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// piece bitfield stored as 64-bit words in wire order: piece 64 * w + j is bit 63 - j of word w,
+// so a BITFIELD payload is a big endian load per word and the bits past size() are always zero.
+// the set operations below run a word at a time and vectorize where the compiler can
+class Bitfield {
+public:
+    Bitfield() = default;
+    explicit Bitfield(size_t bits) { resize(bits); }
+
+    // bits that are added start out clear
+    void resize(size_t bits) {
+        size_ = bits;
+        words_.resize((bits + 63) / 64, 0);
+        clear_tail();
+    }
+
+    size_t size() const { return size_; }
+    size_t word_count() const { return words_.size(); }
+    size_t byte_size() const { return (size_ + 7) / 8; }
+    uint64_t word(size_t w) const { return words_[w]; }
+
+    bool test(size_t i) const { return words_[i / 64] & mask(i); }
+    void set(size_t i) { words_[i / 64] |= mask(i); }
+    void reset(size_t i) { words_[i / 64] &= ~mask(i); }
+    void clear() { std::ranges::fill(words_, 0); }
+    void set_all() {
+        std::ranges::fill(words_, ~uint64_t{ 0 });
+        clear_tail();
+    }
+
+    size_t count() const {
+        size_t out{};
+        for (auto w : words_) out += (size_t)std::popcount(w);
+        return out;
+    }
+
+    bool none() const {
+        for (auto w : words_) if (w) return false;
+        return true;
+    }
+
+    // from a BITFIELD payload, short payloads leave the rest clear and spare bits are dropped
+    void assign(std::span<const unsigned char> bytes) {
+        size_t full = std::min(bytes.size() / 8, words_.size());
+        for (size_t w = 0; w < full; ++w) words_[w] = boost::endian::load_big_u64(bytes.data() + w * 8);
+
+        for (size_t w = full; w < words_.size(); ++w) {
+            uint64_t word{};
+            for (size_t b = 0; b < 8; ++b) {
+                auto at = w * 8 + b;
+                word = (word << 8) | (at < bytes.size() ? bytes[at] : 0);
+            }
+            words_[w] = word;
+        }
+        clear_tail();
+    }
+
+    // as a BITFIELD payload
+    std::vector<uint8_t> to_bytes() const {
+        std::vector<uint8_t> out(words_.size() * 8);
+        for (size_t w = 0; w < words_.size(); ++w) boost::endian::store_big_u64(out.data() + w * 8, words_[w]);
+        out.resize(byte_size());
+        return out;
+    }
+
+private:
+    static uint64_t mask(size_t i) { return uint64_t{ 1 } << (63 - i % 64); }
+
+    void clear_tail() {
+        if (size_ % 64) words_.back() &= ~uint64_t{ 0 } << (64 - size_ % 64);
+    }
+
+    std::vector<uint64_t> words_;
+    size_t size_{};
+};
+
+// word at a time queries over bitfields of the same size. op(w) combines word w of each,
+// e.g. [&](size_t w) { return peer.word(w) & ~mine.word(w); } for "peer has, we don't"
+template <typename Op>
+size_t count_bits(size_t words, Op&& op) {
+    size_t out{};
+    for (size_t w = 0; w < words; ++w) out += (size_t)std::popcount(op(w));
+    return out;
+}
+
+template <typename Op>
+bool any_bits(size_t words, Op&& op) {
+    for (size_t w = 0; w < words; ++w) if (op(w)) return true;
+    return false;
+}
+
+// calls f(index) for every set bit in ascending order until it returns true, true if one did
+template <typename Op, typename F>
+bool find_bits(size_t words, Op&& op, F&& f) {
+    for (size_t w = 0; w < words; ++w) {
+        for (uint64_t bits = op(w); bits; ) {
+            auto lead = std::countl_zero(bits);
+            if (f(w * 64 + (size_t)lead)) return true;
+            bits &= ~(uint64_t{ 1 } << (63 - lead));
+        }
+    }
+    return false;
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+// size of a cache line on everything we care about. std::hardware_destructive_interference_size
+// would be nicer but gcc warns that it's not abi stable
+inline constexpr size_t cache_line_size = 64;
+
+// each thread gets a fixed shard the first time it touches any counter
+inline size_t this_thread_shard(size_t shards) {
+    static std::atomic<size_t> next_shard{};
+    thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed);
+    return shard % shards;
+}
+
+// a counter that is written from many threads and read rarely. every writer thread adds to
+// its own cache line, so the io thread, disk workers and hashers never bounce the same
+// line between cores. reads sum all the shards
+class ShardedCounter {
+public:
+    static constexpr size_t shards = 8;
+
+    void add(size_t n) {
+        shards_[this_thread_shard(shards)].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    size_t load() const {
+        size_t total{};
+        for (const auto& shard : shards_) total += shard.value.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    // not atomic with respect to concurrent adds, only used to set a baseline (e.g. after a recheck)
+    void store(size_t n) {
+        for (auto& shard : shards_) shard.value.store(0, std::memory_order_relaxed);
+        shards_[0].value.store(n, std::memory_order_relaxed);
+    }
+
+private:
+    struct alignas(cache_line_size) Shard {
+        std::atomic<size_t> value{};
+    };
+
+    std::array<Shard, shards> shards_{};
+};
+
+// single writer byte counter, for things that only ever change on one thread (e.g. a peer
+// connection on the io thread). padded so neighbours in an array don't share a line
+struct alignas(cache_line_size) LocalCounter {
+    std::atomic<size_t> value{};
+
+    void add(size_t n) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    size_t load() const { return value.load(std::memory_order_relaxed); }
+};
+
+// exponentially weighted moving average of a monotonic byte counter, sampled from the tick.
+// the weight scales with the time since the last sample, so an irregular tick doesn't skew it
+class RateEstimator {
+public:
+    explicit RateEstimator(std::chrono::duration<double> time_constant = std::chrono::seconds(5))
+        : time_constant_(time_constant.count()) {}
+
+    void sample(size_t total, std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) {
+        if (!primed_ || total < last_total_) {
+            reset(total, now);
+            return;
+        }
+
+        double dt = std::chrono::duration<double>(now - last_time_).count();
+        if (dt <= 0.0) return;
+
+        double instant = (double)(total - last_total_) / dt;
+        double alpha = 1.0 - std::exp(-dt / time_constant_);
+        double prev = rate_.load(std::memory_order_relaxed);
+
+        rate_.store(prev + alpha * (instant - prev), std::memory_order_relaxed);
+        last_total_ = total;
+        last_time_ = now;
+    }
+
+    // forget the history, the next sample starts from here
+    void reset(size_t total, std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) {
+        last_total_ = total;
+        last_time_ = now;
+        primed_ = true;
+        rate_.store(0.0, std::memory_order_relaxed);
+    }
+
+    // bytes per second
+    double rate() const { return rate_.load(std::memory_order_relaxed); }
+
+private:
+    double time_constant_;
+    size_t last_total_{};
+    std::chrono::steady_clock::time_point last_time_{};
+    bool primed_{ false };
+    std::atomic<double> rate_{};
+};
+
+// log-linear latency histogram in the spirit of HdrHistogram: every power of two (in
+// microseconds) is split into 8 linear sub-buckets, so any recorded value is known to
+// within 12.5%. recording is three relaxed adds and no locks, safe from any thread
+class LatencyHistogram {
+public:
+    static constexpr int sub_bucket_bits = 3;
+    static constexpr uint64_t sub_buckets = 1 << sub_bucket_bits;
+    static constexpr int max_bits = 32;    // values are clamped to ~71 minutes
+    static constexpr size_t bucket_count = sub_buckets * (max_bits - sub_bucket_bits + 1);
+
+    // rounded up, so a bucket's upper edge bounds every sample in it
+    void record(std::chrono::steady_clock::duration d) {
+        auto us = std::chrono::ceil<std::chrono::microseconds>(d).count();
+        record_us(us > 0 ? (uint64_t)us : 0);
+    }
+
+    void record_us(uint64_t us) {
+        us = std::min<uint64_t>(us, (uint64_t(1) << max_bits) - 1);
+        buckets_[bucket_index(us)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_us_.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t sum_us() const { return sum_us_.load(std::memory_order_relaxed); }
+
+    // number of samples below 2^bits microseconds. powers of two are bucket edges so this is exact
+    uint64_t count_below_pow2(int bits) const {
+        if (bits > max_bits) return count();
+        size_t end = bits <= sub_bucket_bits ? (size_t(1) << bits) : bucket_index(uint64_t(1) << bits);
+
+        uint64_t total{};
+        for (size_t i = 0; i < end; ++i) total += buckets_[i].load(std::memory_order_relaxed);
+        return total;
+    }
+
+    // highest value equivalent to the q-th quantile, in microseconds
+    uint64_t quantile_us(double q) const {
+        auto n = count();
+        if (n == 0) return 0;
+
+        auto target = std::max<uint64_t>(1, (uint64_t)std::ceil(q * (double)n));
+        uint64_t seen{};
+        for (size_t i = 0; i < bucket_count; ++i) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen >= target) return bucket_upper(i) - 1;
+        }
+        return bucket_upper(bucket_count - 1) - 1;
+    }
+
+private:
+    static size_t bucket_index(uint64_t us) {
+        if (us < sub_buckets) return (size_t)us;
+        int shift = std::bit_width(us) - 1 - sub_bucket_bits;
+        return (size_t)(sub_buckets + shift * sub_buckets + ((us >> shift) - sub_buckets));
+    }
+
+    static uint64_t bucket_upper(size_t index) {
+        if (index < sub_buckets) return index + 1;
+        auto shift = (index - sub_buckets) / sub_buckets;
+        auto sub = (index - sub_buckets) % sub_buckets;
+        return (sub_buckets + sub + 1) << shift;
+    }
+
+    std::array<std::atomic<uint64_t>, bucket_count> buckets_{};
+    std::atomic<uint64_t> count_{};
+    std::atomic<uint64_t> sum_us_{};
+};
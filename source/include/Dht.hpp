@@ -0,0 +1,170 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include <array>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <Bencode.hpp>
+#include <Peer.hpp>
+#include <UdpSocket.hpp>
+
+// mainline DHT (BEP 5), IPv4 only. one node per session, living on the session's io_context
+// and sharing its UDP socket with uTP
+
+using NodeId = std::array<uint8_t, 20>;
+
+struct DhtOptions {
+    std::vector<std::string> bootstrap;     // "host:port", used while the routing table is empty
+    std::filesystem::path state_file;       // node id and known nodes between runs, empty for none
+};
+
+// Kademlia routing table. bucket i holds nodes whose id shares exactly i leading bits with ours,
+// which is the fully split bucket tree of the paper flattened into an array
+class RoutingTable {
+public:
+    static constexpr size_t bucket_size = 8;
+
+    struct Node {
+        NodeId id;
+        udp::endpoint endpoint;
+        std::chrono::steady_clock::time_point last_seen{};
+        int fail_count{};
+    };
+
+    explicit RoutingTable(const NodeId& own_id) : own_id_(own_id) {}
+
+    // the node answered a query or sent us one. full buckets keep their good nodes and
+    // park newcomers in a replacement cache
+    void heard_from(const NodeId& id, const udp::endpoint& endpoint, std::chrono::steady_clock::time_point now);
+
+    // a query timed out, nodes that keep failing make room for their replacements
+    void failed(const udp::endpoint& endpoint);
+
+    std::vector<Node> closest(const NodeId& target, size_t count) const;
+    std::vector<Node> all() const;
+    size_t size() const;
+
+    // a random id inside every bucket nobody was heard from in `age`, to look up and refresh it
+    std::vector<NodeId> stale_buckets(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::duration age, std::mt19937& rng);
+
+    const NodeId& id() const { return own_id_; }
+
+private:
+    static constexpr int max_failures = 2;
+
+    struct Bucket {
+        std::vector<Node> nodes;
+        std::vector<Node> replacements;
+        std::chrono::steady_clock::time_point last_changed{};
+    };
+
+    size_t bucket_index(const NodeId& id) const;
+
+    NodeId own_id_;
+    std::array<Bucket, 160> buckets_;
+};
+
+class Dht {
+public:
+    using PeersHandler = std::function<void(const std::vector<Peer>&)>;
+
+    // claims the bencoded datagrams arriving on socket
+    Dht(boost::asio::io_context& io, UdpSocket& socket, DhtOptions options);
+
+    Dht(const Dht&) = delete;
+    Dht& operator=(const Dht&) = delete;
+
+    void start();
+    void stop();    // saves the node cache
+
+    // iterative get_peers on the io thread. the handler sees each batch of new peers as
+    // replies arrive, and once the lookup settles we announce ourselves on announce_port
+    // to the closest nodes that gave us a token (0 skips the announce)
+    void get_peers(const NodeId& info_hash, uint16_t announce_port, PeersHandler handler);
+
+    size_t node_count() const { return table_.size(); }
+    uint16_t port() const { return socket_.port(); }
+    const NodeId& id() const { return table_.id(); }
+
+    // peers announced to this node for info_hash, io thread only
+    size_t stored_peers(const NodeId& info_hash) const;
+
+private:
+    using Dict = BEncodeValue::Dict;
+    using Clock = std::chrono::steady_clock;
+    using ReplyHandler = std::function<void(const Dict* reply)>;   // null on timeout or error
+
+    static constexpr size_t alpha = 3;      // queries in flight per lookup
+    static constexpr auto query_timeout = std::chrono::seconds(2);
+    static constexpr auto token_rotation = std::chrono::minutes(5);
+    static constexpr auto peer_lifetime = std::chrono::minutes(30);
+    static constexpr auto bucket_refresh = std::chrono::minutes(15);
+    static constexpr size_t max_peers_per_hash = 200;
+    static constexpr size_t max_stored_hashes = 2000;  // info hashes we keep peers for, announced to last goes first
+    static constexpr size_t max_values_per_reply = 50;
+
+    struct Transaction {
+        udp::endpoint endpoint;
+        Clock::time_point deadline;
+        ReplyHandler handler;
+    };
+
+    struct StoredPeer {
+        std::string compact;    // 4 byte ip + 2 byte port
+        Clock::time_point added;
+    };
+
+    struct Lookup;
+
+    void handle_packet(const udp::endpoint& from, std::string_view packet);
+    void handle_query(const udp::endpoint& from, const std::string& tid, const std::string& method, const Dict& args);
+    void send_reply(const udp::endpoint& to, const std::string& tid, Dict reply);
+    void send_error(const udp::endpoint& to, const std::string& tid, int code, const std::string& message);
+    void send_query(const udp::endpoint& to, const std::string& method, Dict args, ReplyHandler handler);
+    void send(const udp::endpoint& to, const BEncodeValue& message);
+
+    void start_lookup(std::shared_ptr<Lookup> lookup);
+    void step(const std::shared_ptr<Lookup>& lookup);
+    void finish(const std::shared_ptr<Lookup>& lookup);
+    void find_node(const NodeId& target);
+
+    std::string make_token(const udp::endpoint& from, const std::array<uint8_t, 8>& secret) const;
+    bool valid_token(const udp::endpoint& from, const std::string& token) const;
+    std::string compact_nodes(const NodeId& target) const;
+
+    void resolve_bootstrap();
+    void tick();
+    bool load_state();
+    void save_state() const;
+
+    boost::asio::io_context& io_;
+    DhtOptions options_;
+    UdpSocket& socket_;
+    udp::resolver resolver_;
+    boost::asio::steady_timer tick_timer_;
+    std::mt19937 rng_;
+
+    RoutingTable table_;
+    std::vector<udp::endpoint> bootstrap_endpoints_;
+    size_t resolving_{};                    // bootstrap names still being resolved
+    std::vector<std::shared_ptr<Lookup>> deferred_;  // waiting for the bootstrap nodes
+
+    uint16_t next_tid_{};
+    std::unordered_map<uint16_t, Transaction> transactions_;
+
+    std::array<uint8_t, 8> secret_{}, previous_secret_{};
+    Clock::time_point last_rotation_{}, last_refresh_{};
+
+    std::map<NodeId, std::vector<StoredPeer>> peer_store_;
+
+    bool stopped_{ false };
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// memory for one asio operation at a time, handed from each operation to the next. a connection
+// keeps one per kind of operation it can have outstanding (read, write, wait) so its steady state
+// never touches the heap, however many other connections share the io thread. a second concurrent
+// operation or one that doesn't fit falls back to operator new. io thread only
+class HandlerMemory {
+public:
+    HandlerMemory() = default;
+    HandlerMemory(const HandlerMemory&) = delete;
+    HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+    void* allocate(size_t size) {
+        if (!in_use_ && size <= sizeof(storage_)) {
+            in_use_ = true;
+            return storage_;
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void* pointer) {
+        if (pointer == storage_) in_use_ = false;
+        else ::operator delete(pointer);
+    }
+
+private:
+    // a composed read or write with a coroutine's handler is a few hundred bytes
+    alignas(std::max_align_t) unsigned char storage_[1024];
+    bool in_use_{ false };
+};
+
+template <typename T>
+class HandlerAllocator {
+public:
+    using value_type = T;
+
+    explicit HandlerAllocator(HandlerMemory& memory) noexcept : memory_(&memory) {}
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U>& other) noexcept : memory_(other.memory_) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(memory_->allocate(sizeof(T) * n)); }
+    void deallocate(T* pointer, size_t) noexcept { memory_->deallocate(pointer); }
+
+    template <typename U>
+    bool operator==(const HandlerAllocator<U>& other) const noexcept { return memory_ == other.memory_; }
+
+private:
+    template <typename> friend class HandlerAllocator;
+    HandlerMemory* memory_;
+};
+
+// a completion handler whose operation asio allocates from memory, everything else about it is
+// the wrapped handler's. made by bind_memory
+template <typename Handler>
+class MemoryBoundHandler {
+public:
+    using allocator_type = HandlerAllocator<std::byte>;
+
+    MemoryBoundHandler(HandlerMemory& memory, Handler handler) : memory_(&memory), handler_(std::move(handler)) {}
+
+    allocator_type get_allocator() const noexcept { return allocator_type(*memory_); }
+
+    template <typename... Args>
+    void operator()(Args&&... args) { std::move(handler_)(std::forward<Args>(args)...); }
+
+    const Handler& handler() const noexcept { return handler_; }
+
+private:
+    HandlerMemory* memory_;
+    Handler handler_;
+};
+
+template <typename Token>
+struct MemoryBoundToken {
+    HandlerMemory* memory;
+    Token token;
+};
+
+// the completion token, or handler, with its operations allocated from memory:
+//   co_await socket.async_read_some(buffers, bind_memory(read_memory_, use_awaitable));
+template <typename Token>
+MemoryBoundToken<std::decay_t<Token>> bind_memory(HandlerMemory& memory, Token&& token) {
+    return { &memory, std::forward<Token>(token) };
+}
+
+// the wrapper runs its handler wherever the handler itself would have run
+template <typename Handler, typename Executor>
+struct boost::asio::associated_executor<MemoryBoundHandler<Handler>, Executor> {
+    using type = boost::asio::associated_executor_t<Handler, Executor>;
+
+    static type get(const MemoryBoundHandler<Handler>& h, const Executor& ex = Executor()) noexcept {
+        return boost::asio::get_associated_executor(h.handler(), ex);
+    }
+};
+
+// initiate with the wrapped token as usual, only the handler it produces gets wrapped
+template <typename Token, typename Signature>
+struct boost::asio::async_result<MemoryBoundToken<Token>, Signature> {
+    template <typename Initiation, typename RawToken, typename... Args>
+    static auto initiate(Initiation&& initiation, RawToken&& token, Args&&... args) {
+        // async_initiate moves from what it's given, a token kept for the next operation stays intact
+        Token inner(std::forward<RawToken>(token).token);
+        return boost::asio::async_initiate<Token, Signature>(
+            [initiation = std::forward<Initiation>(initiation), memory = token.memory](auto&& handler, auto&&... args) mutable {
+                using Handler = std::decay_t<decltype(handler)>;
+                std::move(initiation)(MemoryBoundHandler<Handler>(*memory, std::forward<decltype(handler)>(handler)),
+                                      std::forward<decltype(args)>(args)...);
+            },
+            inner, std::forward<Args>(args)...);
+    }
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <Peer.hpp>
+#include <UdpSocket.hpp>
+
+// local service discovery (BEP 14): every torrent announces itself to the LAN by multicast and
+// hears about peers on the same segment straight away, no tracker round trip needed. sessions on
+// one host share the group port, so it works on loopback too. io thread only
+
+struct LsdOptions {
+    udp::endpoint group{ boost::asio::ip::make_address_v4("239.192.152.143"), 6771 };
+};
+
+class Lsd {
+public:
+    using PeersHandler = std::function<void(const std::vector<Peer>&)>;
+
+    // throws when the group port can't be bound or joined
+    Lsd(boost::asio::io_context& io, uint16_t listen_port, const LsdOptions& options = {});
+
+    Lsd(const Lsd&) = delete;
+    Lsd& operator=(const Lsd&) = delete;
+
+    void start();
+    void stop();
+
+    // announce the torrent from now on, peers announcing the same info hash go to handler
+    void add(const std::array<uint8_t, 20>& info_hash, PeersHandler handler);
+    void remove(const std::array<uint8_t, 20>& info_hash);
+
+    size_t peers_discovered() const { return peers_discovered_; }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry {
+        PeersHandler handler;
+        Clock::time_point next_announce{};
+        Clock::time_point last_announce{};
+    };
+
+    void receive();
+    void on_message(const udp::endpoint& from, std::string_view message);
+    void on_timer();
+    void send(const std::vector<std::string>& hashes);
+
+    static std::string hex(const std::array<uint8_t, 20>& info_hash);
+
+    static constexpr auto announce_interval = std::chrono::minutes(5);   // BEP 14
+    static constexpr auto min_interval = std::chrono::minutes(1);       // per torrent, however often it's asked
+    static constexpr auto peer_interval = std::chrono::minutes(1);      // per peer and torrent, what we act on
+    static constexpr size_t hashes_per_message = 16;                    // stays well under a typical MTU
+
+    udp::socket socket_;
+    udp::endpoint group_;
+    uint16_t listen_port_;
+    std::string cookie_;        // ours, to recognize our own announces coming back
+    boost::asio::steady_timer timer_;
+    bool stopped_{ false };
+
+    std::map<std::string, Entry> torrents_;     // by lowercase hex info hash
+    std::map<std::pair<std::string, udp::endpoint>, Clock::time_point> heard_;  // rate limit for incoming, by announced port
+    size_t peers_discovered_{};
+
+    std::array<char, 1500> buf_{};
+    udp::endpoint from_;
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+class PeerConnection;
+
+// BEP 9: a magnet's info dictionary, fetched in 16 KiB pieces over ut_metadata. every peer that
+// has it gets a share of the pieces so the whole dictionary arrives in about one round trip, and
+// once nothing is left unasked idle peers double up on the slowest outstanding pieces. io thread only
+class MetadataFetcher {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit MetadataFetcher(const std::array<uint8_t, 20>& info_hash) : info_hash_(info_hash) {}
+
+    // a peer announced metadata_size in its extended handshake
+    void add_source(const std::shared_ptr<PeerConnection>& peer, size_t size);
+
+    // a piece or, empty, a reject. true once the last piece arrived and the whole hashes to the info hash
+    bool on_piece(const PeerConnection& peer, int piece, std::span<const uint8_t> data);
+
+    // requests that went unanswered go to someone else
+    void tick(Clock::time_point now);
+
+    bool complete() const { return complete_; }
+    size_t size() const { return size_; }
+
+    // the verified info dictionary, once complete
+    std::string take() { return std::move(buffer_); }
+
+private:
+    struct Request {
+        int piece;
+        Clock::time_point sent;
+    };
+
+    struct Source {
+        std::weak_ptr<PeerConnection> peer;
+        const PeerConnection* key;
+        std::vector<Request> pending;
+        bool bad{ false };              // rejected us or sent a piece of a dictionary that didn't hash
+    };
+
+    struct Piece {
+        bool have{ false };
+        const PeerConnection* from{};   // who sent it, banned if the hash fails
+    };
+
+    void request_pieces(Clock::time_point now);
+    int requests_for(int piece) const;
+    Source* find(const PeerConnection& peer);
+    void verify();
+
+    static constexpr size_t piece_size = 16384;
+    static constexpr size_t max_size = 16 << 20;        // 1000 times what a large torrent needs
+    static constexpr size_t max_pending = 2;            // per peer, a handful of round trips for the whole dictionary
+    static constexpr auto request_timeout = std::chrono::seconds(5);
+    static constexpr auto endgame_after = std::chrono::milliseconds(500);
+
+    std::array<uint8_t, 20> info_hash_;
+    size_t size_{};
+    std::string buffer_;
+    std::vector<Piece> pieces_;
+    std::vector<Source> sources_;
+    bool complete_{ false };
+};
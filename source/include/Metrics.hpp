@@ -0,0 +1,69 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <Counters.hpp>
+
+// collects samples and renders them in the Prometheus text exposition format.
+// samples of one metric must be contiguous, so they're grouped by name and written out in
+// the order each name was first seen, no matter how the callers interleave them
+class MetricsWriter {
+public:
+    using Labels = std::vector<std::pair<std::string, std::string>>;
+
+    void counter(const std::string& name, const std::string& help, const Labels& labels, double value);
+    void gauge(const std::string& name, const std::string& help, const Labels& labels, double value);
+
+    // exported in seconds with power of two bucket bounds, plus a <name>_summary summary
+    // carrying p50/p90/p99/p99.9 from the full resolution buckets
+    void histogram(const std::string& name, const std::string& help, const Labels& labels, const LatencyHistogram& histogram);
+
+    std::string str() const;
+
+private:
+    struct Family {
+        std::string type, help, samples;
+    };
+
+    Family& family(const std::string& name, const char* type, const std::string& help);
+    static void sample(std::string& out, const std::string& name, const Labels& labels, double value);
+
+    std::vector<std::string> order_;
+    std::unordered_map<std::string, Family> families_;
+};
+
+// scrape endpoint, GET /metrics. runs on the session's io_context, so the render callback
+// can look at torrent and peer state without locking
+class MetricsServer {
+public:
+    // "<port>" listens on 127.0.0.1:<port>, "unix:<path>" on a unix domain socket
+    MetricsServer(boost::asio::io_context& io, const std::string& where, std::function<std::string()> render);
+    ~MetricsServer();
+
+    void start();
+    void stop();
+
+private:
+    using tcp = boost::asio::ip::tcp;
+
+    void accept_tcp();
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+    using unix_socket = boost::asio::local::stream_protocol;
+    void accept_unix();
+    std::optional<unix_socket::acceptor> unix_acceptor_;
+#endif
+
+    boost::asio::io_context& io_;
+    std::function<std::string()> render_;
+
+    std::optional<tcp::acceptor> tcp_acceptor_;
+    uint16_t port_{};
+    std::string unix_path_;
+};
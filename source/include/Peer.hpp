@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <span>
 #include <string>
 #include <vector>
 #include <sstream>
@@ -21,12 +22,36 @@ public:
     auto addr() const { return endpoint_.address(); }
     uint16_t port() const { return endpoint_.port(); }
 
+    // loopback, private (RFC 1918 / unique local) or link local, where LAN peers live
+    bool is_lan() const {
+        auto address = endpoint_.address();
+        if (address.is_loopback()) return true;
+        if (address.is_v6()) {
+            auto v6 = address.to_v6();
+            return v6.is_link_local() || (v6.to_bytes()[0] & 0xFE) == 0xFC;
+        }
+        auto b = address.to_v4().to_bytes();
+        return b[0] == 10 || (b[0] == 172 && (b[1] & 0xF0) == 16) || (b[0] == 192 && b[1] == 168) || (b[0] == 169 && b[1] == 254);
+    }
+
     bool operator==(const Peer& other) const {
-        return this->ip() == other.ip() && this->port() == other.port();
+        return endpoint_ == other.endpoint_;
     }
 
 private:
     boost::asio::ip::tcp::endpoint endpoint_;
 };
 
-std::vector<Peer> parse_compact_peers(const BEncodeValue& peers_blob);
\ No newline at end of file
+// compact peer entries, address then port in network order: 6 bytes each for IPv4, 18 for IPv6
+// (BEP 7). decoded straight from the bytes and appended to peers, a trailing partial entry is ignored
+void parse_compact_peers(std::span<const uint8_t> blob, bool v6, std::vector<Peer>& peers);
+
+// a tracker's "peers", compact IPv4 or the old list of dicts, and "peers6"
+std::vector<Peer> parse_compact_peers(const BEncodeValue& peers_blob);
+std::vector<Peer> parse_compact_peers6(const BEncodeValue& peers_blob);
+
+// both of them out of an HTTP(S) announce response
+std::vector<Peer> tracker_peers(const BEncodeValue::Dict& response);
+
+// the reverse, for the peers of one family. the others are skipped
+std::string compact_peers(const std::vector<Peer>& peers, bool v6 = false);
\ No newline at end of file
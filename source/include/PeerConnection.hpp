@@ -1,110 +1,244 @@
 #pragma once
 
 #include <boost/asio.hpp>
-#include <boost/dynamic_bitset.hpp>
 #include <boost/endian/conversion.hpp>
 
+#include <functional>
 #include <memory>
+#include <optional>
 #include <string>
 #include <queue>
 #include <span>
 
+#include <HandlerMemory.hpp>
 #include <Peer.hpp>
+#include <PeerSocket.hpp>
+#include <Bitfield.hpp>
+#include <Counters.hpp>
 #include <PieceManager.hpp>
 
-using boost::asio::ip::tcp;
-
 class PeerConnection : public std::enable_shared_from_this<PeerConnection> {
 public:
-
-    // outbound connections
+    using PeersHandler = std::function<void(const std::vector<Peer>&)>;
+    using MetadataSourceHandler = std::function<void(const std::shared_ptr<PeerConnection>&, size_t metadata_size)>;
+    using MetadataPieceHandler = std::function<void(const std::shared_ptr<PeerConnection>&, int piece, std::span<const uint8_t> data)>;
+
+    // what we offer in the extended handshake (BEP 10), set by the torrent before start
+    struct Extensions {
+        uint16_t listen_port{};
+        PeersHandler pex;       // ut_pex (BEP 11) peers go here, unset for private torrents
+
+        // ut_metadata (BEP 9): the info dictionary we serve, empty while a magnet is still fetching it
+        std::function<std::string_view()> metadata;
+        // set while fetching: peers that have the metadata, and the pieces they send (empty when rejected)
+        MetadataSourceHandler metadata_source;
+        MetadataPieceHandler metadata_piece;
+    };
+
+    // outbound connections, over uTP when utp is given and the peer answers it, TCP otherwise
     PeerConnection(boost::asio::io_context& io,
                    Peer peer,
                    std::array<uint8_t, 20ULL> info_hash,
                    std::string peer_id,
-                   PieceManager& pm
+                   PieceManager* pm,
+                   UtpContext* utp = nullptr
                   )
         : socket_(io),
           peer_(std::move(peer)),
           info_hash_(std::move(info_hash)),
           peer_id_(std::move(peer_id)),
-          piece_manager_(pm) {
-            peer_bitfield_.resize(pm.num_pieces_, false);
+          piece_manager_(pm),
+          have_timer_(socket_.get_executor()),
+          timeout_timer_(socket_.get_executor()),
+          send_signal_(socket_.get_executor()),
+          utp_(utp) {
+            if (pm) peer_bitfield_.resize(pm->num_pieces_);
           }
 
-    // inbound connections
-    PeerConnection(tcp::socket socket,
+    // inbound connections, the session has already read the peer's handshake to route it here
+    PeerConnection(PeerSocket socket,
+                   const std::array<char, 68>& peer_handshake,
                    std::array<uint8_t, 20> info_hash,
                    std::string peer_id,
-                   PieceManager& pm)
+                   PieceManager* pm)
         : socket_(std::move(socket)),
           peer_(socket_.remote_endpoint().address(), socket_.remote_endpoint().port()),
           info_hash_(std::move(info_hash)),
           peer_id_(std::move(peer_id)),
-          piece_manager_(pm) {
-        peer_bitfield_.resize(pm.num_pieces_, false);
+          handshake_buf_(peer_handshake),
+          piece_manager_(pm),
+          have_timer_(socket_.get_executor()),
+          timeout_timer_(socket_.get_executor()),
+          send_signal_(socket_.get_executor()),
+          inbound_(true) {
+        if (pm) peer_bitfield_.resize(pm->num_pieces_);
     }
 
+    void set_extensions(Extensions extensions) { extensions_ = std::move(extensions); }
+
+    // a connection made without a piece manager (a magnet still fetching its metadata) only talks
+    // extensions until the torrent hands it one. what the peer announced meanwhile is applied then
+    void attach(PieceManager& pm);
+
+    // ask the peer for a piece of the info dictionary, the answer goes to Extensions::metadata_piece
+    void request_metadata(int piece);
+
+    // connect (outbound) and handshake, then trade messages until stop() or the peer hangs up
     void start();
-    void start_inbound();
-    void send_handshake();
-    void on_inbound_handshake_complete();
 
     void stop();
     void decrement_inflight_blocks();
-    void signal_have(int piece_index);
+
+    // tell the peer about a verified piece with the next batch of HAVEs, false if it has the piece
+    // already and is left alone. io thread only
+    bool queue_have(int piece_index);
+    void post_have(int piece_index);    // the same from any thread
 
     bool is_alive() const;
+    bool is_utp() const { return socket_.is_utp(); }
+
+    // on our LAN: found by local service discovery or at a private address. set before start
+    void set_local(bool local) { local_ = local; }
+    bool is_local() const { return local_; }
     const Peer& peer() const;
 
+    // payload bytes exchanged with this peer and their rolling rates, refreshed by the torrent's tick
+    void update_rates(std::chrono::steady_clock::time_point now);
+    size_t downloaded() const { return downloaded_.load(); }
+    size_t uploaded() const { return uploaded_.load(); }
+    double download_rate() const { return download_rate_.rate(); }
+    double upload_rate() const { return upload_rate_.rate(); }
+    // decode a BITFIELD payload into peer_bitfield_, public for the benchmarks
+    void set_bitfield(const std::span<const unsigned char> payload);
+
+    // recount what we want from this peer after our wanted pieces changed, safe from any thread
+    void refresh_interest();
+
+    int in_flight_blocks() const { return in_flight_blocks_.load(std::memory_order_relaxed); }
+    size_t send_queue_bytes() const { return send_queue_bytes_; }
+
+    // where the peer takes connections: the address we dialed, or for an inbound peer its address
+    // with the port from its extended handshake. nullopt while that's unknown
+    std::optional<Peer> listen_peer() const;
+
+    // PEX: the changes to `connected` since the last message, once one is due. io thread only
+    void maybe_send_pex(const std::vector<std::shared_ptr<PeerConnection>>& connected, std::chrono::steady_clock::time_point now);
+
 private:
-    void do_handshake();                                                    //
-    void on_handshake(boost::system::error_code ec, std::size_t bytes);     //
+    boost::asio::awaitable<void> run(std::shared_ptr<PeerConnection> self); //
+    void write_handshake();                                                 //
+    void arm_timeout();                                                     //
 
-    tcp::socket socket_;                                                    //
+    PeerSocket socket_;                                                     //
     Peer peer_;                                                     //      //
     std::array<uint8_t, 20> info_hash_;                                     //  --> Connect to peer
     std::string peer_id_;                                    //             //
 
     std::array<char, 68> handshake_buf_; // 68 byte handshake               //
-    PieceManager& piece_manager_;
+    PieceManager* piece_manager_;       // null until a magnet's metadata is in
+    boost::asio::steady_timer have_timer_;
+    boost::asio::steady_timer timeout_timer_;   // connect and handshake, stops the connection when it fires
+    boost::asio::steady_timer send_signal_;     // never expires, cancelled to wake write_loop
+    UtpContext* utp_{};
+    bool inbound_{ false };
+    bool connecting_{ false };  // trying uTP, the socket isn't open yet
+    bool stopped_{ false };
+    bool handshake_done_{ false };
+
+    bool check_handshake();     // the peer's handshake in handshake_buf_, false to hang up
+    void on_connected();        // both handshakes are through
 
     // -- Download data --
 
-    const int max_in_flight_blocks{20};
+    // LAN peers get the deeper pipeline, so blocks go to the rack next door before the WAN
+    static constexpr int max_in_flight_blocks = 20;
+    static constexpr int max_in_flight_blocks_local = 64;
+    bool local_{ false };
     std::atomic<int> in_flight_blocks_{};
 
-    void read_message_length();
-    void read_message_body(size_t length);
-    void handle_message();
-    void send_interested();
+    LocalCounter downloaded_;
+    LocalCounter uploaded_;
+    RateEstimator download_rate_;
+    RateEstimator upload_rate_;
+    size_t send_queue_bytes_{};    // piece data queued or handed to async_write and not yet sent, io thread only
+
+    static constexpr auto handshake_timeout{ std::chrono::seconds(20) };
+    static constexpr size_t recv_buffer_size = 32768;           // a piece message and change
+    static constexpr size_t max_message_size = 4 << 20;         // the bitfield of a 32M piece torrent, nothing legit is bigger
+    static constexpr uint32_t max_request_length = 128 * 1024;  // clients ask for 16 KiB, some for more
+
+    boost::asio::awaitable<void> read_loop();
+    boost::asio::awaitable<void> write_loop(std::shared_ptr<PeerConnection> self);
+    uint8_t* append_message(size_t size);
+    void handle_message(const std::span<const unsigned char> message);
+    void send_interest(bool interested);
+    void update_interest();
     void send_request(int piece_index, int offset, int length);
     void handle_have(const std::span<const unsigned char> payload);
 
     void handle_bitfield(const std::span<const unsigned char> payload);
-    void set_bitfield(const std::span<const unsigned char> payload);
-    bool peer_has_needed_piece();
     void handle_piece(const std::span<const unsigned char> payload);
     void maybe_request_next();
 
     // Buffers
 
-    std::array<char, 4> length_buf_; // 4 byte length prefix
-    std::vector<unsigned char> msg_buf_; // Variable length message body
+    std::vector<uint8_t> recv_buf_;     // read off the socket, only a partial message is left between reads
+    std::vector<uint8_t> send_buf_;     // messages queued since the last write went out
+    std::vector<uint8_t> write_buf_;    // the write in flight, swapped with send_buf_
+    size_t unsent_piece_bytes_{};       // send_queue_bytes_ still in send_buf_
+
+    // what the steady state's asio operations are allocated from, one of each is outstanding at most
+    HandlerMemory read_memory_;
+    HandlerMemory write_memory_;
+    HandlerMemory wait_memory_;         // send_signal_
+    HandlerMemory have_memory_;         // have_timer_
 
     // my state
     bool am_choked_{ true };
     bool am_interested_{ false };
 
-    boost::dynamic_bitset<> peer_bitfield_; // Bitfield of pieces the peer has
+    Bitfield peer_bitfield_; // Bitfield of pieces the peer has
+    std::vector<uint8_t> early_bitfield_;   // BITFIELD and HAVEs that came before the piece manager
+    std::vector<uint32_t> early_haves_;
+    size_t needed_pieces_{}; // pieces the peer has that we still want, kept up to date by HAVEs both ways
 
     // -- Seeder logic --
     void signal_bitfield();
 
+    // HAVEs go out together once per interval instead of one tiny write per piece
+    static constexpr auto have_flush_interval_{ std::chrono::milliseconds(100) };
+    std::vector<uint32_t> pending_haves_;
+    bool have_flush_scheduled_{ false };
+    void flush_haves();
+
     // peer state
     bool peer_choked{ true };
     bool peer_interested{ false };
 
     void signal_unchoke();
     void handle_request(const std::span<const unsigned char> payload);
+
+    // -- extension protocol --
+    static constexpr uint8_t extended_msg_id = 20;
+    static constexpr uint8_t ut_pex_id = 1;         // the ids peers send extension messages to us with
+    static constexpr uint8_t ut_metadata_id = 2;
+    static constexpr size_t metadata_piece_size = 16384;
+    static constexpr auto pex_interval{ std::chrono::seconds(60) };   // BEP 11's floor
+    static constexpr size_t max_pex_peers = 50;     // per list and message
+
+    void send_extended_handshake();
+    void send_extended(uint8_t id, const std::string& payload);
+    void handle_extended(const std::span<const unsigned char> payload);
+    void handle_extended_handshake(const std::span<const unsigned char> payload);
+    void handle_pex(const std::span<const unsigned char> payload);
+    void handle_metadata(const std::span<const unsigned char> payload);
+    void send_metadata(int piece);
+
+    Extensions extensions_;
+    bool peer_extensions_{ false };     // reserved bit 20 in the peer's handshake
+    uint8_t peer_pex_id_{};             // 0 when the peer doesn't do ut_pex
+    uint8_t peer_metadata_id_{};        // same for ut_metadata
+    uint16_t peer_listen_port_{};       // "p" of the extended handshake
+    std::vector<Peer> pex_sent_;        // what the peer has heard from us
+    std::chrono::steady_clock::time_point next_pex_{};
 };
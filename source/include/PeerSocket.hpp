@@ -0,0 +1,96 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include <memory>
+#include <variant>
+
+#include <Utp.hpp>
+
+using boost::asio::ip::tcp;
+
+// what a peer connection runs over, a TCP socket or a uTP stream. both meet asio's stream
+// requirements, so boost::asio::async_read / async_write work the same on either
+class PeerSocket {
+public:
+    using executor_type = boost::asio::any_io_executor;
+
+    explicit PeerSocket(tcp::socket socket) : stream_(std::move(socket)) {}
+    explicit PeerSocket(boost::asio::io_context& io) : stream_(std::in_place_type<tcp::socket>, io) {}   // a fresh TCP socket
+    explicit PeerSocket(std::shared_ptr<UtpStream> stream) : stream_(std::move(stream)) {}
+
+    PeerSocket(PeerSocket&&) noexcept = default;
+    PeerSocket& operator=(PeerSocket&& other) noexcept {
+        if (this != &other) {
+            close();
+            stream_ = std::move(other.stream_);
+        }
+        return *this;
+    }
+
+    // a uTP stream is kept by its context until the FIN is through, dropping ours isn't enough
+    ~PeerSocket() { close(); }
+
+    bool is_utp() const { return std::holds_alternative<std::shared_ptr<UtpStream>>(stream_); }
+
+    // for async_connect, only valid before a uTP stream replaced the socket
+    tcp::socket& tcp_socket() { return std::get<tcp::socket>(stream_); }
+
+    executor_type get_executor() {
+        if (auto* socket = std::get_if<tcp::socket>(&stream_)) return socket->get_executor();
+        return utp()->get_executor();
+    }
+
+    template <typename MutableBufferSequence, typename ReadHandler>
+    void async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler) {
+        if (auto* socket = std::get_if<tcp::socket>(&stream_)) socket->async_read_some(buffers, std::forward<ReadHandler>(handler));
+        else utp()->async_read_some(buffers, std::forward<ReadHandler>(handler));
+    }
+
+    template <typename ConstBufferSequence, typename WriteHandler>
+    void async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler) {
+        if (auto* socket = std::get_if<tcp::socket>(&stream_)) socket->async_write_some(buffers, std::forward<WriteHandler>(handler));
+        else utp()->async_write_some(buffers, std::forward<WriteHandler>(handler));
+    }
+
+    // no Nagle on TCP: the tail of a batch of PIECEs would otherwise wait for the ACK of what went
+    // before it, a delayed ACK away on a receiver that isn't reading yet. uTP has nothing to turn off
+    void set_no_delay() {
+        if (auto* socket = std::get_if<tcp::socket>(&stream_)) {
+            boost::system::error_code ec;
+            socket->set_option(tcp::no_delay(true), ec);
+        }
+    }
+
+    bool is_open() const {
+        if (auto* socket = std::get_if<tcp::socket>(&stream_)) return socket->is_open();
+        return utp() && utp()->is_open();
+    }
+
+    void close() {
+        if (auto* socket = std::get_if<tcp::socket>(&stream_)) {
+            boost::system::error_code ec;
+            socket->close(ec);
+        } else if (utp()) {
+            utp()->close();
+        }
+    }
+
+    // throws like tcp::socket::remote_endpoint when a TCP socket isn't connected. IPv4 peers that
+    // came in on the dual stack acceptor show up as ::ffff:a.b.c.d, they get their plain address back
+    tcp::endpoint remote_endpoint() const {
+        if (auto* socket = std::get_if<tcp::socket>(&stream_)) {
+            auto endpoint = socket->remote_endpoint();
+            auto address = endpoint.address();
+            if (address.is_v6() && address.to_v6().is_v4_mapped())
+                return { boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, address.to_v6()), endpoint.port() };
+            return endpoint;
+        }
+        return { utp()->remote_endpoint().address(), utp()->remote_endpoint().port() };
+    }
+
+private:
+    const std::shared_ptr<UtpStream>& utp() const { return std::get<std::shared_ptr<UtpStream>>(stream_); }
+
+    std::variant<tcp::socket, std::shared_ptr<UtpStream>> stream_;
+};
@@ -14,78 +14,156 @@
 #include <condition_variable>
 #include <mutex>
 #include <queue>
+#include <map>
+#include <unordered_map>
 #include <optional>
 #include <algorithm>
 #include <ranges>
 
 #include <TorrentFile.hpp>
 #include <Stats.hpp>
-
-#include <boost/dynamic_bitset.hpp>
+#include <ThreadPool.hpp>
+#include <Bitfield.hpp>
 
 class PeerConnection;
 
+enum class FilePriority : uint8_t { Skip = 0, Normal = 1, High = 2 };
+
+// how disk space for the torrent's files is reserved
+enum class AllocationMode {
+    Sparse,     // files are sized up front but blocks are only allocated as pieces are written
+    Full,       // every file is fully allocated by init_files, fails early if the disk is too small
+    Lazy        // a file is fully allocated the first time a piece is written to it
+};
+
 class PieceManager {
 public:
     PieceManager(size_t total_size,
                  size_t num_pieces,
                  size_t piece_length,
-                 const std::vector<std::array<unsigned char, 20>>& piece_hashes,
+                 PieceHashes piece_hashes,
                  const std::string& torrent_name,
-                 Stats& stats)
-        : total_length_(total_size),
-          num_pieces_(num_pieces),
+                 Stats& stats,
+                 ThreadPool& disk_pool,
+                 ThreadPool& hash_pool)
+        : num_pieces_(num_pieces),
           piece_length_(piece_length),
-          piece_hashes_(std::move(piece_hashes)),
+          total_length_(total_size),
+          piece_hashes_(piece_hashes),
+          disk_pool_(disk_pool),
+          hash_pool_(hash_pool),
           stats_(stats)
     { 
         pieces_.resize(num_pieces);
-        my_bitfield_.resize((num_pieces + 7) / 8, 0);
+        my_bitfield_.resize(num_pieces);
+        wanted_bits_.resize(num_pieces);
+        wanted_bits_.set_all();
+        high_priority_bits_.resize(num_pieces);
 
         stats_.total_pieces.store(num_pieces, std::memory_order_relaxed); 
         stats_.total_size.store(total_length_, std::memory_order_relaxed);
+        stats_.piece_length.store(piece_length_, std::memory_order_relaxed);
 
         std::cout << num_pieces << " pieces found.\n";
         save_file_name_ = torrent_name + ".fastresume";
-
-        if (std::filesystem::exists(save_file_name_)) load_resume_data();
-        else std::ofstream out(save_file_name_, std::ios::binary | std::ios::trunc);
-
-        writer_thread_ = std::thread(&PieceManager::writer_thread_func, this);
-        timeout_thread_ = std::thread(&PieceManager::timeout_thread_func, this);
+        part_file_name_ = torrent_name + ".parts";
+        piece_priorities_.assign(num_pieces, FilePriority::Normal);
+        wanted_pieces_ = num_pieces;
     }
     
     ~PieceManager();
 
     void add_block(int piece_index, int begin, std::span<const unsigned char>);
     size_t piece_length_for_index(int piece_index) const;
-    void init_files(const std::vector<TorrentFile>& files);
+    void init_files(const std::vector<TorrentFile>& files, AllocationMode mode = AllocationMode::Sparse);
+
+    // hash everything already on disk and rebuild the bitfield and resume data from it. returns
+    // right away, the check runs on the disk and hash pools
+    void recheck();
+
+    // block timeouts and periodic resume saves, driven by the session once a second
+    void tick();
 
-    std::optional<std::pair<int, int>> next_block_request(const boost::dynamic_bitset<>& peer_bitfield, std::chrono::steady_clock::time_point sent_time, std::weak_ptr<PeerConnection> peer);
+    // one entry per torrent file, missing entries are Normal. can be changed after init_files,
+    // files that become wanted are created and pick up whatever the part file holds for them
+    void set_file_priorities(std::vector<FilePriority> priorities);
+
+    std::optional<std::pair<int, int>> next_block_request(const Bitfield& peer_bitfield, std::chrono::steady_clock::time_point sent_time, std::weak_ptr<PeerConnection> peer);
+
+    // pieces of a peer's bitfield we still want (not verified yet and not skipped), for interest
+    size_t count_needed(const Bitfield& peer_bitfield);
+    bool is_needed(int piece_index);
 
     void maybe_init(int piece_index);
     bool is_complete(int piece_index);
 
     size_t num_pieces_;
 
-    void add_to_peer_list(std::weak_ptr<PeerConnection> peer); // peer list
+    // connections that finished the handshake, removed again when they stop
+    void add_peer(const std::shared_ptr<PeerConnection>& peer);
+    void remove_peer(const PeerConnection* peer);
+    std::vector<std::shared_ptr<PeerConnection>> live_peers();
     std::vector<uint8_t> get_my_bitfield();
 
     std::vector<uint8_t> fetch_block(uint32_t piece_index, uint32_t begin, uint32_t length);
+
+    // the same into the caller's buffer, out.size() bytes. false for a range outside the piece or a failed read
+    bool read_block(uint32_t piece_index, uint32_t begin, std::span<uint8_t> out);
+
+    // straight to the files, normally only called by the writer for verified pieces
+    void write_piece(int index, const std::vector<unsigned char>& data);
+
+    // -- streaming --
+
+    // time critical pieces are picked before anything else, earliest deadline first
+    void set_piece_deadline(int piece_index, std::chrono::steady_clock::time_point deadline);
+    void clear_piece_deadline(int piece_index);
+
+    // block until the piece is verified and on disk, false on timeout
+    bool wait_for_piece(int piece_index, std::chrono::milliseconds timeout);
+    bool read_data(size_t offset, unsigned char* out, size_t length) { return read_range(offset, out, length); }
+    size_t piece_length() const { return piece_length_; }
+
+    // -- disk back-pressure --
+
+    // verified pieces waiting for the writer keep their buffers. once they hold this many bytes
+    // (never less than two pieces) peers stop requesting, until the writer has it down to half
+    void set_write_queue_limit(size_t bytes);
+
+    // any thread, checked before every request goes out
+    bool write_backlogged() const { return write_backlogged_.load(std::memory_order_relaxed); }
     
 private:
     std::string save_file_name_;
 
-    // read resume data if available
+    // fast resume, loaded once the files are known and rewritten on a timer and at shutdown
+    static constexpr int resume_file_version_{ 1 };
+    static constexpr auto resume_save_interval_{ std::chrono::seconds(30) };
+
     std::mutex resume_file_mutex_;
-    void load_resume_data();
-    void save_resume_data(int piece_index);
+    std::atomic<bool> resume_dirty_{ false };
+    std::atomic<bool> resume_save_scheduled_{ false };
+    std::chrono::steady_clock::time_point last_resume_save_{};  // only touched by tick()
+
+    bool load_resume_data();
+    void save_resume_data();
+
+    // hash the pieces set in `pieces` in the background and take the valid ones, empty for all of
+    // them (recheck). checks queued while one runs are merged into the next round
+    void start_check(std::vector<char> pieces);
+    void check_pieces(std::vector<char> pieces);   // one round, on a disk thread
+    std::vector<char> check_queue_;     // pieces still to check, guarded by piece_mutex_
+    bool check_scheduled_{ false };     // a check job is queued or running, guarded by piece_mutex_
+    std::atomic<bool> checking_{ false };
+    std::atomic<bool> stopping_{ false };   // set by the destructor, a running check gives up
 
     enum class BlockState { NotRequested, Requested, Received };
 
     struct InFlightBlock {
         std::chrono::steady_clock::time_point sent_time{};
         std::weak_ptr<PeerConnection> peer{};
+        std::weak_ptr<PeerConnection> racer{};  // asked too once the block ran late, at most one
+        bool raced{ false };
     };
 
     struct PieceBuffer {
@@ -94,49 +172,112 @@ private:
         std::vector<InFlightBlock> in_flight_blocks;
         size_t bytes_written = 0;
         bool is_complete = false;
+        bool verifying = false;     // every block is in, the hash runs on the hash pool
     };
 
     struct OutputFile {        // do we need this at all?
         std::string path;
         size_t start, length;
+        bool allocated{ false };   // lazy allocation already done
+        FilePriority priority{ FilePriority::Normal };  // guarded by piece_mutex_ once files_ is set up
+        bool in_part_file{ false }; // skipped and never created, its bytes go to the part file
+        bool unsynced{ false };     // written since the last sync_files, guarded by file_io_mutex_
     };
 
+    // bytes of skipped files that share a piece with wanted files live here instead,
+    // at their absolute torrent offset in a sparse file
+    std::string part_file_name_;
+    std::vector<FilePriority> file_priorities_;     // what the user asked for, guarded by piece_mutex_
+    FilePriority file_priority(size_t index) const; // missing entries are Normal, under piece_mutex_
+    std::vector<FilePriority> piece_priorities_;    // highest priority of the files a piece overlaps
+    size_t wanted_pieces_{};
+    Bitfield wanted_bits_;          // piece_priorities_ as bitfields, guarded by piece_mutex_ like them
+    Bitfield high_priority_bits_;
+
+    void update_piece_priorities();
+    bool all_wanted_complete() const;
+    void create_file(const OutputFile& f);
+    void move_from_part_file(OutputFile& f);   // a skipped file becomes wanted, under file_io_mutex_
+
+    AllocationMode allocation_mode_{ AllocationMode::Sparse };
+    void allocate_files();
+
     std::vector<OutputFile> files_;
 
     std::vector<PieceBuffer> pieces_;
+
+    // written pieces hand their buffer to the next piece instead of freeing it, a fresh multi MiB
+    // buffer comes from mmap and costs a page fault per 4 KiB touched. guarded by piece_mutex_
+    static constexpr size_t max_idle_buffer_bytes_ = 32 << 20;
+    std::vector<std::vector<unsigned char>> idle_buffers_;  // capacity piece_length_ each
+    std::vector<unsigned char> take_buffer();
+    void recycle_buffer(std::vector<unsigned char>& data);
+
+    // deadlines of time critical pieces, guarded by piece_mutex_
+    std::map<int, std::chrono::steady_clock::time_point> piece_deadlines_;
+    std::condition_variable piece_written_cv_;
+
+    // a block of the most urgent piece is requested again from another peer once it's this late
+    static constexpr auto duplicate_request_after_{ std::chrono::milliseconds(500) };
+    std::optional<int> pick_block(int piece_index, std::chrono::steady_clock::time_point sent_time, const std::weak_ptr<PeerConnection>& peer);
     size_t piece_length_;
     size_t total_length_;
     
-    const std::vector<std::array<unsigned char, 20>>& piece_hashes_;
+    PieceHashes piece_hashes_; // view into the torrent's metadata storage
 
-    // Writer thread machinery
+    // Writer machinery, disk work runs on the session's pool so idle torrents cost no threads
 
     std::queue<int> completed_pieces_;
+    size_t write_queue_bytes_{};            // data of completed_pieces_ and the piece being written, guarded by write_mutex_
+    size_t write_queue_high_{ 64 << 20 };   // bytes, guarded by write_mutex_
+    size_t write_queue_low_{ 32 << 20 };
+    static constexpr size_t max_write_queue_depth_ = 1024;    // pieces, for torrents with tiny ones
+    std::atomic<bool> write_backlogged_{ false };
     std::mutex write_mutex_;
     std::mutex piece_mutex_;
-    std::condition_variable write_cv_;
-    std::thread writer_thread_;
-    std::atomic<bool> stop_writer_{ false };
+    std::condition_variable write_cv_;      // signalled whenever pending_disk_jobs_ drops
+    bool writer_scheduled_{ false };        // a flush job is queued or running, guarded by write_mutex_
+    size_t pending_disk_jobs_{};            // jobs on the disk or hash pool that still reference us, guarded by write_mutex_
 
-    bool verify_hash(int index, const std::vector<unsigned char>& data);
-    void write_piece(int index, const std::vector<unsigned char>& data);
-    void writer_thread_func();
+    ThreadPool& disk_pool_;
+    ThreadPool& hash_pool_;
 
-    // timeout machinery
-    std::thread timeout_thread_;
-    std::atomic<bool> stop_timeout_{ false };
-    std::condition_variable timeout_cv_;
+    void post_disk_job(std::function<void()> job);
+    void post_job(ThreadPool& pool, std::function<void()> job);   // counted like disk jobs
 
-    void timeout_thread_func();
+    bool verify_hash(int index, const std::vector<unsigned char>& data);
+    void piece_verified(int piece_index, bool ok);  // on the hash thread that checked it
+
+    // map an absolute torrent offset onto the files it spans. the parts are written back to back,
+    // with one pwritev per file however many buffers they come in
+    void write_range(size_t offset, std::span<const std::span<const unsigned char>> parts);
+    void write_range(size_t offset, const unsigned char* data, size_t length);
+    bool read_range(size_t offset, unsigned char* out, size_t length);
+    void flush_completed_pieces();
+    void write_pieces(std::span<const int> run);    // consecutive verified pieces, then release their buffers
+
+    // written data is synced to disk once this much piles up, and before every resume save so the
+    // resume data never claims a piece the page cache could still lose
+    static constexpr size_t sync_every_bytes_ = 64 << 20;
+    size_t unsynced_bytes_{};               // guarded by file_io_mutex_
+    bool part_file_unsynced_{ false };
+    void sync_files(size_t min_bytes = 0);
+    bool update_write_backlog();    // under write_mutex_, true when requesting may resume
 
     // Stats counter
 
     Stats& stats_;
 
-    // peer list
+    // peer registry, removal swaps the last entry into the freed slot
+    struct PeerEntry {
+        const PeerConnection* key;
+        std::weak_ptr<PeerConnection> conn;
+    };
     std::mutex peer_list_mutex_;
-    std::vector<std::weak_ptr<PeerConnection>> peer_connections;
+    std::vector<PeerEntry> peer_connections;
+    std::unordered_map<const PeerConnection*, size_t> peer_slots_;  // index into peer_connections
     void notify_all_peers(int piece_index);
+    void refresh_peer_interest();   // after what we want changed under the peers' feet
 
     // file i/o
     std::mutex file_io_mutex_;
@@ -144,7 +285,7 @@ private:
     // my bitfield
     void update_my_bitfield(int piece_index);
     std::mutex my_bitfield_mutex_;
-    std::vector<uint8_t> my_bitfield_;
+    Bitfield my_bitfield_;
 
     std::atomic<bool> is_torrent_complete{ false };
 };
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <unordered_map>
+#include <memory>
+#include <string>
+#include <mutex>
+
+#include <ThreadPool.hpp>
+#include <Torrent.hpp>
+#include <Metrics.hpp>
+#include <Dht.hpp>
+#include <Lsd.hpp>
+#include <Utp.hpp>
+
+struct SessionOptions {
+    uint16_t listen_port{ 31616 };     // 0 picks a free port
+    std::string peer_id{ "-CT0001-123456789012" };
+    size_t disk_threads{ 2 };
+    size_t max_connections{ 200 };  // peer connections over all torrents, on top of each torrent's own limit
+    size_t tracker_threads{ 4 };
+    std::string metrics;    // "<port>" or "unix:<path>" to export prometheus metrics, empty for none
+    std::string trace;      // chrome trace of the block/piece lifecycle, written here when run() returns
+
+    // uTP peers on the listen port number (UDP). inbound ones are accepted, outbound connections
+    // try uTP first and fall back to TCP
+    bool utp{ true };
+
+    // mainline DHT on the same UDP socket, private torrents never use it
+    bool dht{ true };
+    std::vector<std::string> dht_bootstrap{ "router.bittorrent.com:6881", "dht.transmissionbt.com:6881", "router.utorrent.com:6881" };
+    std::filesystem::path dht_state{ "dht.state" };     // node id and known nodes between runs, empty for none
+
+    // local service discovery, multicast announces to find peers on the LAN. private torrents never use it
+    bool lsd{ true };
+};
+
+// one engine for many torrents: owns the io_context, the listening socket,
+// the disk/hash/tracker workers and routes inbound peers by info_hash
+class Session {
+public:
+    explicit Session(const SessionOptions& options = {});
+    ~Session();
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    // call before run() or from the io_context's thread
+    std::shared_ptr<Torrent> add_torrent(Metadata metadata, const TorrentOptions& options = {});
+
+    void run();     // blocks until stop()
+    void stop();    // safe to call from any thread
+
+    boost::asio::io_context& io() { return io_; }
+    ThreadPool& disk_pool() { return disk_pool_; }
+    ThreadPool& hash_pool() { return hash_pool_; }
+    ThreadPool& tracker_pool() { return tracker_pool_; }
+
+    // tracker clients are shared between all torrents announcing to the same URL
+    std::shared_ptr<BaseTracker> tracker(const std::string& url);
+
+    const std::string& peer_id() const { return options_.peer_id; }
+
+    // room for another peer connection under the session wide limit, inbound sockets still
+    // waiting for their handshake count too. io thread only
+    bool can_connect() const;
+    uint16_t listen_port() const { return listen_port_; }
+
+    // null when the DHT is off or its port was taken, io thread only
+    Dht* dht() { return dht_.get(); }
+
+    // null when LSD is off or the group couldn't be joined, io thread only
+    Lsd* lsd() { return lsd_.get(); }
+
+    // null when uTP is off or the UDP port was taken, io thread only
+    UtpContext* utp() { return utp_.get(); }
+
+private:
+    void start_accept();
+    void read_handshake(std::shared_ptr<PeerSocket> socket);
+    size_t pending_handshakes_{};   // accepted, handshake not read yet
+    static constexpr auto handshake_timeout_{ std::chrono::seconds(10) };
+    void tick();
+    void display_stats();
+    std::string render_metrics();
+
+    SessionOptions options_;
+
+    // members are torn down bottom-up: torrents flush through the pools,
+    // and pool jobs may still post to the io_context while the pools shut down
+    boost::asio::io_context io_;
+    ThreadPool disk_pool_;
+    ThreadPool hash_pool_;
+    ThreadPool tracker_pool_;
+
+    tcp::acceptor acceptor_;
+    uint16_t listen_port_{};    // what the acceptor actually got, announced to trackers
+    boost::asio::steady_timer tick_timer_;
+    std::unique_ptr<MetricsServer> metrics_;
+    std::unique_ptr<UdpSocket> udp_;    // shared by uTP and the DHT
+    std::unique_ptr<UtpContext> utp_;
+    std::unique_ptr<Dht> dht_;
+    std::unique_ptr<Lsd> lsd_;
+    bool stopped_{ false };
+
+    // keyed by the raw 20 byte info hash
+    std::unordered_map<std::string, std::shared_ptr<Torrent>> torrents_;
+
+    std::mutex trackers_mutex_;
+    std::unordered_map<std::string, std::shared_ptr<BaseTracker>> trackers_;
+};
@@ -1,7 +1,14 @@
+#pragma once
+
 #include <print>
+#include <format>
 #include <atomic>
 #include <chrono>
 #include <iostream>
+#include <optional>
+#include <string>
+
+#include <Counters.hpp>
 
 class Stats {
 public:
@@ -9,10 +16,63 @@ public:
     std::atomic<int> connected_peers{};
     std::atomic<int> completed_pieces{};
     std::atomic<int> total_pieces{};
-    std::atomic<size_t> downloaded_bytes{};
-    std::atomic<size_t> uploaded_bytes{};
     std::atomic<size_t> total_size{};
+    std::atomic<size_t> piece_length{};
     std::atomic<double> progress{};
+    std::atomic<int> checked_pieces{};
+    std::atomic<bool> checking{ false };
+    std::atomic<bool> fetching_metadata{ false };  // a magnet waiting for its info dictionary, nothing else is known yet
+
+    // bumped for every block in and out, from whichever thread handles it
+    ShardedCounter downloaded_bytes;
+    ShardedCounter uploaded_bytes;
+
+    RateEstimator download_rate;
+    RateEstimator upload_rate;
+
+    // where the time goes, exported by the metrics endpoint
+    LatencyHistogram block_latency;         // request sent -> block arrived
+    LatencyHistogram piece_verify_time;     // SHA1 of a completed piece
+    LatencyHistogram disk_write_time;       // writing a verified piece out, its share of the run it went out in
+    std::atomic<size_t> write_queue_depth{};    // verified pieces waiting for the writer
+    std::atomic<size_t> write_queue_bytes{};    // their data, still in memory until it's on disk
+    std::atomic<bool> write_backlogged{ false };    // past the high water mark, no new requests go out
+    std::atomic<size_t> write_backlog_events{};     // how often that happened
+    std::atomic<size_t> pending_disk_jobs{};    // jobs of this torrent queued or running on the disk pool
+
+    // called once per tick from the io thread
+    void update_rates() {
+        auto now = std::chrono::steady_clock::now();
+
+        // a recheck moves downloaded_bytes by the whole file, don't count that as speed
+        if (checking.load()) download_rate.reset(downloaded_bytes.load(), now);
+        else download_rate.sample(downloaded_bytes.load(), now);
+
+        upload_rate.sample(uploaded_bytes.load(), now);
+    }
+
+    size_t bytes_left() const {
+        auto left = total_pieces.load() - completed_pieces.load();
+        return left > 0 ? (size_t)left * piece_length.load() : 0;
+    }
+
+    // nullopt when we're not moving
+    std::optional<std::chrono::seconds> eta() const {
+        auto rate = download_rate.rate();
+        if (rate < 1.0) return std::nullopt;
+        return std::chrono::seconds((long long)((double)bytes_left() / rate));
+    }
+
+    static std::string format_rate(double bytes_per_sec) {
+        if (bytes_per_sec >= 1024.0 * 1024.0) return std::format("{:.2f} MB/s", bytes_per_sec / (1024.0 * 1024.0));
+        return std::format("{:.1f} KB/s", bytes_per_sec / 1024.0);
+    }
+
+    static std::string format_eta(std::optional<std::chrono::seconds> eta) {
+        if (!eta) return "--:--:--";
+        auto s = eta->count();
+        return std::format("{:02}:{:02}:{:02}", s / 3600, (s / 60) % 60, s % 60);
+    }
 
     void display() const {
             auto peers = connected_peers.load();
@@ -21,10 +81,23 @@ public:
             auto down = downloaded_bytes.load();
             auto up = uploaded_bytes.load();
             auto total = total_size.load();
-            auto prog = progress.load();
 
-            std::print("\rPeers: {}, Pieces: {}/{}, Downloaded: {} MB, Uploaded: {} MB, Total size: {} MB, Progress: {:.2f}%", 
-            peers, comp_pieces, tot_pieces, down / (1024 * 1024), up / (1024 * 1024), total / (1024 * 1024), ((double)comp_pieces / (double)tot_pieces) * 100);
+            if (fetching_metadata.load()) {
+                std::print("\rFetching metadata...");
+                std::flush(std::cout);
+                return;
+            }
+
+            if (checking.load()) {
+                std::print("\rChecking pieces: {}/{}", checked_pieces.load(), tot_pieces);
+                std::flush(std::cout);
+                return;
+            }
+
+            std::print("\rPeers: {}, Pieces: {}/{}, Downloaded: {} MB, Uploaded: {} MB, Total size: {} MB, Progress: {:.2f}%, Down: {}, Up: {}, ETA: {}{}",
+            peers, comp_pieces, tot_pieces, down / (1024 * 1024), up / (1024 * 1024), total / (1024 * 1024), ((double)comp_pieces / (double)tot_pieces) * 100,
+            format_rate(download_rate.rate()), format_rate(upload_rate.rate()), comp_pieces >= tot_pieces ? "done" : format_eta(eta()),
+            write_backlogged.load() ? std::format(", waiting on disk ({} MB queued)", write_queue_bytes.load() / (1024 * 1024)) : "");
             std::flush(std::cout);
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/asio.hpp>
+
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#include <TorrentFile.hpp>
+#include <PieceManager.hpp>
+
+// local HTTP endpoint serving the torrent's files with Range support while they download.
+// GET /            lists the files
+// GET /<index>     streams file <index>, reads block until the pieces they need are on disk
+class StreamServer {
+public:
+    StreamServer(PieceManager& pm, const Metadata& metadata, uint16_t port);
+    ~StreamServer();
+
+    void start();
+    void stop();
+
+private:
+    using tcp = boost::asio::ip::tcp;
+
+    struct FileEntry {
+        std::string path;
+        size_t start, length;
+    };
+
+    struct Connection {
+        std::weak_ptr<tcp::socket> socket;
+        std::thread thread;
+        std::atomic<bool> done{ false };    // serve() returned, the thread only needs joining
+    };
+
+    void accept_loop();
+    void serve(std::shared_ptr<tcp::socket> socket, std::atomic<bool>& done);
+    bool stream_range(tcp::socket& socket, const FileEntry& file, size_t first, size_t last);
+
+    // mark the pieces in front of the reader as time critical, closest ones first. `window` is what
+    // this reader asked for, a piece keeps its deadline until every reader that wants it is past it
+    void prioritize(std::set<int>& window, size_t offset);
+    void release(std::set<int>& window, int below = std::numeric_limits<int>::max());
+
+    static constexpr size_t read_ahead_pieces_{ 8 };
+    static constexpr auto first_piece_deadline_{ std::chrono::milliseconds(500) };
+    static constexpr auto per_piece_deadline_{ std::chrono::milliseconds(250) };
+
+    PieceManager& piece_manager_;
+    std::vector<FileEntry> files_;
+    uint16_t port_;
+
+    boost::asio::io_context io_;
+    tcp::acceptor acceptor_;
+    std::thread accept_thread_;
+
+    std::mutex connections_mutex_;
+    std::list<Connection> connections_;     // finished ones are joined by the accept loop
+
+    std::mutex deadlines_mutex_;
+    std::map<int, size_t> deadline_readers_;    // piece -> readers whose window holds it
+
+    std::atomic<bool> stopped_{ false };
+};
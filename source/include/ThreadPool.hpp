@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <string>
+
+#include <Trace.hpp>
+
+// fixed set of worker threads draining a shared job queue
+class ThreadPool {
+public:
+    // name labels the workers in traces, "disk" gives disk-0, disk-1, ...
+    explicit ThreadPool(size_t threads = std::max(1u, std::thread::hardware_concurrency()), std::string name = {}) {
+        for (size_t i = 0; i < threads; ++i) {
+            workers_.emplace_back(&ThreadPool::worker_func, this, name.empty() ? name : name + "-" + std::to_string(i));
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::scoped_lock<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& worker : workers_) if (worker.joinable()) worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void post(std::function<void()> job) {
+        {
+            std::scoped_lock<std::mutex> lock(mutex_);
+            jobs_.push(std::move(job));
+        }
+        cv_.notify_one();
+    }
+
+    // drop jobs that haven't started yet, running ones finish normally
+    void clear() {
+        std::scoped_lock<std::mutex> lock(mutex_);
+        std::queue<std::function<void()>>().swap(jobs_);
+    }
+
+    size_t size() const { return workers_.size(); }
+
+    // jobs waiting for a worker
+    size_t pending() {
+        std::scoped_lock<std::mutex> lock(mutex_);
+        return jobs_.size();
+    }
+
+private:
+    void worker_func(std::string name) {
+        if (!name.empty()) trace::set_thread_name(name);
+
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [&] { return stop_ || !jobs_.empty(); });
+                if (stop_ && jobs_.empty()) return;
+
+                job = std::move(jobs_.front());
+                jobs_.pop();
+            }
+            job();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::queue<std::function<void()>> jobs_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_{ false };
+};
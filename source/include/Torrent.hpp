@@ -0,0 +1,90 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <deque>
+#include <vector>
+#include <map>
+#include <memory>
+#include <optional>
+#include <filesystem>
+
+#include <TorrentFile.hpp>
+#include <Stats.hpp>
+#include <Peer.hpp>
+#include <PieceManager.hpp>
+#include <PeerConnection.hpp>
+#include <StreamServer.hpp>
+#include <BaseTracker.hpp>
+#include <Metrics.hpp>
+#include <MetadataFetcher.hpp>
+
+class Session;
+
+struct TorrentOptions {
+    bool force_recheck{ false };    // hash existing data even if resume data is present
+    AllocationMode allocation{ AllocationMode::Sparse };
+    std::optional<uint16_t> stream_port;   // serve the files over local HTTP while downloading
+    std::map<size_t, FilePriority> file_priorities; // by file index, everything else is Normal
+    std::filesystem::path save_path;    // files, resume and part files go here, default is the working directory
+    size_t max_write_queue_bytes{ 64 << 20 };   // verified pieces held in memory for a slow disk before requesting stops
+    size_t max_connections{ 50 };   // peers dialed or accepted at once, the rest wait in the candidate pool
+};
+
+// per torrent state hosted by a Session. no threads of its own: disk work goes to the
+// session's pools and everything else runs on the session's io_context
+class Torrent : public std::enable_shared_from_this<Torrent> {
+public:
+    // a magnet's metadata has no info dictionary yet, the torrent fetches it from its peers first
+    Torrent(Session& session, Metadata metadata, const TorrentOptions& options);
+    ~Torrent();
+
+    void start();
+    void stop();
+    void tick();
+
+    // every peer source (trackers, PEX, DHT, LSD) ends up here. local ones came from the LAN. they go
+    // to the candidate pool and are dialed while the torrent and the session are below their limits
+    void add_peers(const std::vector<Peer>& peers, bool local = false);
+    void attach_inbound(PeerSocket socket, const std::array<char, 68>& handshake);
+
+    size_t open_connections() const;    // dialing or connected, io thread only
+
+    const Metadata& metadata() const { return metadata_; }
+    const std::array<uint8_t, 20>& info_hash() const { return metadata_.info_hash; }
+    Stats& stats() { return stats_; }
+
+    // torrent and per peer samples for the session's metrics endpoint, io thread only
+    void write_metrics(MetricsWriter& w) const;
+
+private:
+    void announce();
+    PeerConnection::Extensions extensions();
+    bool is_local(const Peer& peer) const;
+    void connect_candidates();     // dial from the pool into free connection slots
+
+    void init_storage();    // the piece manager and what hangs off it, once the info dictionary is known
+    std::unique_ptr<PieceManager> make_piece_manager();    // any thread, metadata_ is settled by then
+    void start_stream_server();
+    void on_metadata_piece(const PeerConnection& peer, int piece, std::span<const uint8_t> data);
+    void on_metadata();
+    void on_storage(std::unique_ptr<PieceManager> pm, const std::string& error);   // back on the io thread
+
+    Session& session_;
+    Metadata metadata_;
+    TorrentOptions options_;
+    Stats stats_;
+
+    std::unique_ptr<PieceManager> pm_;                  // null while fetching the metadata
+    std::unique_ptr<MetadataFetcher> metadata_fetcher_;
+    std::unique_ptr<StreamServer> stream_server_;
+
+    std::vector<std::shared_ptr<BaseTracker>> trackers_;
+    std::vector<std::shared_ptr<PeerConnection>> connections_;
+    std::deque<Peer> candidates_;   // heard of, not dialed yet. LAN peers in front
+    static constexpr size_t max_candidates_{ 1000 };
+    std::vector<boost::asio::ip::address> lan_addresses_;  // hosts local service discovery found
+
+    boost::asio::steady_timer announce_timer_;
+    bool started_{ false };
+    bool stopped_{ false };
+};
@@ -6,6 +6,9 @@
 #include <string>
 #include <optional>
 #include <array>
+#include <span>
+#include <memory>
+#include <string_view>
 #include <print>
 #include <ranges>
 #include <cstring>
@@ -19,16 +22,38 @@ struct TorrentFile {
 	uint64_t length;
 };
 
+// view over the concatenated 20 byte SHA1 hashes of the "pieces" string,
+// points straight into the buffer the torrent was parsed from
+class PieceHashes {
+public:
+	PieceHashes() = default;
+	explicit PieceHashes(std::span<const uint8_t> raw) : raw_(raw) {}
+
+	size_t size() const { return raw_.size() / 20; }
+	std::span<const uint8_t, 20> operator[](size_t index) const { return raw_.subspan(index * 20).first<20>(); }
+
+	// the same hashes in a copy of the buffer they point into
+	PieceHashes rebased(std::string_view from, std::string_view to) const {
+		if (raw_.empty()) return {};
+		auto offset = reinterpret_cast<const char*>(raw_.data()) - from.data();
+		return PieceHashes({ reinterpret_cast<const uint8_t*>(to.data()) + offset, raw_.size() });
+	}
+
+private:
+	std::span<const uint8_t> raw_;
+};
+
 struct Metadata {
 	std::string announce;							     // primary tracker URL (for older torrents)
 	std::vector<std::vector<std::string>> announce_list; // list of tracker URLs by hierarchy
 
 	std::string name;																	// ------
 	uint64_t piece_length;																//      | <-- contained in
-	std::vector<std::array<uint8_t, 20>> piece_hashes;  // each hash is 20 bytes		//      | <-- info dict
+	PieceHashes piece_hashes;							// each hash is 20 bytes		//      | <-- info dict
 	std::vector<TorrentFile> files;						// for multi-file torrents		// ------
 
 	std::array<uint8_t, 20> info_hash;					// SHA1 hash of the info dictionary
+	bool is_private{ false };							// BEP 27, peers only come from the trackers
 
 	// OPTIONALS
 
@@ -39,6 +64,26 @@ struct Metadata {
 	// -- END OPTIONALS
 
 	uint64_t total_size{};
+
+	std::string_view info_bytes;						// raw bencoded info dictionary
+	std::shared_ptr<const void> storage;				// keeps the buffer behind piece_hashes/info_bytes alive
+
+	// false for a magnet until its info dictionary came in from peers
+	bool has_info() const { return !info_bytes.empty(); }
 };
 
-Metadata parse_torrent(const std::string&);
\ No newline at end of file
+// the caller has to keep the input alive for as long as the returned metadata is used
+Metadata parse_torrent(std::string_view);
+
+// a temporary is taken over instead, the metadata keeps it alive
+Metadata parse_torrent(std::string&&);
+
+// map a .torrent file and parse it in place, the metadata keeps a copy of the info dictionary
+Metadata load_torrent(const std::string& path);
+
+// magnet:?xt=urn:btih:<hex or base32 hash>&dn=<name>&tr=<tracker>... only the info hash, the
+// trackers and maybe a name, the info dictionary has to come from peers (BEP 9)
+Metadata parse_magnet(std::string_view uri);
+
+// an info dictionary fetched from peers, the metadata owns a copy of it
+Metadata parse_info(std::string_view info);
\ No newline at end of file
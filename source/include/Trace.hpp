@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// optional event tracing of the block/piece lifecycle. every thread records into its own
+// fixed size ring (oldest events are overwritten), so recording is a relaxed load when
+// tracing is off and a couple of plain stores when it's on. the dump is Chrome trace JSON,
+// which chrome://tracing, Perfetto (ui.perfetto.dev) and speedscope all open
+namespace trace {
+
+enum class Event : uint8_t {
+    RequestSent,        // piece, begin
+    BlockReceived,      // piece, begin
+    HashBegin,          // piece
+    HashEnd,            // piece, 1 if the hash matched
+    PieceQueued,        // piece, handed to the writer
+    WriteBegin,         // piece
+    WriteEnd,           // piece
+    HaveBroadcast,      // piece, number of peers it went out to
+    RequestTimeout,     // piece, begin
+};
+
+// call once, before or after the threads that record exist. capacity is per thread
+void start(size_t events_per_thread = 1 << 16);
+void stop();
+
+// readable while recording, events overwritten during the dump are dropped
+bool write_chrome_json(const std::string& path);
+
+// label for the calling thread in the trace viewer
+void set_thread_name(const std::string& name);
+
+namespace detail {
+    extern std::atomic<bool> enabled;
+    void record(Event event, int32_t piece, int32_t arg);
+}
+
+inline void event(Event event, int32_t piece, int32_t arg = 0) {
+    if (detail::enabled.load(std::memory_order_relaxed)) detail::record(event, piece, arg);
+}
+
+}
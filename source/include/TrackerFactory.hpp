@@ -1,3 +1,5 @@
+#pragma once
+
 #include <memory>
 #include <string>
 #include <stdexcept>
@@ -7,7 +9,7 @@
 #include <HttpsTracker.hpp>
 #include <UdpTracker.hpp>
 
-std::shared_ptr<BaseTracker> make_tracker(const std::string& url) {
+inline std::shared_ptr<BaseTracker> make_tracker(const std::string& url) {
     if (url.rfind("http://", 0) == 0) return std::make_shared<HttpTracker>(url);
     else if (url.rfind("https://", 0) == 0) return std::make_shared<HttpsTracker>(url);
     else if (url.rfind("udp://", 0) == 0) return std::make_shared<UdpTracker>(url);
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include <array>
+#include <functional>
+#include <span>
+#include <vector>
+
+using udp = boost::asio::ip::udp;
+
+// the one UDP socket a session has, on the same port number it listens on for TCP peers.
+// every datagram goes to the first handler that claims it: the DHT takes bencoded messages,
+// uTP takes anything with a uTP header. io thread only
+class UdpSocket {
+public:
+    using Handler = std::function<bool(const udp::endpoint& from, std::span<const uint8_t> packet)>;
+
+    UdpSocket(boost::asio::io_context& io, uint16_t port)
+        : socket_(io, udp::endpoint(udp::v4(), port)) {
+        // uTP sends from inside its ack processing, a full send buffer drops the packet like the
+        // network would instead of stalling the io thread
+        socket_.non_blocking(true);
+
+        // a few windows of uTP bursts between io loop turns, the default buffers drop them
+        boost::system::error_code ec;
+        socket_.set_option(udp::socket::receive_buffer_size(2 << 20), ec);
+        socket_.set_option(udp::socket::send_buffer_size(2 << 20), ec);
+    }
+
+    UdpSocket(const UdpSocket&) = delete;
+    UdpSocket& operator=(const UdpSocket&) = delete;
+
+    void add_handler(Handler handler) { handlers_.push_back(std::move(handler)); }
+
+    void start() { receive(); }
+
+    void close() {
+        boost::system::error_code ec;
+        socket_.close(ec);
+    }
+
+    // best effort, like the datagram it is
+    void send(const udp::endpoint& to, std::span<const uint8_t> packet) {
+        boost::system::error_code ec;
+        socket_.send_to(boost::asio::buffer(packet.data(), packet.size()), to, 0, ec);
+    }
+
+    udp::socket& socket() { return socket_; }
+    uint16_t port() const { return socket_.local_endpoint().port(); }
+
+private:
+    void receive() {
+        socket_.async_receive_from(boost::asio::buffer(buf_), from_, [this](boost::system::error_code ec, size_t bytes) {
+            if (ec == boost::asio::error::operation_aborted || !socket_.is_open()) return;
+            if (!ec && from_.port() != 0) {
+                std::span<const uint8_t> packet(buf_.data(), bytes);
+                for (auto& handler : handlers_) if (handler(from_, packet)) break;
+            }
+            receive();
+        });
+    }
+
+    udp::socket socket_;
+    std::vector<Handler> handlers_;
+    std::array<uint8_t, 2048> buf_{};
+    udp::endpoint from_;
+};
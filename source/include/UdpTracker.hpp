@@ -32,7 +32,7 @@ class UdpTracker : public BaseTracker {
 public:
     UdpTracker(const std::string& url) : BaseTracker(url) {}
 
-    TrackerResponse announce(const std::array<uint8_t, 20>& infoHash, const std::string& peerId, const std::atomic<size_t>& uploaded, const std::atomic<size_t>& downloaded, const std::atomic<size_t>& total) override;
+    TrackerResponse announce(const std::array<uint8_t, 20>& infoHash, const std::string& peerId, uint16_t port, size_t uploaded, size_t downloaded, size_t total) override;
 
     std::string protocol() const override { return "udp"; }
 
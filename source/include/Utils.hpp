@@ -6,6 +6,10 @@
 #include <array>
 #include <cstdint>
 #include <iomanip>
+#include <string_view>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 struct ParsedUrl {
     std::string host;
@@ -17,6 +21,21 @@ ParsedUrl parse_url(const std::string& url);
 
 std::string read_from_file(const std::string&);
 
+// read-only mapping of a whole file, pages are faulted in only when touched.
+// the file itself is closed once mapped. keep the view short lived, a file
+// truncated under it turns the next page fault into a SIGBUS
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path);
+
+    std::string_view view() const {
+        return { static_cast<const char*>(region_.get_address()), region_.get_size() };
+    }
+
+private:
+    boost::interprocess::mapped_region region_;
+};
+
 inline std::string percent_encode(const std::array<uint8_t, 20>& info_hash) {
     std::ostringstream oss;
     for (const auto& ch: info_hash) {
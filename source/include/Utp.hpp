@@ -0,0 +1,245 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include <array>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <span>
+#include <vector>
+
+#include <UdpSocket.hpp>
+
+// uTP (BEP 29): reliable byte streams over the session's UDP socket. LEDBAT congestion
+// control keeps the queueing delay we add to the path near a 100 ms target, so a seeding
+// client backs off as soon as anything else on the uplink starts to wait behind it.
+// selective acks repair losses without resending the whole window, and packets are paced
+// over the round trip instead of going out in window sized bursts. io thread only
+
+class UtpContext;
+
+class UtpStream : public std::enable_shared_from_this<UtpStream> {
+public:
+    using executor_type = boost::asio::any_io_executor;
+    using Handler = std::move_only_function<void(boost::system::error_code, size_t)>;
+
+    // made by UtpContext::connect and for inbound SYNs
+    UtpStream(UtpContext& context, const udp::endpoint& remote, uint16_t recv_id, uint16_t send_id);
+
+    UtpStream(const UtpStream&) = delete;
+    UtpStream& operator=(const UtpStream&) = delete;
+
+    executor_type get_executor();
+
+    // AsyncReadStream / AsyncWriteStream, so boost::asio::async_read and async_write work on it.
+    // a write completes once its bytes are in the send buffer, a read once anything arrived
+    template <typename MutableBufferSequence, typename ReadHandler>
+    void async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler) {
+        start_read({ boost::asio::buffer_sequence_begin(buffers), boost::asio::buffer_sequence_end(buffers) },
+                   Handler(std::forward<ReadHandler>(handler)));
+    }
+
+    template <typename ConstBufferSequence, typename WriteHandler>
+    void async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler) {
+        start_write({ boost::asio::buffer_sequence_begin(buffers), boost::asio::buffer_sequence_end(buffers) },
+                    Handler(std::forward<WriteHandler>(handler)));
+    }
+
+    // pending operations complete with operation_aborted, what was written still goes out before the FIN
+    void close();
+    bool is_open() const;
+
+    const udp::endpoint& remote_endpoint() const { return remote_; }
+
+    size_t congestion_window() const { return (size_t)cwnd_; }
+    std::chrono::microseconds rtt() const { return rtt_; }
+    std::chrono::microseconds queueing_delay() const { return std::chrono::microseconds(our_delay_); }
+
+private:
+    friend class UtpContext;
+
+    using Clock = std::chrono::steady_clock;
+
+    enum class State { SynSent, Connected, FinSent, Closed };
+
+    struct Header {
+        uint8_t type{};
+        uint16_t connection_id{};
+        uint32_t timestamp{};
+        uint32_t timestamp_diff{};
+        uint32_t wnd_size{};
+        uint16_t seq_nr{};
+        uint16_t ack_nr{};
+    };
+
+    struct OutPacket {
+        uint8_t type{};
+        uint16_t seq{};
+        std::vector<uint8_t> data;      // header and payload, the header is refreshed on every send
+        Clock::time_point sent{};
+        int transmissions{};
+        bool in_flight{ false };
+        bool acked{ false };            // selectively, the cumulative ack pops it
+        bool fast_resent{ false };
+    };
+
+    struct PendingWrite {
+        std::vector<boost::asio::const_buffer> buffers;
+        size_t size{};
+        Handler handler;
+    };
+
+    void start_read(std::vector<boost::asio::mutable_buffer> buffers, Handler handler);
+    void start_write(std::vector<boost::asio::const_buffer> buffers, Handler handler);
+    void complete(Handler handler, boost::system::error_code ec, size_t bytes);
+
+    // driven by the context
+    void connect(std::function<void(boost::system::error_code)> handler);
+    void accept(const Header& syn);
+    void incoming(const Header& header, std::span<const uint8_t> sack, std::span<const uint8_t> payload);
+    void tick(Clock::time_point now);
+    void detach();
+
+    void process_ack(const Header& header, std::span<const uint8_t> sack, Clock::time_point now);
+    void packet_acked(OutPacket& packet, Clock::time_point now, size_t& acked_bytes);
+    void detect_losses();
+    void on_delay_sample(uint32_t delay, Clock::time_point now);
+    void grow_window(size_t acked_bytes, size_t flight_before);
+    void loss_event(uint16_t seq, bool timeout);
+    void mark_lost(OutPacket& packet);
+    void on_timeout();
+
+    void receive_data(uint16_t seq, std::span<const uint8_t> payload);
+    void receive_fin(uint16_t seq);
+    void deliver_read();
+    void pump_writes();
+
+    void flush();
+    bool window_allows(size_t bytes) const;
+    void transmit(OutPacket& packet, Clock::time_point now);
+    void send_ack();
+    void schedule_ack();
+    void fill_header(uint8_t* out, uint8_t type, uint16_t seq_nr, bool sack) const;
+    uint32_t advertised_window() const;
+
+    void fail(boost::system::error_code ec);
+    void set_closed();
+
+    static constexpr size_t header_size = 20;
+    static constexpr size_t packet_size = 1400;     // fits the usual MTU after IP and UDP headers
+    static constexpr size_t max_payload = packet_size - header_size;
+    static constexpr size_t min_window = packet_size;
+    static constexpr size_t max_window = 4 << 20;
+    static constexpr size_t send_buffer_limit = 1 << 20;
+    static constexpr size_t recv_window = 1 << 20;
+    static constexpr uint32_t target_delay_us = 100'000;
+    static constexpr double max_cwnd_increase_per_rtt = 3000;
+    static constexpr uint16_t max_reorder = 1024;
+    static constexpr auto min_rto = std::chrono::milliseconds(500);
+    static constexpr auto max_rto = std::chrono::seconds(60);
+    static constexpr auto keepalive_interval = std::chrono::seconds(30);
+    static constexpr auto idle_timeout = std::chrono::seconds(120);
+    static constexpr int max_syn_retries = 1;     // a peer without uTP costs 3 s before the TCP fallback
+    static constexpr int max_retries = 6;
+
+    UtpContext* context_;
+    udp::endpoint remote_;
+    uint16_t recv_id_, send_id_;
+    State state_{ State::SynSent };
+    boost::system::error_code error_;
+    bool user_closed_{ false };
+    std::function<void(boost::system::error_code)> connect_handler_;
+
+    // -- sending --
+    uint16_t seq_nr_{ 1 };                  // next sequence number to use
+    std::deque<OutPacket> outgoing_;        // sent and not cumulatively acked, front is seq_nr_ - size()
+    std::vector<uint8_t> send_buffer_;      // written but not packetized yet, from send_offset_
+    size_t send_offset_{};
+    size_t unacked_bytes_{};                // payload held by outgoing_
+    size_t bytes_in_flight_{};              // whole packets, what the window limits
+    std::deque<PendingWrite> pending_writes_;
+    bool fin_queued_{ false };
+    uint16_t last_ack_seen_{};
+    int dup_acks_{};
+
+    // -- congestion control --
+    double cwnd_{ 4 * packet_size };
+    size_t ssthresh_{ max_window };
+    uint32_t peer_wnd_{ recv_window };
+    uint32_t our_delay_{};                  // latest sample minus the base delay, us
+    std::array<uint32_t, 2> base_history_{};    // minimum one way delay per minute, newest first
+    Clock::time_point base_rotated_{};
+    bool have_base_{ false };
+    uint16_t loss_seq_{};                   // packets sent before this were covered by the last cut
+    bool recovering_{ false };
+
+    std::chrono::microseconds rtt_{}, rtt_var_{};
+    Clock::duration rto_{ std::chrono::seconds(1) };
+    Clock::time_point rto_deadline_{};
+    bool rto_armed_{ false };
+    int timeouts_{};
+
+    Clock::time_point next_send_{};         // pacing, packets are spread over the round trip
+    boost::asio::steady_timer pacing_timer_;
+    bool pacing_armed_{ false };
+
+    // -- receiving --
+    uint16_t ack_nr_{};                     // last in order packet received
+    std::vector<uint8_t> recv_buffer_;      // in order bytes the reader hasn't taken, from recv_offset_
+    size_t recv_offset_{};
+    std::map<uint16_t, std::vector<uint8_t>> reorder_;   // out of order payload by seq_nr
+    size_t reorder_bytes_{};
+    bool got_fin_{ false }, eof_{ false };
+    uint16_t eof_seq_{};
+    uint32_t reply_micro_{};                // how long the peer's last packet took to reach us, for the peer's LEDBAT
+    int unacked_packets_{};
+    bool ack_posted_{ false };
+    uint32_t last_wnd_sent_{ recv_window };
+
+    std::vector<boost::asio::mutable_buffer> read_buffers_;
+    Handler read_handler_;
+
+    Clock::time_point last_sent_{}, last_received_{};
+};
+
+// owns every uTP connection on a UdpSocket and claims the datagrams that carry a uTP header
+class UtpContext {
+public:
+    using AcceptHandler = std::function<void(std::shared_ptr<UtpStream>)>;
+    using ConnectHandler = std::function<void(boost::system::error_code, std::shared_ptr<UtpStream>)>;
+
+    UtpContext(boost::asio::io_context& io, UdpSocket& socket);
+    ~UtpContext();
+
+    UtpContext(const UtpContext&) = delete;
+    UtpContext& operator=(const UtpContext&) = delete;
+
+    // inbound connections, from the SYN on
+    void on_accept(AcceptHandler handler) { accept_handler_ = std::move(handler); }
+
+    void connect(const udp::endpoint& remote, ConnectHandler handler);
+
+    size_t connection_count() const { return streams_.size(); }
+
+private:
+    friend class UtpStream;
+
+    using Key = std::pair<udp::endpoint, uint16_t>;     // remote and the id its packets carry to us
+
+    bool incoming(const udp::endpoint& from, std::span<const uint8_t> packet);
+    void send(const udp::endpoint& to, std::span<const uint8_t> packet);
+    void send_reset(const udp::endpoint& to, uint16_t connection_id);
+    void remove(const UtpStream& stream);
+    void tick();
+
+    boost::asio::io_context& io_;
+    UdpSocket& socket_;
+    boost::asio::steady_timer tick_timer_;
+    std::mt19937 rng_;
+    AcceptHandler accept_handler_;
+    std::map<Key, std::shared_ptr<UtpStream>> streams_;
+};
@@ -1,6 +1,10 @@
 #include "Bencode.hpp"
 
-BEncodeParser::BEncodeParser(const std::string& input) : _data(input), pos(0) {}
+#include <cctype>
+#include <charconv>
+#include <tuple>
+
+BEncodeParser::BEncodeParser(std::string_view input, bool reference_pieces) : _data(input), pos(0), _reference_pieces(reference_pieces) {}
 
 BEncodeValue BEncodeParser::parse() {
 	return parse_value();
@@ -39,48 +43,75 @@ int64_t BEncodeParser::parse_int() {
     size_t end = _data.find('e', pos);
     if (end == std::string::npos) throw std::runtime_error("Missing 'e' for integer");
 
-    std::string number = _data.substr(pos, end - pos);
+    int64_t number{};
+    auto [ptr, ec] = std::from_chars(_data.data() + pos, _data.data() + end, number);
+    if (ec != std::errc() || ptr != _data.data() + end) throw std::runtime_error("Invalid integer");
     pos = end + 1;  // move past 'e'
 
-    return std::stoll(number);
+    return number;
 }
 
 std::string BEncodeParser::parse_string() {
+    auto [start, end] = skip_string();
+    return std::string(_data.substr(start, end - start));
+}
+
+// past a string without copying it, where its bytes are
+std::pair<size_t, size_t> BEncodeParser::skip_string() {
     size_t colon = _data.find(':', pos);
     if (colon == std::string::npos) throw std::runtime_error("Missing ':' in string");
 
-    std::string len_str = _data.substr(pos, colon - pos);
-    size_t len = std::stoull(len_str);
+    size_t len{};
+    auto [ptr, ec] = std::from_chars(_data.data() + pos, _data.data() + colon, len);
+    if (ec != std::errc() || ptr != _data.data() + colon) throw std::runtime_error("Invalid string length");
 
     pos = colon + 1;  // skip ':'
 
-    if (pos + len > _data.size()) throw std::runtime_error("String length exceeds input");
+    if (len > _data.size() - pos) throw std::runtime_error("String length exceeds input");
 
-    std::string result = _data.substr(pos, len);
+    size_t start = pos;
     pos += len;  // advance past the string
 
-    return result;
+    return { start, pos };
 }
 
 BEncodeValue::List BEncodeParser::parse_list() {
     BEncodeValue::List list;
+    ++_depth;
     while (pos < _data.size() && _data[pos] != 'e') {
         list.push_back(parse_value());
     }
     if (pos >= _data.size() || _data[pos] != 'e') throw std::runtime_error("Missing 'e' at end of list");
     ++pos;  // skip 'e'
+    --_depth;
     return list;
 }
 
 BEncodeValue::Dict BEncodeParser::parse_dict() {
     BEncodeValue::Dict dict;
+    ++_depth;
     while (pos < _data.size() && _data[pos] != 'e') {
         std::string key = parse_string();
 		size_t val_start = pos;
-        BEncodeValue value = parse_value();
+
+        // only the torrent's own info dictionary, not whatever else is called that further down
+        bool info = _depth == 1 && key == "info";
+        bool pieces = _depth == 2 && _in_info && key == "pieces" && pos < _data.size() && isdigit(_data[pos]);
+
+        BEncodeValue value;
+        if (pieces) {
+            std::tie(_pieces_start, _pieces_end) = skip_string();
+            if (!_reference_pieces) value.value = std::string(_data.substr(_pieces_start, _pieces_end - _pieces_start));
+            else value.value = std::string();
+        }
+        else {
+            if (info) _in_info = true;
+            value = parse_value();
+            if (info) _in_info = false;
+        }
 		size_t val_end = pos;
 
-        if (key == "info") {
+        if (info) {
 			_info_start = val_start;
 			_info_end = val_end;
         }
@@ -88,5 +119,81 @@ BEncodeValue::Dict BEncodeParser::parse_dict() {
     }
     if (pos >= _data.size() || _data[pos] != 'e') throw std::runtime_error("Missing 'e' at end of dict");
     ++pos;  // skip 'e'
+    --_depth;
     return dict;
+}
+
+size_t BEncodeWriter::int_size(int64_t value) {
+    // 'i' + optional sign + digits + 'e'
+    size_t size = value < 0 ? 3 : 2;
+    uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+    do { ++size; magnitude /= 10; } while (magnitude);
+    return size;
+}
+
+size_t BEncodeWriter::string_size(size_t length) {
+    // length digits + ':' + payload
+    size_t size = length + 1;
+    do { ++size; length /= 10; } while (length);
+    return size;
+}
+
+size_t BEncodeWriter::encoded_size(const BEncodeValue& value) {
+    if (value.is_int()) return int_size(value.as_int());
+    if (value.is_string()) return string_size(value.as_string().size());
+
+    size_t size = 2; // 'l' / 'd' and 'e'
+    if (value.is_list()) {
+        for (const auto& item : value.as_list()) size += encoded_size(item);
+    }
+    else {
+        for (const auto& [key, item] : value.as_dict()) size += string_size(key.size()) + encoded_size(item);
+    }
+    return size;
+}
+
+void BEncodeWriter::write(const BEncodeValue& value) {
+    _out.reserve(_out.size() + encoded_size(value));
+    write_value(value);
+}
+
+void BEncodeWriter::write_int(int64_t value) {
+    char buf[24];
+    buf[0] = 'i';
+    auto [end, ec] = std::to_chars(buf + 1, buf + sizeof(buf) - 1, value);
+    *end++ = 'e';
+    _out.append(buf, end);
+}
+
+void BEncodeWriter::write_string(std::string_view value) {
+    char buf[24];
+    auto [end, ec] = std::to_chars(buf, buf + sizeof(buf) - 1, value.size());
+    *end++ = ':';
+    _out.append(buf, end);
+    _out.append(value);
+}
+
+void BEncodeWriter::write_value(const BEncodeValue& value) {
+    if (value.is_int()) write_int(value.as_int());
+    else if (value.is_string()) write_string(value.as_string());
+    else if (value.is_list()) {
+        begin_list();
+        for (const auto& item : value.as_list()) write_value(item);
+        end();
+    }
+    else {
+        // std::map<std::string> compares through char_traits<char>, i.e. as unsigned bytes
+        begin_dict();
+        for (const auto& [key, item] : value.as_dict()) {
+            write_string(key);
+            write_value(item);
+        }
+        end();
+    }
+}
+
+std::string bencode(const BEncodeValue& value) {
+    std::string out;
+    BEncodeWriter(out).write(value);
+    return out;
 }
\ No newline at end of file
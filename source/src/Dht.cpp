@@ -0,0 +1,647 @@
+#include <Dht.hpp>
+
+#include <boost/endian/conversion.hpp>
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <print>
+#include <set>
+
+namespace {
+    NodeId distance(const NodeId& a, const NodeId& b) {
+        NodeId out;
+        for (size_t i = 0; i < out.size(); ++i) out[i] = a[i] ^ b[i];
+        return out;
+    }
+
+    NodeId random_id(std::mt19937& rng) {
+        NodeId out;
+        for (auto& b : out) b = (uint8_t)rng();
+        return out;
+    }
+
+    std::string id_string(const NodeId& id) {
+        return { reinterpret_cast<const char*>(id.data()), id.size() };
+    }
+
+    std::optional<NodeId> to_id(const BEncodeValue* value) {
+        if (!value || !value->is_string() || value->as_string().size() != 20) return std::nullopt;
+        NodeId out;
+        std::memcpy(out.data(), value->as_string().data(), 20);
+        return out;
+    }
+
+    const BEncodeValue* find(const BEncodeValue::Dict& dict, const std::string& key) {
+        auto it = dict.find(key);
+        return it == dict.end() ? nullptr : &it->second;
+    }
+
+    // 4 byte ip + 2 byte port, the compact form BEP 5 and the trackers use
+    std::string compact_endpoint(const udp::endpoint& endpoint) {
+        std::string out(6, '\0');
+        auto ip = endpoint.address().to_v4().to_bytes();
+        std::memcpy(out.data(), ip.data(), 4);
+        boost::endian::store_big_u16(reinterpret_cast<unsigned char*>(out.data()) + 4, endpoint.port());
+        return out;
+    }
+
+    udp::endpoint parse_endpoint(const char* p) {
+        boost::asio::ip::address_v4::bytes_type ip;
+        std::memcpy(ip.data(), p, 4);
+        return { boost::asio::ip::address_v4(ip), boost::endian::load_big_u16(reinterpret_cast<const unsigned char*>(p) + 4) };
+    }
+
+    // 20 byte id + compact endpoint per node
+    std::vector<std::pair<NodeId, udp::endpoint>> parse_nodes(const BEncodeValue* value) {
+        std::vector<std::pair<NodeId, udp::endpoint>> out;
+        if (!value || !value->is_string()) return out;
+
+        const auto& s = value->as_string();
+        for (size_t i = 0; i + 26 <= s.size(); i += 26) {
+            NodeId id;
+            std::memcpy(id.data(), s.data() + i, 20);
+            auto endpoint = parse_endpoint(s.data() + i + 20);
+            if (endpoint.port() != 0) out.emplace_back(id, endpoint);
+        }
+        return out;
+    }
+}
+
+// -- routing table --
+
+size_t RoutingTable::bucket_index(const NodeId& id) const {
+    for (size_t i = 0; i < id.size(); ++i) {
+        if (auto x = (uint8_t)(id[i] ^ own_id_[i])) return i * 8 + (size_t)std::countl_zero(x);
+    }
+    return buckets_.size();     // our own id
+}
+
+void RoutingTable::heard_from(const NodeId& id, const udp::endpoint& endpoint, std::chrono::steady_clock::time_point now) {
+    auto index = bucket_index(id);
+    if (index >= buckets_.size()) return;
+    auto& bucket = buckets_[index];
+
+    auto same = [&](const Node& n) { return n.id == id; };
+    if (auto it = std::ranges::find_if(bucket.nodes, same); it != bucket.nodes.end()) {
+        it->endpoint = endpoint;
+        it->last_seen = now;
+        it->fail_count = 0;
+        bucket.last_changed = now;
+        return;
+    }
+
+    Node node{ id, endpoint, now, 0 };
+    if (bucket.nodes.size() < bucket_size) {
+        bucket.nodes.push_back(node);
+        bucket.last_changed = now;
+        return;
+    }
+
+    // a node that stopped answering loses its place right away
+    if (auto bad = std::ranges::find_if(bucket.nodes, [](const Node& n) { return n.fail_count >= max_failures; }); bad != bucket.nodes.end()) {
+        *bad = node;
+        bucket.last_changed = now;
+        return;
+    }
+
+    std::erase_if(bucket.replacements, same);
+    bucket.replacements.push_back(node);
+    if (bucket.replacements.size() > bucket_size) bucket.replacements.erase(bucket.replacements.begin());
+}
+
+void RoutingTable::failed(const udp::endpoint& endpoint) {
+    for (auto& bucket : buckets_) {
+        auto it = std::ranges::find_if(bucket.nodes, [&](const Node& n) { return n.endpoint == endpoint; });
+        if (it == bucket.nodes.end()) continue;
+
+        if (++it->fail_count < max_failures) return;
+
+        if (!bucket.replacements.empty()) {
+            *it = bucket.replacements.back();
+            bucket.replacements.pop_back();
+        }
+        else if (it->last_seen == std::chrono::steady_clock::time_point{}) {
+            bucket.nodes.erase(it);     // never answered at all, e.g. a stale cache entry
+        }
+        return;
+    }
+}
+
+std::vector<RoutingTable::Node> RoutingTable::closest(const NodeId& target, size_t count) const {
+    std::vector<Node> out;
+    for (const auto& bucket : buckets_) {
+        for (const auto& node : bucket.nodes) if (node.fail_count < max_failures) out.push_back(node);
+    }
+
+    auto by_distance = [&](const Node& a, const Node& b) { return distance(a.id, target) < distance(b.id, target); };
+    if (out.size() > count) {
+        std::ranges::partial_sort(out, out.begin() + (ptrdiff_t)count, by_distance);
+        out.resize(count);
+    }
+    else std::ranges::sort(out, by_distance);
+    return out;
+}
+
+std::vector<RoutingTable::Node> RoutingTable::all() const {
+    std::vector<Node> out;
+    for (const auto& bucket : buckets_) out.insert(out.end(), bucket.nodes.begin(), bucket.nodes.end());
+    return out;
+}
+
+size_t RoutingTable::size() const {
+    size_t out{};
+    for (const auto& bucket : buckets_) out += bucket.nodes.size();
+    return out;
+}
+
+std::vector<NodeId> RoutingTable::stale_buckets(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::duration age, std::mt19937& rng) {
+    std::vector<NodeId> out;
+
+    // past the deepest bucket with nodes in it there is nothing to refresh
+    size_t deepest{};
+    for (size_t i = 0; i < buckets_.size(); ++i) if (!buckets_[i].nodes.empty()) deepest = i;
+
+    for (size_t i = 0; i <= deepest; ++i) {
+        auto& bucket = buckets_[i];
+        if (now - bucket.last_changed < age) continue;
+        bucket.last_changed = now;
+
+        // keep the first i bits of our id, flip bit i, randomize the rest
+        auto id = random_id(rng);
+        for (size_t bit = 0; bit <= i; ++bit) {
+            uint8_t mask = (uint8_t)(0x80 >> (bit % 8));
+            bool own = own_id_[bit / 8] & mask;
+            if (bit == i) own = !own;
+            id[bit / 8] = (uint8_t)(own ? id[bit / 8] | mask : id[bit / 8] & ~mask);
+        }
+        out.push_back(id);
+    }
+    return out;
+}
+
+// -- lookups --
+
+// one iterative get_peers or find_node. candidates stay sorted by distance to the target,
+// bootstrap nodes whose id we don't know yet sort last
+struct Dht::Lookup {
+    enum class State { Fresh, Queried, Responded, Failed };
+
+    struct Candidate {
+        NodeId distance;
+        udp::endpoint endpoint;
+        State state{ State::Fresh };
+        std::string token;
+    };
+
+    NodeId target;
+    bool want_peers{ false };
+    uint16_t announce_port{};
+    PeersHandler handler;
+
+    std::vector<Candidate> candidates;
+    std::set<udp::endpoint> seen;
+    std::set<std::string> peers_seen;
+    size_t in_flight{};
+
+    void add(const std::optional<NodeId>& id, const udp::endpoint& endpoint) {
+        if (!seen.insert(endpoint).second) return;
+
+        NodeId d;
+        if (id) d = distance(*id, target);
+        else d.fill(0xFF);
+
+        auto at = std::ranges::upper_bound(candidates, d, {}, &Candidate::distance);
+        candidates.insert(at, Candidate{ .distance = d, .endpoint = endpoint, .state = State::Fresh, .token = {} });
+
+        // far away candidates that were never asked are not worth keeping around
+        while (candidates.size() > 128 && candidates.back().state == State::Fresh) candidates.pop_back();
+    }
+};
+
+Dht::Dht(boost::asio::io_context& io, UdpSocket& socket, DhtOptions options)
+    : io_(io),
+      options_(std::move(options)),
+      socket_(socket),
+      resolver_(io),
+      tick_timer_(io),
+      rng_(std::random_device{}()),
+      table_(random_id(rng_))
+{
+    for (auto& b : secret_) b = (uint8_t)rng_();
+    previous_secret_ = secret_;
+
+    // every KRPC message is a bencoded dictionary, nothing else on the socket starts with 'd'
+    socket_.add_handler([this](const udp::endpoint& from, std::span<const uint8_t> packet) {
+        if (packet.empty() || packet[0] != 'd') return false;
+        if (!stopped_ && from.address().is_v4()) handle_packet(from, std::string_view(reinterpret_cast<const char*>(packet.data()), packet.size()));
+        return true;
+    });
+}
+
+void Dht::start() {
+    auto now = Clock::now();
+    last_rotation_ = last_refresh_ = now;
+
+    if (load_state()) std::print("DHT: {} nodes from {}\n", table_.size(), options_.state_file.string());
+
+    resolve_bootstrap();
+    tick();
+
+    // fill the buckets around our own id
+    find_node(table_.id());
+}
+
+void Dht::stop() {
+    if (std::exchange(stopped_, true)) return;
+
+    tick_timer_.cancel();
+    resolver_.cancel();
+    transactions_.clear();
+    deferred_.clear();
+    save_state();
+}
+
+void Dht::get_peers(const NodeId& info_hash, uint16_t announce_port, PeersHandler handler) {
+    auto lookup = std::make_shared<Lookup>();
+    lookup->target = info_hash;
+    lookup->want_peers = true;
+    lookup->announce_port = announce_port;
+    lookup->handler = std::move(handler);
+    start_lookup(std::move(lookup));
+}
+
+void Dht::find_node(const NodeId& target) {
+    auto lookup = std::make_shared<Lookup>();
+    lookup->target = target;
+    start_lookup(std::move(lookup));
+}
+
+void Dht::start_lookup(std::shared_ptr<Lookup> lookup) {
+    if (stopped_) return;
+
+    for (const auto& node : table_.closest(lookup->target, RoutingTable::bucket_size * 2)) lookup->add(node.id, node.endpoint);
+
+    // an empty table starts from the bootstrap nodes, once we know where they are
+    if (lookup->candidates.empty()) {
+        if (resolving_ > 0) {
+            deferred_.push_back(std::move(lookup));
+            return;
+        }
+        for (const auto& endpoint : bootstrap_endpoints_) lookup->add(std::nullopt, endpoint);
+    }
+    step(lookup);
+}
+
+// query the closest candidates that haven't been asked, until the k closest all answered
+void Dht::step(const std::shared_ptr<Lookup>& lookup) {
+    if (stopped_) return;
+
+    size_t responded{};
+    for (auto& candidate : lookup->candidates) {
+        if (responded >= RoutingTable::bucket_size || lookup->in_flight >= alpha) break;
+
+        if (candidate.state == Lookup::State::Responded) ++responded;
+        if (candidate.state != Lookup::State::Fresh) continue;
+
+        candidate.state = Lookup::State::Queried;
+        ++lookup->in_flight;
+
+        Dict args{ { "id", BEncodeValue{ id_string(table_.id()) } } };
+        if (lookup->want_peers) args["info_hash"] = BEncodeValue{ id_string(lookup->target) };
+        else args["target"] = BEncodeValue{ id_string(lookup->target) };
+
+        auto endpoint = candidate.endpoint;
+        send_query(endpoint, lookup->want_peers ? "get_peers" : "find_node", std::move(args), [this, lookup, endpoint](const Dict* reply) {
+            --lookup->in_flight;
+
+            auto it = std::ranges::find(lookup->candidates, endpoint, &Lookup::Candidate::endpoint);
+            if (it != lookup->candidates.end()) it->state = reply ? Lookup::State::Responded : Lookup::State::Failed;
+
+            if (reply) {
+                if (auto token = find(*reply, "token"); token && token->is_string() && it != lookup->candidates.end()) it->token = token->as_string();
+
+                for (const auto& [id, node] : parse_nodes(find(*reply, "nodes"))) {
+                    if (id != table_.id()) lookup->add(id, node);
+                }
+
+                // values is a list of compact peers, new ones go straight to the torrent
+                if (auto values = find(*reply, "values"); values && values->is_list() && lookup->handler) {
+                    std::string fresh;
+                    for (const auto& value : values->as_list()) {
+                        if (value.is_string() && value.as_string().size() == 6 && lookup->peers_seen.insert(value.as_string()).second) fresh += value.as_string();
+                    }
+                    if (!fresh.empty()) lookup->handler(parse_compact_peers(BEncodeValue{ std::move(fresh) }));
+                }
+            }
+            step(lookup);
+        });
+    }
+
+    if (lookup->in_flight == 0) finish(lookup);
+}
+
+void Dht::finish(const std::shared_ptr<Lookup>& lookup) {
+    if (!lookup->want_peers || lookup->announce_port == 0) return;
+
+    size_t announced{};
+    for (const auto& candidate : lookup->candidates) {
+        if (announced == RoutingTable::bucket_size) break;
+        if (candidate.state != Lookup::State::Responded || candidate.token.empty()) continue;
+
+        Dict args{
+            { "id", BEncodeValue{ id_string(table_.id()) } },
+            { "info_hash", BEncodeValue{ id_string(lookup->target) } },
+            { "port", BEncodeValue{ (int64_t)lookup->announce_port } },
+            { "token", BEncodeValue{ candidate.token } },
+        };
+        send_query(candidate.endpoint, "announce_peer", std::move(args), [](const Dict*) {});
+        ++announced;
+    }
+}
+
+// -- krpc --
+
+void Dht::handle_packet(const udp::endpoint& from, std::string_view packet) {
+    BEncodeValue message;
+    try { message = BEncodeParser(packet).parse(); }
+    catch (const std::exception&) { return; }
+    if (!message.is_dict()) return;
+
+    const auto& dict = message.as_dict();
+    auto tid = find(dict, "t");
+    auto type = find(dict, "y");
+    if (!tid || !tid->is_string() || !type || !type->is_string()) return;
+
+    if (type->as_string() == "q") {
+        auto method = find(dict, "q");
+        auto args = find(dict, "a");
+        if (!method || !method->is_string() || !args || !args->is_dict()) return send_error(from, tid->as_string(), 203, "Protocol Error");
+
+        if (auto id = to_id(find(args->as_dict(), "id"))) table_.heard_from(*id, from, Clock::now());
+        return handle_query(from, tid->as_string(), method->as_string(), args->as_dict());
+    }
+
+    // replies and errors, matched to our query by transaction id and sender
+    if (tid->as_string().size() != 2) return;
+    auto key = boost::endian::load_big_u16(reinterpret_cast<const unsigned char*>(tid->as_string().data()));
+    auto it = transactions_.find(key);
+    if (it == transactions_.end() || it->second.endpoint != from) return;
+
+    auto handler = std::move(it->second.handler);
+    transactions_.erase(it);
+
+    auto reply = find(dict, "r");
+    if (type->as_string() == "r" && reply && reply->is_dict()) {
+        if (auto id = to_id(find(reply->as_dict(), "id"))) table_.heard_from(*id, from, Clock::now());
+        handler(&reply->as_dict());
+    }
+    else handler(nullptr);
+}
+
+void Dht::handle_query(const udp::endpoint& from, const std::string& tid, const std::string& method, const Dict& args) {
+    Dict reply{ { "id", BEncodeValue{ id_string(table_.id()) } } };
+
+    if (method == "ping") return send_reply(from, tid, std::move(reply));
+
+    if (method == "find_node") {
+        auto target = to_id(find(args, "target"));
+        if (!target) return send_error(from, tid, 203, "Protocol Error");
+
+        reply["nodes"] = BEncodeValue{ compact_nodes(*target) };
+        return send_reply(from, tid, std::move(reply));
+    }
+
+    if (method == "get_peers") {
+        auto info_hash = to_id(find(args, "info_hash"));
+        if (!info_hash) return send_error(from, tid, 203, "Protocol Error");
+
+        reply["token"] = BEncodeValue{ make_token(from, secret_) };
+
+        // whoever asks doesn't need to hear about itself
+        BEncodeValue::List values;
+        if (auto it = peer_store_.find(*info_hash); it != peer_store_.end()) {
+            auto self = compact_endpoint(from);
+            for (const auto& peer : it->second) {
+                if (values.size() == max_values_per_reply) break;
+                if (peer.compact != self) values.push_back(BEncodeValue{ peer.compact });
+            }
+        }
+
+        if (!values.empty()) reply["values"] = BEncodeValue{ std::move(values) };
+        else reply["nodes"] = BEncodeValue{ compact_nodes(*info_hash) };
+        return send_reply(from, tid, std::move(reply));
+    }
+
+    if (method == "announce_peer") {
+        auto info_hash = to_id(find(args, "info_hash"));
+        auto token = find(args, "token");
+        auto port = find(args, "port");
+        auto implied = find(args, "implied_port");
+        if (!info_hash || !token || !token->is_string() || !port || !port->is_int()) return send_error(from, tid, 203, "Protocol Error");
+        if (!valid_token(from, token->as_string())) return send_error(from, tid, 203, "Bad token");
+
+        bool use_source_port = implied && implied->is_int() && implied->as_int() != 0;
+        auto peer_port = use_source_port ? from.port() : (uint16_t)port->as_int();
+        if (peer_port == 0) return send_error(from, tid, 203, "Protocol Error");
+
+        // a new info hash pushes out the one announced to least recently, peers are kept oldest first
+        if (peer_store_.size() >= max_stored_hashes && !peer_store_.contains(*info_hash)) {
+            auto oldest = std::ranges::min_element(peer_store_, {}, [](const auto& entry) { return entry.second.back().added; });
+            peer_store_.erase(oldest);
+        }
+
+        auto compact = compact_endpoint(udp::endpoint(from.address(), peer_port));
+        auto& peers = peer_store_[*info_hash];
+        std::erase_if(peers, [&](const StoredPeer& p) { return p.compact == compact; });
+        peers.push_back({ std::move(compact), Clock::now() });
+        if (peers.size() > max_peers_per_hash) peers.erase(peers.begin());
+
+        return send_reply(from, tid, std::move(reply));
+    }
+
+    send_error(from, tid, 204, "Method Unknown");
+}
+
+void Dht::send_query(const udp::endpoint& to, const std::string& method, Dict args, ReplyHandler handler) {
+    // skip ids that are still waiting for an answer, 65536 in flight never happens
+    while (transactions_.contains(next_tid_)) ++next_tid_;
+    auto key = next_tid_++;
+
+    std::string tid(2, '\0');
+    boost::endian::store_big_u16(reinterpret_cast<unsigned char*>(tid.data()), key);
+    transactions_[key] = { to, Clock::now() + query_timeout, std::move(handler) };
+
+    send(to, BEncodeValue{ Dict{
+        { "a", BEncodeValue{ std::move(args) } },
+        { "q", BEncodeValue{ method } },
+        { "t", BEncodeValue{ std::move(tid) } },
+        { "y", BEncodeValue{ std::string("q") } },
+    } });
+}
+
+void Dht::send_reply(const udp::endpoint& to, const std::string& tid, Dict reply) {
+    send(to, BEncodeValue{ Dict{
+        { "r", BEncodeValue{ std::move(reply) } },
+        { "t", BEncodeValue{ tid } },
+        { "y", BEncodeValue{ std::string("r") } },
+    } });
+}
+
+void Dht::send_error(const udp::endpoint& to, const std::string& tid, int code, const std::string& message) {
+    send(to, BEncodeValue{ Dict{
+        { "e", BEncodeValue{ BEncodeValue::List{ BEncodeValue{ (int64_t)code }, BEncodeValue{ message } } } },
+        { "t", BEncodeValue{ tid } },
+        { "y", BEncodeValue{ std::string("e") } },
+    } });
+}
+
+void Dht::send(const udp::endpoint& to, const BEncodeValue& message) {
+    if (stopped_) return;
+
+    auto buf = bencode(message);
+    socket_.send(to, { reinterpret_cast<const uint8_t*>(buf.data()), buf.size() });
+}
+
+// -- tokens --
+
+// first 8 bytes of SHA1(secret + ip). secrets rotate every few minutes and the previous one
+// is still accepted, so a token stays good for 5 to 10 minutes
+std::string Dht::make_token(const udp::endpoint& from, const std::array<uint8_t, 8>& secret) const {
+    auto ip = from.address().to_v4().to_bytes();
+
+    std::array<uint8_t, 12> input;
+    std::memcpy(input.data(), secret.data(), 8);
+    std::memcpy(input.data() + 8, ip.data(), 4);
+
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1(input.data(), input.size(), digest);
+    return { reinterpret_cast<const char*>(digest), 8 };
+}
+
+bool Dht::valid_token(const udp::endpoint& from, const std::string& token) const {
+    return token == make_token(from, secret_) || token == make_token(from, previous_secret_);
+}
+
+std::string Dht::compact_nodes(const NodeId& target) const {
+    std::string out;
+    for (const auto& node : table_.closest(target, RoutingTable::bucket_size)) {
+        out += id_string(node.id);
+        out += compact_endpoint(node.endpoint);
+    }
+    return out;
+}
+
+size_t Dht::stored_peers(const NodeId& info_hash) const {
+    auto it = peer_store_.find(info_hash);
+    return it == peer_store_.end() ? 0 : it->second.size();
+}
+
+// -- housekeeping --
+
+void Dht::resolve_bootstrap() {
+    for (const auto& entry : options_.bootstrap) {
+        auto colon = entry.rfind(':');
+        if (colon == std::string::npos) continue;
+
+        ++resolving_;
+        resolver_.async_resolve(udp::v4(), entry.substr(0, colon), entry.substr(colon + 1),
+            [this, entry](boost::system::error_code ec, udp::resolver::results_type results) {
+                if (ec == boost::asio::error::operation_aborted || stopped_) return;
+
+                if (ec) std::cerr << "DHT: can't resolve " << entry << ": " << ec.message() << "\n";
+                else for (const auto& r : results) bootstrap_endpoints_.push_back(r.endpoint());
+
+                if (--resolving_ == 0) {
+                    for (auto& lookup : std::exchange(deferred_, {})) start_lookup(std::move(lookup));
+                }
+            });
+    }
+}
+
+void Dht::tick() {
+    if (stopped_) return;
+    auto now = Clock::now();
+
+    // queries nobody answered
+    std::vector<ReplyHandler> expired;
+    for (auto it = transactions_.begin(); it != transactions_.end(); ) {
+        if (it->second.deadline > now) { ++it; continue; }
+        table_.failed(it->second.endpoint);
+        expired.push_back(std::move(it->second.handler));
+        it = transactions_.erase(it);
+    }
+    for (auto& handler : expired) handler(nullptr);
+
+    if (now - last_rotation_ > token_rotation) {
+        last_rotation_ = now;
+        previous_secret_ = secret_;
+        for (auto& b : secret_) b = (uint8_t)rng_();
+    }
+
+    if (now - last_refresh_ > std::chrono::minutes(1)) {
+        last_refresh_ = now;
+
+        for (auto it = peer_store_.begin(); it != peer_store_.end(); ) {
+            std::erase_if(it->second, [&](const StoredPeer& p) { return now - p.added > peer_lifetime; });
+            it = it->second.empty() ? peer_store_.erase(it) : std::next(it);
+        }
+
+        for (const auto& target : table_.stale_buckets(now, bucket_refresh, rng_)) find_node(target);
+    }
+
+    tick_timer_.expires_after(std::chrono::milliseconds(500));
+    tick_timer_.async_wait([this](boost::system::error_code ec) {
+        if (!ec) tick();
+    });
+}
+
+// the state file is a bencoded dict: "id" our node id, "nodes" compact node info like find_node returns
+bool Dht::load_state() {
+    if (options_.state_file.empty()) return false;
+
+    std::ifstream in(options_.state_file, std::ios::binary);
+    if (!in) return false;
+    std::string data((std::istreambuf_iterator<char>(in)), {});
+
+    BEncodeValue state;
+    try { state = BEncodeParser(data).parse(); }
+    catch (const std::exception&) { return false; }
+    if (!state.is_dict()) return false;
+
+    auto id = to_id(find(state.as_dict(), "id"));
+    if (!id) return false;
+
+    // never heard from in this run, so they go first when something has to be evicted
+    table_ = RoutingTable(*id);
+    for (const auto& [node_id, endpoint] : parse_nodes(find(state.as_dict(), "nodes"))) {
+        table_.heard_from(node_id, endpoint, {});
+    }
+    return true;
+}
+
+void Dht::save_state() const {
+    if (options_.state_file.empty()) return;
+
+    std::string nodes;
+    for (const auto& node : table_.all()) {
+        if (node.fail_count > 0) continue;
+        nodes += id_string(node.id);
+        nodes += compact_endpoint(node.endpoint);
+    }
+
+    auto tmp = options_.state_file;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out << bencode(BEncodeValue{ Dict{ { "id", BEncodeValue{ id_string(table_.id()) } }, { "nodes", BEncodeValue{ std::move(nodes) } } } });
+        if (!out) return;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, options_.state_file, ec);
+}
@@ -1,13 +1,13 @@
 #include <HttpTracker.hpp>
 
-TrackerResponse HttpTracker::announce(const std::array<uint8_t, 20>& infoHash, const std::string& peerId, const std::atomic<size_t>& uploaded, const std::atomic<size_t>& downloaded, const std::atomic<size_t>& total)
+TrackerResponse HttpTracker::announce(const std::array<uint8_t, 20>& infoHash, const std::string& peerId, uint16_t port, size_t uploaded, size_t downloaded, size_t total)
 {
     try {
         std::string event;
 
-        auto up = uploaded.load();
-        auto down = downloaded.load();
-        auto tot = total.load();
+        auto up = uploaded;
+        auto down = downloaded;
+        auto tot = total;
 
         if (down == 0) event = "started";
         else if (down >= tot) event = "completed";
@@ -15,7 +15,8 @@ TrackerResponse HttpTracker::announce(const std::array<uint8_t, 20>& infoHash, c
         std::string target = parsed.target + 
             "?info_hash=" + percent_encode(infoHash) +
             "&peer_id="   + peerId +
-            "&port=31616&uploaded=" + std::to_string(up) + 
+            "&port=" + std::to_string(port) +
+            "&uploaded=" + std::to_string(up) + 
             "&downloaded=" + std::to_string(down) + 
             "&left=" + std::to_string(tot - down) +
             "&compact=1";
@@ -55,7 +56,7 @@ TrackerResponse HttpTracker::announce(const std::array<uint8_t, 20>& infoHash, c
         BEncodeParser parser(body);
 
         auto parsed_resp = parser.parse().as_dict();
-        auto peers = parse_compact_peers(parsed_resp.at("peers"));
+        auto peers = tracker_peers(parsed_resp);
 
         std::optional<uint32_t> interval;
 
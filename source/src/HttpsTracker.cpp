@@ -7,13 +7,13 @@ namespace net   = boost::asio;
 namespace ssl   = net::ssl;
 using tcp       = net::ip::tcp;
 
-TrackerResponse HttpsTracker::announce(const std::array<uint8_t, 20>& infoHash, const std::string& peerId, const std::atomic<size_t>& uploaded, const std::atomic<size_t>& downloaded, const std::atomic<size_t>& total) {
+TrackerResponse HttpsTracker::announce(const std::array<uint8_t, 20>& infoHash, const std::string& peerId, uint16_t port, size_t uploaded, size_t downloaded, size_t total) {
     try {
         std::string event;
 
-        auto up = uploaded.load();
-        auto down = downloaded.load();
-        auto tot = total.load();
+        auto up = uploaded;
+        auto down = downloaded;
+        auto tot = total;
 
         if (down == 0) event = "started";
         else if (down >= tot) event = "completed";
@@ -21,7 +21,8 @@ TrackerResponse HttpsTracker::announce(const std::array<uint8_t, 20>& infoHash,
         std::string target = parsed.target +
             "?info_hash=" + percent_encode(infoHash) +
             "&peer_id="   + peerId +
-            "&port=31616&uploaded=" + std::to_string(up) + 
+            "&port=" + std::to_string(port) +
+            "&uploaded=" + std::to_string(up) + 
             "&downloaded=" + std::to_string(down) + 
             "&left=" + std::to_string(tot - down) +
             "&compact=1";
@@ -69,7 +70,7 @@ TrackerResponse HttpsTracker::announce(const std::array<uint8_t, 20>& infoHash,
         BEncodeParser parser(body);
 
         auto parsed_resp = parser.parse().as_dict();
-        auto peers = parse_compact_peers(parsed_resp.at("peers"));
+        auto peers = tracker_peers(parsed_resp);
 
         std::optional<uint32_t> interval;
 
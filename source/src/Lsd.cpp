@@ -0,0 +1,154 @@
+#include <Lsd.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <format>
+#include <random>
+
+Lsd::Lsd(boost::asio::io_context& io, uint16_t listen_port, const LsdOptions& options)
+    : socket_(io), group_(options.group), listen_port_(listen_port), timer_(io) {
+    namespace multicast = boost::asio::ip::multicast;
+
+    // every session on the host binds the group port, the kernel hands each one a copy
+    socket_.open(udp::v4());
+    socket_.set_option(udp::socket::reuse_address(true));
+    socket_.bind(udp::endpoint(boost::asio::ip::address_v4::any(), group_.port()));
+    socket_.set_option(multicast::join_group(group_.address()));
+    socket_.set_option(multicast::enable_loopback(true));
+    socket_.non_blocking(true);
+
+    std::random_device rd;
+    cookie_ = std::format("{:08x}", (unsigned)rd());
+}
+
+void Lsd::start() {
+    receive();
+    on_timer();
+}
+
+void Lsd::stop() {
+    stopped_ = true;
+    timer_.cancel();
+    boost::system::error_code ec;
+    socket_.close(ec);
+}
+
+void Lsd::add(const std::array<uint8_t, 20>& info_hash, PeersHandler handler) {
+    auto& entry = torrents_[hex(info_hash)];
+    entry.handler = std::move(handler);
+
+    // right away unless it went out a moment ago
+    entry.next_announce = entry.last_announce + min_interval;
+
+    boost::asio::post(socket_.get_executor(), [this] { if (!stopped_) on_timer(); });
+}
+
+void Lsd::remove(const std::array<uint8_t, 20>& info_hash) {
+    torrents_.erase(hex(info_hash));
+}
+
+// every due torrent, a handful of info hashes per datagram
+void Lsd::on_timer() {
+    auto now = Clock::now();
+
+    std::vector<std::string> due;
+    for (auto& [hash, entry] : torrents_) {
+        if (now < entry.next_announce) continue;
+        entry.last_announce = now;
+        entry.next_announce = now + announce_interval;
+        due.push_back(hash);
+
+        if (due.size() == hashes_per_message) {
+            send(due);
+            due.clear();
+        }
+    }
+    if (!due.empty()) send(due);
+
+    // what we heard a while ago can be acted on again
+    std::erase_if(heard_, [&](const auto& item) { return now - item.second > peer_interval; });
+
+    timer_.expires_after(std::chrono::seconds(1));
+    timer_.async_wait([this](const boost::system::error_code& ec) {
+        if (!ec && !stopped_) on_timer();
+    });
+}
+
+void Lsd::send(const std::vector<std::string>& hashes) {
+    auto message = std::format("BT-SEARCH * HTTP/1.1\r\nHost: {}:{}\r\nPort: {}\r\n",
+                               group_.address().to_string(), group_.port(), listen_port_);
+    for (const auto& hash : hashes) message += std::format("Infohash: {}\r\n", hash);
+    message += std::format("cookie: {}\r\n\r\n\r\n", cookie_);
+
+    // best effort, like the rest of multicast
+    boost::system::error_code ec;
+    socket_.send_to(boost::asio::buffer(message), group_, 0, ec);
+}
+
+void Lsd::receive() {
+    socket_.async_receive_from(boost::asio::buffer(buf_), from_, [this](boost::system::error_code ec, size_t bytes) {
+        if (ec == boost::asio::error::operation_aborted || stopped_) return;
+        if (!ec) on_message(from_, std::string_view(buf_.data(), bytes));
+        receive();
+    });
+}
+
+void Lsd::on_message(const udp::endpoint& from, std::string_view message) {
+    if (!message.starts_with("BT-SEARCH * HTTP/1.1\r\n")) return;
+
+    uint16_t port{};
+    std::string_view cookie;
+    std::vector<std::string> hashes;
+
+    // header names are case insensitive, and clients disagree on how to spell them
+    auto lower = [](std::string_view s) {
+        std::string out(s);
+        for (auto& c : out) c = (char)std::tolower((unsigned char)c);
+        return out;
+    };
+
+    size_t pos = message.find("\r\n") + 2;
+    while (pos < message.size()) {
+        auto end = message.find("\r\n", pos);
+        if (end == std::string_view::npos) end = message.size();
+        auto line = message.substr(pos, end - pos);
+        pos = end + 2;
+
+        auto colon = line.find(':');
+        if (colon == std::string_view::npos) continue;
+        auto name = lower(line.substr(0, colon));
+        auto value = line.substr(colon + 1);
+        while (!value.empty() && value.front() == ' ') value.remove_prefix(1);
+
+        if (name == "port") {
+            unsigned v{};
+            auto [ptr, err] = std::from_chars(value.data(), value.data() + value.size(), v);
+            if (err == std::errc{} && v > 0 && v <= 0xFFFF) port = (uint16_t)v;
+        }
+        else if (name == "infohash" && value.size() == 40) hashes.push_back(lower(value));
+        else if (name == "cookie") cookie = value;
+    }
+
+    if (port == 0 || cookie == cookie_) return;
+
+    auto now = Clock::now();
+    for (const auto& hash : hashes) {
+        auto it = torrents_.find(hash);
+        if (it == torrents_.end()) continue;    // not one of ours
+
+        // one announce per peer and torrent a minute is all we act on, whatever it sends
+        auto [heard, fresh] = heard_.try_emplace({ hash, udp::endpoint(from.address(), port) }, now);
+        if (!fresh) continue;
+
+        ++peers_discovered_;
+        it->second.handler({ Peer(from.address(), port) });
+    }
+}
+
+std::string Lsd::hex(const std::array<uint8_t, 20>& info_hash) {
+    std::string out;
+    out.reserve(40);
+    for (auto byte : info_hash) out += std::format("{:02x}", (unsigned)byte);
+    return out;
+}
@@ -0,0 +1,122 @@
+#include <MetadataFetcher.hpp>
+#include <PeerConnection.hpp>
+
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <cstring>
+
+void MetadataFetcher::add_source(const std::shared_ptr<PeerConnection>& peer, size_t size) {
+    if (complete_ || size == 0 || size > max_size || find(*peer)) return;
+
+    // the first size we hear is the one we fetch, a peer that disagrees can't help with it
+    if (size_ == 0) {
+        size_ = size;
+        buffer_.assign(size, '\0');
+        pieces_.assign((size + piece_size - 1) / piece_size, {});
+    }
+    if (size != size_) return;
+
+    sources_.push_back({ .peer = peer, .key = peer.get(), .pending = {}, .bad = false });
+    request_pieces(Clock::now());
+}
+
+bool MetadataFetcher::on_piece(const PeerConnection& peer, int piece, std::span<const uint8_t> data) {
+    auto* source = find(peer);
+    if (complete_ || !source) return false;
+
+    auto request = std::ranges::find(source->pending, piece, &Request::piece);
+    if (request == source->pending.end()) return false;    // not asked for, or already timed out
+    source->pending.erase(request);
+
+    auto now = Clock::now();
+    if (data.empty()) {
+        // rejected, it may have only part of it or be out of upload slots. either way, ask someone else
+        source->bad = true;
+        request_pieces(now);
+        return false;
+    }
+
+    auto& entry = pieces_[(size_t)piece];
+    auto offset = (size_t)piece * piece_size;
+    auto expected = std::min(piece_size, size_ - offset);
+
+    if (!entry.have && data.size() == expected) {
+        std::memcpy(buffer_.data() + offset, data.data(), expected);
+        entry = { .have = true, .from = source->key };
+    }
+
+    if (std::ranges::all_of(pieces_, &Piece::have)) verify();
+    else request_pieces(now);
+    return complete_;
+}
+
+void MetadataFetcher::tick(Clock::time_point now) {
+    if (complete_) return;
+
+    // a slow peer keeps its place, the piece is up for grabs again
+    for (auto& source : sources_)
+        std::erase_if(source.pending, [&](const Request& r) { return now - r.sent > request_timeout; });
+    std::erase_if(sources_, [](const Source& s) { return s.peer.expired(); });
+    request_pieces(now);
+}
+
+// missing pieces to whoever has the fewest requests out, then duplicates of the oldest outstanding ones
+void MetadataFetcher::request_pieces(Clock::time_point now) {
+    for (;;) {
+        Source* best{};
+        for (auto& source : sources_) {
+            if (source.bad || source.pending.size() >= max_pending || source.peer.expired()) continue;
+            if (!best || source.pending.size() < best->pending.size()) best = &source;
+        }
+        if (!best) return;
+
+        int piece = -1;
+        for (size_t i = 0; i < pieces_.size() && piece < 0; ++i)
+            if (!pieces_[i].have && requests_for((int)i) == 0) piece = (int)i;
+
+        // endgame: nothing unasked, so an idle peer races a slow one for the longest wait
+        if (piece < 0 && best->pending.empty()) {
+            auto oldest = now;
+            for (const auto& source : sources_)
+                for (const auto& request : source.pending)
+                    if (request.sent < oldest && now - request.sent > endgame_after && requests_for(request.piece) < 2) {
+                        oldest = request.sent;
+                        piece = request.piece;
+                    }
+        }
+        if (piece < 0) return;
+
+        best->pending.push_back({ piece, now });
+        best->peer.lock()->request_metadata(piece);
+    }
+}
+
+int MetadataFetcher::requests_for(int piece) const {
+    int count{};
+    for (const auto& source : sources_)
+        count += (int)std::ranges::count(source.pending, piece, &Request::piece);
+    return count;
+}
+
+MetadataFetcher::Source* MetadataFetcher::find(const PeerConnection& peer) {
+    auto it = std::ranges::find(sources_, &peer, &Source::key);
+    return it == sources_.end() ? nullptr : &*it;
+}
+
+void MetadataFetcher::verify() {
+    std::array<uint8_t, 20> hash{};
+    SHA1(reinterpret_cast<const unsigned char*>(buffer_.data()), buffer_.size(), hash.data());
+
+    if (hash == info_hash_) {
+        complete_ = true;
+        for (auto& source : sources_) source.pending.clear();
+        return;
+    }
+
+    // somebody lied, we can't tell who so everybody that contributed is out
+    for (auto& source : sources_)
+        if (std::ranges::find(pieces_, source.key, &Piece::from) != pieces_.end()) source.bad = true;
+    pieces_.assign(pieces_.size(), {});
+    request_pieces(Clock::now());
+}
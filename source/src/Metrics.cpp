@@ -0,0 +1,233 @@
+#include <Metrics.hpp>
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <charconv>
+#include <filesystem>
+#include <print>
+
+namespace beast = boost::beast;
+namespace http  = beast::http;
+
+namespace {
+    std::string escape_label(const std::string& value) {
+        std::string out;
+        out.reserve(value.size());
+        for (char c : value) {
+            if (c == '\\' || c == '"') out += '\\';
+            if (c == '\n') { out += "\\n"; continue; }
+            out += c;
+        }
+        return out;
+    }
+
+    std::string format_number(double value) {
+        char buf[32];
+        auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+        return std::string(buf, end);
+    }
+
+    // one request, one response, then close. prometheus opens a fresh connection per scrape anyway
+    template <class Socket>
+    class MetricsConnection : public std::enable_shared_from_this<MetricsConnection<Socket>> {
+    public:
+        MetricsConnection(Socket socket, std::function<std::string()> render)
+            : socket_(std::move(socket)), render_(std::move(render)) {}
+
+        void start() {
+            auto self = this->shared_from_this();
+            http::async_read(socket_, buffer_, request_, [self](beast::error_code ec, size_t) {
+                if (!ec) self->respond();
+            });
+        }
+
+    private:
+        void respond() {
+            response_.version(request_.version());
+            response_.keep_alive(false);
+            response_.set(http::field::server, "ctorrent");
+
+            auto target = request_.target();
+            if (request_.method() != http::verb::get || (target != "/metrics" && target != "/")) {
+                response_.result(http::status::not_found);
+                response_.body() = "not found\n";
+            }
+            else {
+                response_.result(http::status::ok);
+                response_.set(http::field::content_type, "text/plain; version=0.0.4");
+                response_.body() = render_();
+            }
+            response_.prepare_payload();
+
+            auto self = this->shared_from_this();
+            http::async_write(socket_, response_, [self](beast::error_code ec, size_t) {
+                self->socket_.shutdown(Socket::shutdown_both, ec);
+            });
+        }
+
+        Socket socket_;
+        std::function<std::string()> render_;
+        beast::flat_buffer buffer_;
+        http::request<http::empty_body> request_;
+        http::response<http::string_body> response_;
+    };
+}
+
+// -- MetricsWriter --
+
+MetricsWriter::Family& MetricsWriter::family(const std::string& name, const char* type, const std::string& help) {
+    auto [it, inserted] = families_.try_emplace(name);
+    if (inserted) {
+        it->second.type = type;
+        it->second.help = help;
+        order_.push_back(name);
+    }
+    return it->second;
+}
+
+void MetricsWriter::sample(std::string& out, const std::string& name, const Labels& labels, double value) {
+    out += name;
+    if (!labels.empty()) {
+        out += '{';
+        for (size_t i = 0; i < labels.size(); ++i) {
+            if (i) out += ',';
+            out += labels[i].first;
+            out += "=\"";
+            out += escape_label(labels[i].second);
+            out += '"';
+        }
+        out += '}';
+    }
+    out += ' ';
+    out += format_number(value);
+    out += '\n';
+}
+
+void MetricsWriter::counter(const std::string& name, const std::string& help, const Labels& labels, double value) {
+    sample(family(name, "counter", help).samples, name, labels, value);
+}
+
+void MetricsWriter::gauge(const std::string& name, const std::string& help, const Labels& labels, double value) {
+    sample(family(name, "gauge", help).samples, name, labels, value);
+}
+
+void MetricsWriter::histogram(const std::string& name, const std::string& help, const Labels& labels, const LatencyHistogram& histogram) {
+    // 64us .. ~18min, enough to tell a slow disk from a slow peer
+    static constexpr int first_bound_bits = 6;
+    static constexpr int last_bound_bits = 30;
+
+    auto& out = family(name, "histogram", help).samples;
+    auto count = histogram.count();
+
+    Labels bucket_labels = labels;
+    bucket_labels.emplace_back("le", "");
+
+    // le is "at most": values are whole microseconds (rounded up), so below 2^bits is at most 2^bits - 1
+    for (int bits = first_bound_bits; bits <= last_bound_bits; ++bits) {
+        bucket_labels.back().second = format_number((double)((uint64_t(1) << bits) - 1) / 1e6);
+        sample(out, name + "_bucket", bucket_labels, (double)histogram.count_below_pow2(bits));
+    }
+    bucket_labels.back().second = "+Inf";
+    sample(out, name + "_bucket", bucket_labels, (double)count);
+    sample(out, name + "_sum", labels, (double)histogram.sum_us() / 1e6);
+    sample(out, name + "_count", labels, (double)count);
+
+    // the same samples as a summary, its quantiles come from the full resolution buckets
+    auto summary = name + "_summary";
+    auto& quantiles = family(summary, "summary", help + " (quantiles)").samples;
+    Labels quantile_labels = labels;
+    quantile_labels.emplace_back("quantile", "");
+
+    for (double q : { 0.5, 0.9, 0.99, 0.999 }) {
+        quantile_labels.back().second = format_number(q);
+        sample(quantiles, summary, quantile_labels, (double)histogram.quantile_us(q) / 1e6);
+    }
+    sample(quantiles, summary + "_sum", labels, (double)histogram.sum_us() / 1e6);
+    sample(quantiles, summary + "_count", labels, (double)count);
+}
+
+std::string MetricsWriter::str() const {
+    std::string out;
+    for (const auto& name : order_) {
+        const auto& f = families_.at(name);
+        out += "# HELP " + name + " " + f.help + "\n";
+        out += "# TYPE " + name + " " + f.type + "\n";
+        out += f.samples;
+    }
+    return out;
+}
+
+// -- MetricsServer --
+
+MetricsServer::MetricsServer(boost::asio::io_context& io, const std::string& where, std::function<std::string()> render)
+    : io_(io), render_(std::move(render))
+{
+    if (where.starts_with("unix:")) {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+        unix_path_ = where.substr(5);
+#else
+        throw std::runtime_error("unix sockets are not supported on this platform");
+#endif
+    }
+    else port_ = (uint16_t)std::stoi(where);
+}
+
+MetricsServer::~MetricsServer() {
+    stop();
+}
+
+void MetricsServer::start() {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+    if (!unix_path_.empty()) {
+        std::error_code fs_ec;
+        std::filesystem::remove(unix_path_, fs_ec);    // left over from a previous run
+
+        unix_acceptor_.emplace(io_, unix_socket::endpoint(unix_path_));
+        std::print("Metrics on unix:{}\n", unix_path_);
+        accept_unix();
+        return;
+    }
+#endif
+
+    tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), port_);
+    tcp_acceptor_.emplace(io_);
+    tcp_acceptor_->open(endpoint.protocol());
+    tcp_acceptor_->set_option(tcp::acceptor::reuse_address(true));
+    tcp_acceptor_->bind(endpoint);
+    tcp_acceptor_->listen();
+
+    std::print("Metrics on http://127.0.0.1:{}/metrics\n", port_);
+    accept_tcp();
+}
+
+void MetricsServer::stop() {
+    boost::system::error_code ec;
+    if (tcp_acceptor_) tcp_acceptor_->close(ec);
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+    if (unix_acceptor_ && unix_acceptor_->is_open()) {
+        unix_acceptor_->close(ec);
+        std::error_code fs_ec;
+        std::filesystem::remove(unix_path_, fs_ec);
+    }
+#endif
+}
+
+void MetricsServer::accept_tcp() {
+    tcp_acceptor_->async_accept([this](boost::system::error_code ec, tcp::socket socket) {
+        if (ec == boost::asio::error::operation_aborted) return;
+        if (!ec) std::make_shared<MetricsConnection<tcp::socket>>(std::move(socket), render_)->start();
+        accept_tcp();
+    });
+}
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+void MetricsServer::accept_unix() {
+    unix_acceptor_->async_accept([this](boost::system::error_code ec, unix_socket::socket socket) {
+        if (ec == boost::asio::error::operation_aborted) return;
+        if (!ec) std::make_shared<MetricsConnection<unix_socket::socket>>(std::move(socket), render_)->start();
+        accept_unix();
+    });
+}
+#endif
@@ -1,30 +1,42 @@
 #include <Peer.hpp>
 
-std::vector<Peer> parse_compact_peers(const BEncodeValue& peers_blob) {
-    std::vector<Peer> peers;
+#include <algorithm>
 
-    if (peers_blob.is_string()) {
-        // std::cout << "Peers are in binary form\n";
-        auto peers_string = peers_blob.as_string();
-        size_t count = peers_string.size() / 6;
+void parse_compact_peers(std::span<const uint8_t> blob, bool v6, std::vector<Peer>& peers) {
+    const size_t entry = v6 ? 18 : 6;
+    const size_t count = blob.size() / entry;
+    peers.reserve(peers.size() + count);
+
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t* data = blob.data() + i * entry;
+        uint16_t port = (uint16_t)((data[entry - 2] << 8) | data[entry - 1]);
 
-        for (size_t i = 0; i < count; ++i) {
-            const unsigned char* data = reinterpret_cast<const unsigned char*>(peers_string.data() + i * 6);
+        if (v6) {
+            boost::asio::ip::address_v6::bytes_type bytes;
+            std::copy_n(data, bytes.size(), bytes.begin());
+            peers.emplace_back(boost::asio::ip::address_v6(bytes), port);
+        }
+        else {
+            uint32_t ip = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+            peers.emplace_back(boost::asio::ip::address_v4(ip), port);
+        }
+    }
+}
 
-            std::ostringstream ip;
-            ip << (int)data[0] << "."
-            << (int)data[1] << "."
-            << (int)data[2] << "."
-            << (int)data[3];
+static std::span<const uint8_t> bytes_of(const std::string& s) {
+    return { reinterpret_cast<const uint8_t*>(s.data()), s.size() };
+}
 
-            uint16_t port = (data[4] << 8) | data[5];
+std::vector<Peer> parse_compact_peers(const BEncodeValue& peers_blob) {
+    std::vector<Peer> peers;
 
-            peers.emplace_back(boost::asio::ip::make_address(ip.str()), port);
-        }
+    if (peers_blob.is_string()) {
+        parse_compact_peers(bytes_of(peers_blob.as_string()), false, peers);
     }
 
     else if (peers_blob.is_list()) {
         // std::cout << "Peers are in BEncoded form\n";
+        peers.reserve(peers_blob.as_list().size());
         for (const auto& entry: peers_blob.as_list()) {
             const auto& d = entry.as_dict();
             auto ip = d.at("ip").as_string();
@@ -34,3 +46,36 @@ std::vector<Peer> parse_compact_peers(const BEncodeValue& peers_blob) {
     }
     return peers;
 }
+
+std::vector<Peer> parse_compact_peers6(const BEncodeValue& peers_blob) {
+    std::vector<Peer> peers;
+    if (peers_blob.is_string()) parse_compact_peers(bytes_of(peers_blob.as_string()), true, peers);
+    return peers;
+}
+
+std::vector<Peer> tracker_peers(const BEncodeValue::Dict& response) {
+    std::vector<Peer> peers;
+    if (auto v4 = response.find("peers"); v4 != response.end()) peers = parse_compact_peers(v4->second);
+
+    // BEP 7, IPv6 peers come separately and an IPv6 only tracker may send nothing else
+    if (auto v6 = response.find("peers6"); v6 != response.end() && v6->second.is_string())
+        parse_compact_peers(bytes_of(v6->second.as_string()), true, peers);
+    return peers;
+}
+
+
+std::string compact_peers(const std::vector<Peer>& peers, bool v6) {
+    std::string out;
+    out.reserve(peers.size() * (v6 ? 18 : 6));
+
+    auto append = [&](const auto& bytes) { out.append(reinterpret_cast<const char*>(bytes.data()), bytes.size()); };
+
+    for (const auto& peer : peers) {
+        if (peer.addr().is_v6() != v6) continue;
+        if (v6) append(peer.addr().to_v6().to_bytes());
+        else append(peer.addr().to_v4().to_bytes());
+        out.push_back(static_cast<char>(peer.port() >> 8));
+        out.push_back(static_cast<char>(peer.port() & 0xFF));
+    }
+    return out;
+}
@@ -1,173 +1,243 @@
 #include <PeerConnection.hpp>
+#include <Trace.hpp>
 
-void PeerConnection::start() {
-    auto self = shared_from_this();
+#include <algorithm>
 
-    tcp::endpoint endpoint(peer_.addr(), peer_.port());
-    
-    socket_.async_connect(endpoint,
-        [self](boost::system::error_code ec) {
-            if (ec) self->stop();
-            else self->do_handshake();
-        });
+// the connection's whole life is one coroutine holding the one reference that keeps it alive:
+// connect, handshakes, then messages until either side hangs up. stop() is the only way to end
+// it early, it closes the socket and cancels the timers so whatever is awaited returns
+void PeerConnection::start() {
+    boost::asio::co_spawn(socket_.get_executor(), run(shared_from_this()), boost::asio::detached);
 }
 
-void PeerConnection::start_inbound() {
-    auto self = shared_from_this();
+boost::asio::awaitable<void> PeerConnection::run(std::shared_ptr<PeerConnection> self) {
+    boost::system::error_code ec;
+    auto token = boost::asio::redirect_error(boost::asio::use_awaitable, ec);
 
-    std::print("got an inbound connection\n");
-    boost::asio::async_read(socket_, boost::asio::buffer(handshake_buf_),
-        [self](boost::system::error_code ec, size_t bytes) {
-            if (ec) {
-                std::cout << ec.what() << '\n';
-                self->stop();
-                return;
+    if (inbound_) {
+        // handshake already read and matched to our info_hash by the session
+        if (!check_handshake()) {
+            stop();
+            co_return;
+        }
+        arm_timeout();
+        write_handshake();
+        co_await boost::asio::async_write(socket_, boost::asio::buffer(handshake_buf_), token);
+        if (ec) {
+            stop();
+            co_return;
+        }
+        std::print("inbound peer registered\n");
+    }
+    else {
+        // uTP first, a peer that doesn't answer it within a few seconds gets a TCP connection instead.
+        // the uTP socket is IPv4 only, IPv6 peers go straight to TCP
+        if (utp_ && peer_.addr().is_v4()) {
+            connecting_ = true;
+            auto stream = co_await boost::asio::async_initiate<decltype(token), void(boost::system::error_code, std::shared_ptr<UtpStream>)>(
+                [this](auto handler) {
+                    // the context keeps a copyable callback, the coroutine's handler is move only
+                    auto shared = std::make_shared<decltype(handler)>(std::move(handler));
+                    utp_->connect(udp::endpoint(peer_.addr(), peer_.port()),
+                        [shared](boost::system::error_code ec, std::shared_ptr<UtpStream> stream) { (*shared)(ec, std::move(stream)); });
+                }, token);
+            connecting_ = false;
+
+            if (stopped_) {
+                if (stream) stream->close();
+                co_return;
             }
+            if (!ec && stream) socket_ = PeerSocket(std::move(stream));
+        }
+
+        // connect and both handshakes get one deadline, a peer that stalls anywhere in between is dropped
+        arm_timeout();
 
-            std::string peer_info_hash(self->handshake_buf_.data() + 28, 20);
-            if (peer_info_hash != std::string(reinterpret_cast<const char*>(self->info_hash_.data()), 20)) {
-                self->stop();
-                return;
+        if (!socket_.is_utp()) {
+            co_await socket_.tcp_socket().async_connect(tcp::endpoint(peer_.addr(), peer_.port()), token);
+            if (ec) {
+                stop();
+                co_return;
             }
+        }
+
+        write_handshake();
+        co_await boost::asio::async_write(socket_, boost::asio::buffer(handshake_buf_), token);
+        if (!ec) co_await boost::asio::async_read(socket_, boost::asio::buffer(handshake_buf_), token);
+        if (ec || !check_handshake()) {
+            stop();
+            co_return;
+        }
+    }
+
+    timeout_timer_.cancel();
+    socket_.set_no_delay();
+    on_connected();
+    if (stopped_) co_return;
 
-            std::print("handshake matches!\n");
-            self->send_handshake();
-        });
+    boost::asio::co_spawn(socket_.get_executor(), write_loop(self), boost::asio::detached);
+    co_await read_loop();
 }
 
-void PeerConnection::send_handshake() {
-    auto self = shared_from_this();
+void PeerConnection::arm_timeout() {
+    timeout_timer_.expires_after(handshake_timeout);
+    timeout_timer_.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
+        if (auto self = weak.lock(); self && !ec) self->stop();
+    });
+}
 
-    // Construct handshake message
+void PeerConnection::write_handshake() {
     handshake_buf_[0] = 19;                                     // pstrlen
     std::memcpy(&handshake_buf_[1], "BitTorrent protocol", 19); // pstr
     std::memset(&handshake_buf_[20], 0, 8);                     // reserved
+    handshake_buf_[25] |= 0x10;                                 // extension protocol (BEP 10)
     std::memcpy(&handshake_buf_[28], info_hash_.data(), 20);    // info_hash
     std::memcpy(&handshake_buf_[48], peer_id_.data(), 20);      // peer_id
-
-    boost::asio::async_write(socket_,
-        boost::asio::buffer(handshake_buf_),
-        [self](boost::system::error_code ec, std::size_t bytes) {
-            if (ec) {
-                self->stop();
-                return;
-            }
-            else self->on_inbound_handshake_complete();
-        });    
-}
-
-void PeerConnection::on_inbound_handshake_complete() {
-    std::print("inbound peer registered\n");
-    piece_manager_.add_to_peer_list(weak_from_this());
-    signal_bitfield();
-    read_message_length();
 }
 
 // close connection and stop wasting resources
 void PeerConnection::stop() {
-    boost::system::error_code ec;
-    if (socket_.is_open()) socket_.close(ec);
+    stopped_ = true;
+    socket_.close();
+    have_timer_.cancel();
+    timeout_timer_.cancel();
+    send_signal_.cancel();
+    if (piece_manager_) piece_manager_->remove_peer(this);
 }
 
-void PeerConnection::do_handshake() {
-    auto self = shared_from_this();
-    
-    // Construct handshake message
-    handshake_buf_[0] = 19;                                     // pstrlen
-    std::memcpy(&handshake_buf_[1], "BitTorrent protocol", 19); // pstr
-    std::memset(&handshake_buf_[20], 0, 8);                     // reserved
-    std::memcpy(&handshake_buf_[28], info_hash_.data(), 20);    // info_hash
-    std::memcpy(&handshake_buf_[48], peer_id_.data(), 20);      // peer_id
+void PeerConnection::on_connected() {
+    handshake_done_ = true;
 
-    boost::asio::async_write(socket_,
-        boost::asio::buffer(handshake_buf_),
-        [self](boost::system::error_code ec, std::size_t bytes) {
-            if (ec) {
-                self->stop();
-                return;
-            }
-            else self->on_handshake(ec, bytes);
-        });
+    // without a piece manager there's no bitfield to send yet, attach() does it
+    if (piece_manager_) {
+        piece_manager_->add_peer(shared_from_this());
+        signal_bitfield(); // send my bitfield
+    }
+    if (peer_extensions_) send_extended_handshake();
 }
 
-void PeerConnection::on_handshake(boost::system::error_code ec, std::size_t bytes) {
-    if (ec) return;
-    // std::cout << "Handshake sent (" << bytes << " bytes)\n";
+void PeerConnection::attach(PieceManager& pm) {
+    if (piece_manager_ || stopped_) return;
+    piece_manager_ = &pm;
 
-    auto self = shared_from_this();
-    boost::asio::async_read(socket_,
-        boost::asio::buffer(handshake_buf_),
-        [self](boost::system::error_code ec, std::size_t) {
-            if (ec) {
-                self->stop();
-                return;
-            }
+    peer_bitfield_.resize(pm.num_pieces_);
+    if (!early_bitfield_.empty()) set_bitfield(early_bitfield_);
+    for (auto piece_index : early_haves_)
+        if (piece_index < peer_bitfield_.size()) peer_bitfield_.set(piece_index);
+    early_bitfield_ = {};
+    early_haves_ = {};
 
-            // Verify info_hash
-            std::string peer_info_hash(self->handshake_buf_.data() + 28, 20);
-            if (peer_info_hash != std::string(reinterpret_cast<const char*>(self->info_hash_.data()), 20)) {
-                self->stop();
-                return;
-            }
+    // still handshaking, on_connected registers it
+    if (!handshake_done_ || !socket_.is_open()) return;
 
-            // std::cout << "Handshake verified with " 
-            //           << self->peer_.ip() << ":" << self->peer_.port() << "\n";
+    pm.add_peer(shared_from_this());
+    signal_bitfield();
+    needed_pieces_ = pm.count_needed(peer_bitfield_);
+    update_interest();
+}
+
+// the torrent is ours and the peer isn't us, PEX and the DHT hand out our own address too
+bool PeerConnection::check_handshake() {
+    if (std::memcmp(handshake_buf_.data() + 28, info_hash_.data(), 20) != 0) return false;
+    if (std::memcmp(handshake_buf_.data() + 48, peer_id_.data(), 20) == 0) return false;
 
-            // try reading response
-            self->piece_manager_.add_to_peer_list(self->weak_from_this());
-            self->signal_bitfield(); // send my bitfield
-            self->read_message_length();
-        });
+    peer_extensions_ = handshake_buf_[25] & 0x10;
+    return true;
 }
 
-void PeerConnection::read_message_length() {
-    auto self = shared_from_this();
+// whatever the socket has goes into recv_buf_ and every complete message in it is handled before
+// the next read, so a burst of HAVEs or REQUESTs costs one wakeup instead of two reads apiece
+boost::asio::awaitable<void> PeerConnection::read_loop() {
+    boost::system::error_code ec;
+    auto token = bind_memory(read_memory_, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+    recv_buf_.resize(recv_buffer_size);
+    size_t begin = 0, end = 0;
 
-    boost::asio::async_read(socket_, boost::asio::buffer(length_buf_),
-        [self](boost::system::error_code ec, std::size_t) {
-            if (ec && ec != boost::asio::error::eof) {
-                self->stop();
-                return;
+    for (;;) {
+        while (end - begin >= 4) {
+            uint32_t length = boost::endian::load_big_u32(recv_buf_.data() + begin);
+            if (length > max_message_size) {
+                stop();
+                co_return;
             }
+            if (end - begin - 4 < length) break;
 
-            uint32_t len = (static_cast<uint8_t>(self->length_buf_[0]) << 24) |
-                           (static_cast<uint8_t>(self->length_buf_[1]) << 16) |
-                           (static_cast<uint8_t>(self->length_buf_[2]) << 8)  |
-                           (static_cast<uint8_t>(self->length_buf_[3]));
+            // zero length is a keep-alive
+            if (length) handle_message({ recv_buf_.data() + begin + 4, length });
+            begin += 4 + length;
+            if (stopped_) co_return;
+        }
 
-            if (len == 0) {
-                // Keep-alive (peer might be busy or slow connection)
-                self->read_message_length();
-                return;
-            }
+        // the partial message moves to the front, the buffer grows for one that wouldn't fit
+        if (begin) {
+            std::memmove(recv_buf_.data(), recv_buf_.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        if (end >= 4) {
+            size_t needed = 4 + boost::endian::load_big_u32(recv_buf_.data());
+            if (needed > recv_buf_.size()) recv_buf_.resize(needed);
+        }
 
-            self->msg_buf_.resize(len);
-            self->read_message_body(len);
-        });
+        // eof is the peer hanging up, not a message
+        end += co_await boost::asio::async_read(socket_, boost::asio::buffer(recv_buf_.data() + end, recv_buf_.size() - end),
+                                                boost::asio::transfer_at_least(1), token);
+        if (ec) {
+            stop();
+            co_return;
+        }
+    }
 }
 
-void PeerConnection::read_message_body(std::size_t length) {
-    auto self = shared_from_this();
-    boost::asio::async_read(socket_, boost::asio::buffer(msg_buf_),
-        [self, length](boost::system::error_code ec, std::size_t) {
-            if (ec && ec != boost::asio::error::eof) {
-                self->stop();
-                return;
-            }
+// everything queued while the last write was out goes in the next one, so the requests of a
+// pipeline refill or the HAVEs of a flush leave in as few writes as the socket allows
+// the unnamed shared_ptr is copied into the coroutine frame and keeps us alive while it runs
+boost::asio::awaitable<void> PeerConnection::write_loop(std::shared_ptr<PeerConnection>) {
+    boost::system::error_code ec;
+    auto token = bind_memory(write_memory_, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    auto wait_token = bind_memory(wait_memory_, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+    while (!stopped_) {
+        if (send_buf_.empty()) {
+            // append_message() cancels the wait, stop() too
+            send_signal_.expires_at(boost::asio::steady_timer::time_point::max());
+            co_await send_signal_.async_wait(wait_token);
+            continue;
+        }
 
-            self->handle_message();
+        std::swap(send_buf_, write_buf_);
+        auto piece_bytes = std::exchange(unsent_piece_bytes_, 0);
 
-            // Loop again
-            self->read_message_length();
-        });
+        co_await boost::asio::async_write(socket_, boost::asio::buffer(write_buf_), token);
+        send_queue_bytes_ -= piece_bytes;
+        write_buf_.clear();     // keeps its capacity for the next round
+        if (ec) {
+            stop();
+            co_return;
+        }
+    }
 }
 
-void PeerConnection::handle_message() {
-    
-    if (msg_buf_.empty()) return;
+// room for a message of size bytes at the end of the send queue, for the caller to fill in
+// before it returns to the io context. io thread only
+uint8_t* PeerConnection::append_message(size_t size) {
+    auto offset = send_buf_.size();
+    send_buf_.resize(offset + size);
+    send_signal_.cancel();
+    return send_buf_.data() + offset;
+}
 
-    uint8_t id = static_cast<uint8_t>(msg_buf_[0]);
-    std::span<const unsigned char> payload(msg_buf_.data() + 1, msg_buf_.size() - 1);
+void PeerConnection::handle_message(const std::span<const unsigned char> message) {
+    uint8_t id = message[0];
+    auto payload = message.subspan(1);
+
+    // no piece manager yet: keep what the peer has for attach(), there's nothing to trade
+    if (!piece_manager_ && id >= 4 && id <= 8) {
+        if (id == 5) early_bitfield_.assign(payload.begin(), payload.end());
+        else if (id == 4 && payload.size() >= 4) early_haves_.push_back(boost::endian::load_big_u32(payload.data()));
+        return;
+    }
 
     switch (id) {
         case 0: 
@@ -193,72 +263,32 @@ void PeerConnection::handle_message() {
         case 7: handle_piece(payload); break;                                   // received piece data
         case 8: std::cout << "Received cancel\n"; break;                        // received a cancel
         case 9: std::cout << "Received port\n"; break;                          // received a port
+        case extended_msg_id: handle_extended(payload); break;                  // extension protocol
 
         default: std::print("Unknown message id: {}\n", id); break;
     }
 }
 
-// indicate interest to a peer
-void PeerConnection::send_interested() {
-    auto self = shared_from_this();
-
-    std::array<char, 5> msg{};
-    // length prefix = 1 (message ID only)
-    msg[0] = 0;
-    msg[1] = 0;
-    msg[2] = 0;
-    msg[3] = 1;
-    msg[4] = 2; // message ID = interested
-
-    boost::asio::async_write(socket_, boost::asio::buffer(msg),
-        [self](boost::system::error_code ec, std::size_t /*bytes*/) {
-            if (ec) {
-                self->stop();
-                return;
-            }
-        });
+// indicate (lack of) interest to a peer
+void PeerConnection::send_interest(bool interested) {
+    // length prefix = 1 (message ID only), id 2 = interested, 3 = not interested
+    auto* msg = append_message(5);
+    boost::endian::store_big_u32(msg, 1);
+    msg[4] = interested ? 2 : 3;
 }
 
 // ask for a block
 void PeerConnection::send_request(int piece_index, int begin, int length) {
-    auto self = shared_from_this();
-
-    std::array<char, 17> msg{};
-
-    // length prefix = 13
-    msg[0] = 0;
-    msg[1] = 0;
-    msg[2] = 0;
-    msg[3] = 13;
-
-    msg[4] = 6; // message ID = request
-
-    // piece index
-    msg[5] = (piece_index >> 24) & 0xFF;
-    msg[6] = (piece_index >> 16) & 0xFF;
-    msg[7] = (piece_index >> 8) & 0xFF;
-    msg[8] = piece_index & 0xFF;
-
-    // begin
-    msg[9]  = (begin >> 24) & 0xFF;
-    msg[10] = (begin >> 16) & 0xFF;
-    msg[11] = (begin >> 8) & 0xFF;
-    msg[12] = begin & 0xFF;
-
-    // length
-    msg[13] = (length >> 24) & 0xFF;
-    msg[14] = (length >> 16) & 0xFF;
-    msg[15] = (length >> 8) & 0xFF;
-    msg[16] = length & 0xFF;
-
-    boost::asio::async_write(socket_, boost::asio::buffer(msg),
-        [self, piece_index, begin, length](boost::system::error_code ec, std::size_t /*bytes*/) {
-            if (ec) {
-                self->stop();
-                return;
-            }
-        });
-        in_flight_blocks_.fetch_add(1, std::memory_order_relaxed);  
+    trace::event(trace::Event::RequestSent, piece_index, begin);
+
+    auto* msg = append_message(17);
+    boost::endian::store_big_u32(msg, 13);              // length prefix
+    msg[4] = 6;                                         // message ID = request
+    boost::endian::store_big_u32(msg + 5, piece_index);
+    boost::endian::store_big_u32(msg + 9, begin);
+    boost::endian::store_big_u32(msg + 13, length);
+
+    in_flight_blocks_.fetch_add(1, std::memory_order_relaxed);
 }
 
 // peer informs that they have a piece
@@ -273,14 +303,13 @@ void PeerConnection::handle_have(const std::span<const unsigned char> payload) {
 
     // std::cout << "Peer " << peer_.ip() << ":" << peer_.port()
     //           << " has piece " << piece_index << "\n";
-    
-    peer_bitfield_.set(piece_index);
+    if (piece_index < 0 || (size_t)piece_index >= peer_bitfield_.size()) return;
 
-    // Send interested if not already
-    if (!am_interested_) {
-        am_interested_ = true;
-        send_interested();
+    if (!peer_bitfield_.test(piece_index)) {
+        peer_bitfield_.set(piece_index);
+        if (piece_manager_->is_needed(piece_index)) ++needed_pieces_;
     }
+    update_interest();
 
     // Try requesting immediately if unchoked
     maybe_request_next();
@@ -289,35 +318,37 @@ void PeerConnection::handle_have(const std::span<const unsigned char> payload) {
 // process bitfield and decide interest
 void PeerConnection::handle_bitfield(const std::span<const unsigned char> payload) {
     set_bitfield(payload);
-
-    if (!am_interested_ /* && peer_has_needed_piece() */) {
-        am_interested_ = true;
-        send_interested();
-    }
+    needed_pieces_ = piece_manager_->count_needed(peer_bitfield_);
+    update_interest();
 
     maybe_request_next();
 }
 
-// condition to check whether sending requests to this peer is redundant
-bool PeerConnection::peer_has_needed_piece() {
-    for (size_t i = 0; i < peer_bitfield_.size(); ++i) {
-        if (peer_bitfield_.test(i) && !piece_manager_.is_complete((int)i)) {
-            return true; // This peer has at least one piece we need
-        }
-    }
-    return false;
+// INTERESTED when the peer has something we want, NOT_INTERESTED once it doesn't anymore
+void PeerConnection::update_interest() {
+    bool interested = needed_pieces_ > 0;
+    if (interested == am_interested_) return;
+
+    am_interested_ = interested;
+    send_interest(interested);
+}
+
+void PeerConnection::post_have(int piece_index) {
+    boost::asio::post(socket_.get_executor(), [self = shared_from_this(), piece_index] { self->queue_have(piece_index); });
+}
+
+void PeerConnection::refresh_interest() {
+    boost::asio::post(socket_.get_executor(), [self = shared_from_this()] {
+        if (!self->is_alive() || !self->handshake_done_ || !self->piece_manager_) return;
+        self->needed_pieces_ = self->piece_manager_->count_needed(self->peer_bitfield_);
+        self->update_interest();
+        if (self->am_interested_) self->maybe_request_next();
+    });
 }
 
 // set a bitfield for my reference, 
 void PeerConnection::set_bitfield(const std::span<const unsigned char> payload) {
-    for (size_t i = 0; i < payload.size(); ++i) {
-        for (int bit = 7; bit >= 0; --bit) {
-            if ((payload[i] >> bit) & 1) {
-                auto piece_index = i * 8 + (7 - bit);
-                peer_bitfield_.set(piece_index);
-            }
-        }
-    }
+    peer_bitfield_.assign(payload);
 }
 
 // incoming piece
@@ -327,26 +358,41 @@ void PeerConnection::handle_piece(const std::span<const unsigned char> payload)
         return;
     }
 
-    int piece_index = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
-    int begin = (payload[4] << 24) | (payload[5] << 16) | (payload[6] << 8) | payload[7];
+    uint32_t index = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+    uint32_t offset = (payload[4] << 24) | (payload[5] << 16) | (payload[6] << 8) | payload[7];
+    auto length = payload.size() - 8;
+
+    // only whole blocks of a piece we have metadata for, anything else would land outside its buffer
+    if (!piece_manager_ || index >= piece_manager_->num_pieces_ || offset % 16384 != 0) return;
+    auto piece_length = piece_manager_->piece_length_for_index((int)index);
+    if (offset >= piece_length || length != std::min<size_t>(16384, piece_length - offset)) return;
+
+    int piece_index = (int)index;
+    int begin = (int)offset;
+    trace::event(trace::Event::BlockReceived, piece_index, begin);
 
     // try storing the block now
     in_flight_blocks_.fetch_sub(1, std::memory_order_relaxed);
-    piece_manager_.add_block(piece_index, begin, payload.subspan(8));
+    downloaded_.add(length);
+    piece_manager_->add_block(piece_index, begin, payload.subspan(8));
 
     maybe_request_next();
 }
 
 // try request
 void PeerConnection::maybe_request_next() {
-    while (!am_choked_ && in_flight_blocks_ < max_in_flight_blocks) {
+    // the disk is behind, what's in flight still lands but nothing new goes out until it caught up
+    if (!piece_manager_ || piece_manager_->write_backlogged()) return;
+
+    auto max_in_flight = local_ ? max_in_flight_blocks_local : max_in_flight_blocks;
+    while (!am_choked_ && in_flight_blocks_ < max_in_flight) {
         auto now = std::chrono::steady_clock::now();
-        if (auto req = piece_manager_.next_block_request(peer_bitfield_, now, weak_from_this())) {
+        if (auto req = piece_manager_->next_block_request(peer_bitfield_, now, weak_from_this())) {
             const auto& [piece_index, offset] = req.value();
             send_request(
                 piece_index,
                 offset,
-                std::min(16384, (int)piece_manager_.piece_length_for_index(piece_index) - offset)
+                std::min(16384, (int)piece_manager_->piece_length_for_index(piece_index) - offset)
             );
         } else break;
     }
@@ -358,25 +404,52 @@ void PeerConnection::decrement_inflight_blocks() {
 }
 
 // signal to the peer that I have this piece
-void PeerConnection::signal_have(int piece_index) {
-    auto self = shared_from_this();
+bool PeerConnection::queue_have(int piece_index) {
+    bool peer_has = peer_bitfield_.test(piece_index);
+
+    // one piece less to want from this peer, a full recount settles it before we drop interest
+    if (peer_has && needed_pieces_ > 0 && --needed_pieces_ == 0) {
+        needed_pieces_ = piece_manager_->count_needed(peer_bitfield_);
+        update_interest();
+    }
 
-    std::array<unsigned char, 9> msg{};
+    // nothing to tell a peer that has the piece itself
+    if (peer_has || !is_alive()) return false;
 
-    uint32_t len = boost::endian::native_to_big(5);
-    uint32_t index = boost::endian::native_to_big(piece_index);
+    pending_haves_.push_back((uint32_t)piece_index);
+    if (!std::exchange(have_flush_scheduled_, true)) {
+        have_timer_.expires_after(have_flush_interval_);
+        have_timer_.async_wait(bind_memory(have_memory_, [self = shared_from_this()](boost::system::error_code ec) {
+            self->have_flush_scheduled_ = false;
+            if (!ec) self->flush_haves();
+        }));
+    }
+    return true;
+}
 
-    std::memcpy(msg.data(), &len, 4);       // length prefix
-    msg[4] = 4;                             // message ID -- HAVE
-    std::memcpy(msg.data() + 5, &index, 4); // piece index in big endian
+// every HAVE queued since the last flush in one write
+void PeerConnection::flush_haves() {
+    // still handshaking, the bitfield we send once through has these pieces already
+    if (!handshake_done_) pending_haves_.clear();
+    if (pending_haves_.empty() || !is_alive()) return;
+
+    auto* out = append_message(pending_haves_.size() * 9);
+    for (auto piece_index : pending_haves_) {
+        boost::endian::store_big_u32(out, 5);               // length prefix
+        out[4] = 4;                                         // message ID -- HAVE
+        boost::endian::store_big_u32(out + 5, piece_index); // piece index in big endian
+        out += 9;
+    }
+    pending_haves_.clear();
+}
 
-    boost::asio::async_write(socket_, boost::asio::buffer(msg),
-        [self, piece_index](boost::system::error_code ec, size_t bytes) {}
-    );
-} 
+void PeerConnection::update_rates(std::chrono::steady_clock::time_point now) {
+    download_rate_.sample(downloaded_.load(), now);
+    upload_rate_.sample(uploaded_.load(), now);
+}
 
 bool PeerConnection::is_alive() const {
-    return socket_.is_open();
+    return connecting_ || socket_.is_open();
 }
 
 const Peer& PeerConnection::peer() const {
@@ -384,41 +457,23 @@ const Peer& PeerConnection::peer() const {
 }
 
 void PeerConnection::signal_bitfield() {
-    auto self = shared_from_this();
+    auto my_bitfield = piece_manager_->get_my_bitfield();
 
-    auto my_bitfield = piece_manager_.get_my_bitfield();
-    
-    uint32_t msg_len = (uint32_t)boost::endian::native_to_big(1 + my_bitfield.size());
-
-    std::vector<uint8_t> buffer;
-    buffer.reserve(4 + msg_len);
-
-    buffer.insert(buffer.end(), reinterpret_cast<uint8_t*>(&msg_len), reinterpret_cast<uint8_t*>(&msg_len) + 4);
-    buffer.push_back(5); // id = bitfield
-    buffer.insert(buffer.end(), my_bitfield.begin(), my_bitfield.end());
-
-    // move the buffer into the lambda to prevent lifetime issues
-    // and mark the lambda mutable to make the compiler happy
-
-    boost::asio::async_write(socket_, boost::asio::buffer(buffer),
-        [self, buf = std::move(buffer)](boost::system::error_code ec, size_t bytes) mutable {});
+    auto* msg = append_message(5 + my_bitfield.size());
+    boost::endian::store_big_u32(msg, static_cast<uint32_t>(1 + my_bitfield.size()));
+    msg[4] = 5; // id = bitfield
+    std::copy(my_bitfield.begin(), my_bitfield.end(), msg + 5);
 
     // our job is done, we don't care whether the bitfield reaches the peer or not
-}   
+}
 
 void PeerConnection::signal_unchoke() {
-    auto self = shared_from_this();
     peer_choked = false;
-    
-    std::array<uint8_t, 5> msg{};
 
-    uint32_t len = boost::endian::native_to_big(1);
-    std::memcpy(msg.data(), &len, 4);
+    auto* msg = append_message(5);
+    boost::endian::store_big_u32(msg, 1);
     msg[4] = 1; // id = unchoke
 
-    boost::asio::async_write(socket_, boost::asio::buffer(msg),
-        [self](boost::system::error_code ec, size_t bytes) {});
-
     // again, we don't care if the message is received by the peer or not
 }
 
@@ -426,32 +481,231 @@ void PeerConnection::signal_unchoke() {
 void PeerConnection::handle_request(const std::span<const unsigned char> payload) {
     if (payload.size() < 12) return;
 
-    uint32_t piece_index = boost::endian::big_to_native(*reinterpret_cast<const uint32_t*>(payload.data()));
-    uint32_t begin = boost::endian::big_to_native(*reinterpret_cast<const uint32_t*>(payload.data() + 4));
-    uint32_t length = boost::endian::big_to_native(*reinterpret_cast<const uint32_t*>(payload.data() + 8));
+    uint32_t piece_index = boost::endian::load_big_u32(payload.data());
+    uint32_t begin = boost::endian::load_big_u32(payload.data() + 4);
+    uint32_t length = boost::endian::load_big_u32(payload.data() + 8);
+
+    if (length == 0 || length > max_request_length) return;
+
+    // read straight into the send queue, the block needs no buffer of its own
+    auto* msg = append_message(13 + length);
+    if (!piece_manager_->read_block(piece_index, begin, { msg + 13, length })) {
+        send_buf_.resize(send_buf_.size() - (13 + length));
+        return;
+    }
+    boost::endian::store_big_u32(msg, 9 + length);
+    msg[4] = 7; // id - piece
+    boost::endian::store_big_u32(msg + 5, piece_index);
+    boost::endian::store_big_u32(msg + 9, begin);
+
+    uploaded_.add(length);
+    send_queue_bytes_ += 13 + length;
+    unsent_piece_bytes_ += 13 + length;
+}
+
+// -- extension protocol (BEP 10) --
+
+void PeerConnection::send_extended_handshake() {
+    using Dict = BEncodeValue::Dict;
+
+    Dict m{ { "ut_metadata", BEncodeValue{ (int64_t)ut_metadata_id } } };
+    if (extensions_.pex) m.emplace("ut_pex", BEncodeValue{ (int64_t)ut_pex_id });
+
+    Dict handshake{ { "m", BEncodeValue{ std::move(m) } }, { "v", BEncodeValue{ std::string("ctorrent") } } };
+    if (extensions_.listen_port) handshake.emplace("p", BEncodeValue{ (int64_t)extensions_.listen_port });
+    if (auto info = extensions_.metadata ? extensions_.metadata() : std::string_view{}; !info.empty())
+        handshake.emplace("metadata_size", BEncodeValue{ (int64_t)info.size() });
+
+    send_extended(0, bencode(BEncodeValue{ std::move(handshake) }));
+}
 
-    auto block = piece_manager_.fetch_block(piece_index, begin, length);
-    if (block.empty()) return;
+void PeerConnection::send_extended(uint8_t id, const std::string& payload) {
+    auto* msg = append_message(6 + payload.size());
+    boost::endian::store_big_u32(msg, static_cast<uint32_t>(2 + payload.size()));
+    msg[4] = extended_msg_id;
+    msg[5] = id;
+    std::memcpy(msg + 6, payload.data(), payload.size());
+}
 
-    auto self = shared_from_this();
+void PeerConnection::handle_extended(const std::span<const unsigned char> payload) {
+    if (payload.empty()) return;
 
-    uint32_t msg_len = (uint32_t)boost::endian::native_to_big(9 + block.size());
+    auto body = payload.subspan(1);
+    switch (payload[0]) {
+        case 0: handle_extended_handshake(body); break;
+        case ut_pex_id: handle_pex(body); break;
+        case ut_metadata_id: handle_metadata(body); break;
+        default: break;     // nothing else was offered, ignore
+    }
+}
 
-    std::vector<uint8_t> buffer;
-    buffer.reserve(4 + msg_len);
+void PeerConnection::handle_extended_handshake(const std::span<const unsigned char> payload) {
+    BEncodeValue handshake;
+    try { handshake = BEncodeParser(std::string_view(reinterpret_cast<const char*>(payload.data()), payload.size())).parse(); }
+    catch (const std::exception&) { return; }
+    if (!handshake.is_dict()) return;
+
+    const auto& d = handshake.as_dict();
+
+    // a later handshake may take extensions back, "m" is always the whole set
+    if (auto m = d.find("m"); m != d.end() && m->second.is_dict()) {
+        const auto& ids = m->second.as_dict();
+        auto id = [&](const char* name) {
+            auto it = ids.find(name);
+            return it != ids.end() && it->second.is_int() ? (uint8_t)it->second.as_int() : uint8_t{};
+        };
+        peer_pex_id_ = id("ut_pex");
+        peer_metadata_id_ = id("ut_metadata");
+    }
+    if (auto p = d.find("p"); p != d.end() && p->second.is_int() && p->second.as_int() > 0 && p->second.as_int() <= 0xFFFF)
+        peer_listen_port_ = (uint16_t)p->second.as_int();
 
-    buffer.insert(buffer.end(), reinterpret_cast<uint8_t*>(&msg_len), reinterpret_cast<uint8_t*>(&msg_len) + 4);
-    buffer.push_back(7); // id - piece
+    // a magnet still fetching learns the metadata size from whoever has it
+    if (auto size = d.find("metadata_size"); size != d.end() && size->second.is_int() && size->second.as_int() > 0 &&
+        peer_metadata_id_ && extensions_.metadata_source)
+        extensions_.metadata_source(shared_from_this(), (size_t)size->second.as_int());
 
-    uint32_t be_index = boost::endian::native_to_big(piece_index);
-    uint32_t be_begin = boost::endian::native_to_big(begin);
+    // the first PEX message goes out on the next tick, the peer needs the swarm most right now
+    next_pex_ = {};
+}
+
+void PeerConnection::handle_pex(const std::span<const unsigned char> payload) {
+    if (!extensions_.pex) return;
 
-    buffer.insert(buffer.end(), reinterpret_cast<uint8_t*>(&be_index), reinterpret_cast<uint8_t*>(&be_index) + 4);
-    buffer.insert(buffer.end(), reinterpret_cast<uint8_t*>(&be_begin), reinterpret_cast<uint8_t*>(&be_begin) + 4);
-    buffer.insert(buffer.end(), block.begin(), block.end());
+    BEncodeValue message;
+    try { message = BEncodeParser(std::string_view(reinterpret_cast<const char*>(payload.data()), payload.size())).parse(); }
+    catch (const std::exception&) { return; }
+    if (!message.is_dict()) return;
+
+    const auto& d = message.as_dict();
+    std::vector<Peer> peers;
+    if (auto added = d.find("added"); added != d.end() && added->second.is_string()) peers = parse_compact_peers(added->second);
+    if (auto added6 = d.find("added6"); added6 != d.end()) {
+        auto peers6 = parse_compact_peers6(added6->second);
+        peers.insert(peers.end(), peers6.begin(), peers6.end());
+    }
 
-    boost::asio::async_write(socket_, boost::asio::buffer(buffer),
-        [self, b = std::move(buffer)](boost::system::error_code ec, size_t bytes) mutable {
-            // if (!ec) std::print("Block uploaded\n");
-        });
-}
\ No newline at end of file
+    // a peer can claim anything, don't let one message flood the candidate pool
+    if (peers.size() > max_pex_peers) peers.erase(peers.begin() + max_pex_peers, peers.end());
+    if (!peers.empty()) extensions_.pex(peers);
+}
+
+// -- ut_metadata (BEP 9) --
+
+void PeerConnection::request_metadata(int piece) {
+    if (!peer_metadata_id_ || !socket_.is_open()) return;
+
+    using Dict = BEncodeValue::Dict;
+    send_extended(peer_metadata_id_, bencode(BEncodeValue{ Dict{
+        { "msg_type", BEncodeValue{ (int64_t)0 } },
+        { "piece", BEncodeValue{ (int64_t)piece } },
+    } }));
+}
+
+// a bencoded dict, for data messages followed by the piece itself
+void PeerConnection::handle_metadata(const std::span<const unsigned char> payload) {
+    BEncodeParser parser(std::string_view(reinterpret_cast<const char*>(payload.data()), payload.size()));
+    BEncodeValue message;
+    try { message = parser.parse(); }
+    catch (const std::exception&) { return; }
+    if (!message.is_dict()) return;
+
+    const auto& d = message.as_dict();
+    auto type = d.find("msg_type");
+    auto piece = d.find("piece");
+    if (type == d.end() || piece == d.end() || !type->second.is_int() || !piece->second.is_int()) return;
+
+    auto piece_index = (int)piece->second.as_int();
+    switch (type->second.as_int()) {
+        case 0: send_metadata(piece_index); break;     // request
+        case 1:                                         // data
+            if (extensions_.metadata_piece) extensions_.metadata_piece(shared_from_this(), piece_index, payload.subspan(parser.position()));
+            break;
+        case 2:                                         // reject
+            if (extensions_.metadata_piece) extensions_.metadata_piece(shared_from_this(), piece_index, {});
+            break;
+        default: break;
+    }
+}
+
+void PeerConnection::send_metadata(int piece) {
+    if (!peer_metadata_id_) return;
+
+    using Dict = BEncodeValue::Dict;
+    auto info = extensions_.metadata ? extensions_.metadata() : std::string_view{};
+    auto offset = (size_t)piece * metadata_piece_size;
+
+    if (piece < 0 || offset >= info.size()) {
+        send_extended(peer_metadata_id_, bencode(BEncodeValue{ Dict{
+            { "msg_type", BEncodeValue{ (int64_t)2 } },
+            { "piece", BEncodeValue{ (int64_t)piece } },
+        } }));
+        return;
+    }
+
+    auto message = bencode(BEncodeValue{ Dict{
+        { "msg_type", BEncodeValue{ (int64_t)1 } },
+        { "piece", BEncodeValue{ (int64_t)piece } },
+        { "total_size", BEncodeValue{ (int64_t)info.size() } },
+    } });
+    message += info.substr(offset, metadata_piece_size);
+    send_extended(peer_metadata_id_, message);
+}
+
+std::optional<Peer> PeerConnection::listen_peer() const {
+    if (!inbound_) return peer_;
+    if (peer_listen_port_) return Peer(peer_.addr(), peer_listen_port_);
+    return std::nullopt;
+}
+
+// BEP 11: at most one message a minute, each one the peers connected and dropped since the last.
+// the diff is against what this peer was told, so a peer that misses nothing sees every change once
+void PeerConnection::maybe_send_pex(const std::vector<std::shared_ptr<PeerConnection>>& connected, std::chrono::steady_clock::time_point now) {
+    if (!peer_pex_id_ || !extensions_.pex || now < next_pex_ || !socket_.is_open()) return;
+    next_pex_ = now + pex_interval;
+
+    std::vector<Peer> current;
+    std::string added_flags, added6_flags;     // one per peer, in the order each family is packed
+    std::vector<Peer> added_peers;
+    for (const auto& connection : connected) {
+        if (connection.get() == this || !connection->is_alive()) continue;
+        auto peer = connection->listen_peer();
+        if (!peer) continue;
+
+        if (std::ranges::find(pex_sent_, *peer) == pex_sent_.end()) {
+            if (added_peers.size() >= max_pex_peers) continue;   // the rest go out next time
+            added_peers.push_back(*peer);
+
+            uint8_t flags = 0;
+            if (connection->peer_bitfield_.size() && connection->peer_bitfield_.count() == connection->peer_bitfield_.size()) flags |= 0x02;  // seed
+            if (connection->is_utp()) flags |= 0x04;        // supports uTP
+            if (!connection->inbound_) flags |= 0x10;       // reachable, we connected to it
+            (peer->addr().is_v6() ? added6_flags : added_flags).push_back(static_cast<char>(flags));
+        }
+        current.push_back(std::move(*peer));
+    }
+
+    std::vector<Peer> dropped_peers;
+    for (const auto& peer : pex_sent_) {
+        if (dropped_peers.size() >= max_pex_peers) break;
+        if (std::ranges::find(current, peer) == current.end()) dropped_peers.push_back(peer);
+    }
+    if (added_peers.empty() && dropped_peers.empty()) return;
+
+    // what the peer knows now: what it knew, minus what was dropped, plus what was added
+    std::erase_if(pex_sent_, [&](const Peer& peer) { return std::ranges::find(dropped_peers, peer) != dropped_peers.end(); });
+    pex_sent_.insert(pex_sent_.end(), added_peers.begin(), added_peers.end());
+
+    using Dict = BEncodeValue::Dict;
+    Dict message{
+        { "added", BEncodeValue{ compact_peers(added_peers) } },
+        { "added.f", BEncodeValue{ std::move(added_flags) } },
+        { "dropped", BEncodeValue{ compact_peers(dropped_peers) } },
+    };
+    if (!added6_flags.empty() || std::ranges::any_of(dropped_peers, [](const Peer& p) { return p.addr().is_v6(); })) {
+        message["added6"] = BEncodeValue{ compact_peers(added_peers, true) };
+        message["added6.f"] = BEncodeValue{ std::move(added6_flags) };
+        message["dropped6"] = BEncodeValue{ compact_peers(dropped_peers, true) };
+    }
+    send_extended(peer_pex_id_, bencode(BEncodeValue{ std::move(message) }));
+}
@@ -1,22 +1,205 @@
 #include <PieceManager.hpp>
 #include <PeerConnection.hpp>
+#include <Trace.hpp>
+#include <Utils.hpp>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 PieceManager::~PieceManager() {
-    stop_writer_ = true;
-    write_cv_.notify_all();
-    if (writer_thread_.joinable()) writer_thread_.join();
+    // wait out disk jobs that still reference us (a running check gives up early), then write
+    // whatever is left on this thread
+    stopping_ = true;
+    {
+        std::unique_lock<std::mutex> lock(write_mutex_);
+        write_cv_.wait(lock, [&] { return pending_disk_jobs_ == 0; });
+    }
+    flush_completed_pieces();
+
+    // the queue is drained, so this snapshot matches what is on disk. not after an unfinished
+    // check though, the old resume data is better than state nobody verified
+    if (!files_.empty() && !checking_) save_resume_data();
+}
+
+void PieceManager::post_disk_job(std::function<void()> job) {
+    post_job(disk_pool_, std::move(job));
+}
+
+void PieceManager::post_job(ThreadPool& pool, std::function<void()> job) {
+    {
+        std::scoped_lock<std::mutex> lock(write_mutex_);
+        ++pending_disk_jobs_;
+        stats_.pending_disk_jobs.store(pending_disk_jobs_, std::memory_order_relaxed);
+    }
+
+    pool.post([this, job = std::move(job)] {
+        job();
+
+        // notify under the lock, the destructor may run the moment it sees zero
+        std::scoped_lock<std::mutex> lock(write_mutex_);
+        --pending_disk_jobs_;
+        stats_.pending_disk_jobs.store(pending_disk_jobs_, std::memory_order_relaxed);
+        write_cv_.notify_all();
+    });
+}
+
+namespace {
+    // reserve real blocks for the whole file so later random writes don't fragment it
+    bool preallocate(const std::string& path, size_t length) {
+#ifdef __linux__
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+        int rc = ::fallocate(fd, 0, 0, (off_t)length);
+        ::close(fd);
+        if (rc == 0) return true;
+#endif
+        // no fallocate on this platform/filesystem, at least get the size right
+        std::error_code ec;
+        if (std::filesystem::file_size(path, ec) < length && !ec) std::filesystem::resize_file(path, length, ec);
+        return !ec;
+    }
+
+    // all of iov at offset, however many calls that takes
+    bool write_file(const std::string& path, size_t offset, std::vector<iovec>& iov) {
+        constexpr size_t max_iov = 1024;    // IOV_MAX on Linux and the BSDs
+
+        int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+
+        size_t first = 0;
+        while (first < iov.size()) {
+            auto n = ::pwritev(fd, iov.data() + first, (int)std::min(iov.size() - first, max_iov), (off_t)offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            offset += (size_t)n;
+
+            // drop what went out, a short write leaves the rest of a buffer for the next call
+            for (auto left = (size_t)n; left > 0;) {
+                auto take = std::min(left, iov[first].iov_len);
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + take;
+                iov[first].iov_len -= take;
+                left -= take;
+                if (iov[first].iov_len == 0) ++first;
+            }
+        }
+        ::close(fd);
+        return first == iov.size();
+    }
+
+    void sync_file(const std::string& path) {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd < 0) return;
+#ifdef __linux__
+        ::fdatasync(fd);
+#else
+        ::fsync(fd);
+#endif
+        ::close(fd);
+    }
+
+    int64_t file_mtime(const std::filesystem::path& path, std::error_code& ec) {
+        return std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+    }
 
-    stop_timeout_ = true;
-    timeout_cv_.notify_all();
-    if (timeout_thread_.joinable()) timeout_thread_.join();
+    // what the file really occupies on disk, a preallocated sparse file has a size but no blocks
+    size_t allocated_bytes(const std::string& path) {
+        struct stat st {};
+        if (::stat(path.c_str(), &st) != 0) return 0;
+        return (size_t)st.st_blocks * 512;
+    }
 }
 
-void PieceManager::load_resume_data() {
-    std::ifstream in(save_file_name_, std::ios::binary | std::ios::in);
+// resume file layout (bencoded dict):
+//   file-format   "ctorrent resume file"
+//   file-version  resume_file_version_
+//   num pieces / piece length, must match the torrent
+//   pieces        bitfield of pieces that are verified and on disk
+//   unfinished    list of { piece, bitmask } for pieces with received blocks, blocks are on disk
+//   file sizes    list of [ size, mtime ] per file, taken after a sync. a changed size discards the resume
+//                 data, a newer mtime only gets the file's pieces hashed again before they're trusted
+bool PieceManager::load_resume_data() {
+    if (!std::filesystem::exists(save_file_name_)) return false;
+
+    BEncodeValue root;
+    try {
+        auto in = read_from_file(save_file_name_);
+        root = BEncodeParser(in).parse();
+    }
+    catch (const std::exception& e) {
+        std::print("Ignoring unreadable resume file {}: {}\n", save_file_name_, e.what());
+        return false;
+    }
+
+    auto reject = [&](std::string_view reason) {
+        std::print("Ignoring resume file {}: {}\n", save_file_name_, reason);
+        return false;
+    };
+
+    if (!root.is_dict()) return reject("not a dictionary");
+    const auto& dict = root.as_dict();
+
+    auto get = [&](const std::string& key) -> const BEncodeValue* {
+        auto it = dict.find(key);
+        return it == dict.end() ? nullptr : &it->second;
+    };
+
+    auto format = get("file-format");
+    auto version = get("file-version");
+    if (!format || !format->is_string() || format->as_string() != "ctorrent resume file") return reject("unknown format");
+    if (!version || !version->is_int() || version->as_int() != resume_file_version_) return reject("unsupported version");
+
+    auto pieces_count = get("num pieces");
+    auto length = get("piece length");
+    if (!pieces_count || !pieces_count->is_int() || (size_t)pieces_count->as_int() != num_pieces_ ||
+        !length || !length->is_int() || (size_t)length->as_int() != piece_length_) return reject("torrent layout changed");
 
-    int piece_index{}, piece_count{};
+    // validate the data files against what they looked like when the resume data was written. the
+    // writer keeps going after a save, so after a crash the mtimes are usually newer: that costs
+    // a hash of the pieces we claim in those files, not the whole resume data
+    std::vector<char> suspect(num_pieces_, 0);
+    auto sizes = get("file sizes");
+    if (!sizes || !sizes->is_list() || sizes->as_list().size() != files_.size()) return reject("file list changed");
+
+    for (size_t i = 0; i < files_.size(); ++i) {
+        const auto& entry = sizes->as_list()[i];
+        if (!entry.is_list() || entry.as_list().size() != 2 || !entry.as_list()[0].is_int() || !entry.as_list()[1].is_int())
+            return reject("malformed file entry");
+        auto saved_size = entry.as_list()[0].as_int();
+        auto saved_mtime = entry.as_list()[1].as_int();
+
+        std::error_code ec;
+        auto size = std::filesystem::file_size(files_[i].path, ec);
+        if (ec && saved_size == -1 && files_[i].in_part_file) continue; // never created
+        if (ec || (int64_t)size != saved_size) return reject(files_[i].path + " changed size");
+
+        auto mtime = file_mtime(files_[i].path, ec);
+        if (!ec && mtime == saved_mtime) continue;
+
+        const auto& f = files_[i];
+        if (f.length == 0) continue;
+        std::fill(suspect.begin() + (ptrdiff_t)(f.start / piece_length_), suspect.begin() + (ptrdiff_t)((f.start + f.length - 1) / piece_length_ + 1), 1);
+    }
+
+    auto bitfield = get("pieces");
+    if (!bitfield || !bitfield->is_string() || bitfield->as_string().size() != my_bitfield_.byte_size()) return reject("malformed bitfield");
+
+    const auto& bits = bitfield->as_string();
+    int piece_count{};
+    std::vector<char> verify(num_pieces_, 0);
+    size_t verify_count{};
+
+    for (size_t piece_index = 0; piece_index < num_pieces_; ++piece_index) {
+        if (!((uint8_t)bits[piece_index / 8] & (1 << (7 - piece_index % 8)))) continue;
+
+        if (suspect[piece_index]) {
+            verify[piece_index] = 1;
+            ++verify_count;
+            continue;
+        }
 
-    while (in.read(reinterpret_cast<char*>(&piece_index), sizeof(int))) {
         auto& curr = pieces_[piece_index];
         auto curr_length = piece_length_for_index(piece_index);
 
@@ -25,164 +208,892 @@ void PieceManager::load_resume_data() {
 
         // modify my bitfield
         update_my_bitfield(piece_index);
-        stats_.downloaded_bytes.fetch_add(curr_length, std::memory_order_relaxed);
+        stats_.downloaded_bytes.add(curr_length);
         ++piece_count;
     }
-    
-    std::cout << "Found " << piece_count << '/' << num_pieces_ << " pieces\n";
+
+    // pull the blocks of unfinished pieces back in, the hash check on completion catches anything stale
+    int partial_count{};
+    if (auto unfinished = get("unfinished"); unfinished && unfinished->is_list()) {
+        std::scoped_lock<std::mutex> lock(piece_mutex_);
+
+        for (const auto& entry : unfinished->as_list()) {
+            if (!entry.is_dict()) continue;
+            const auto& d = entry.as_dict();
+
+            auto piece_it = d.find("piece");
+            auto mask_it = d.find("bitmask");
+            if (piece_it == d.end() || mask_it == d.end() || !piece_it->second.is_int() || !mask_it->second.is_string()) continue;
+
+            auto piece_index = piece_it->second.as_int();
+            if (piece_index < 0 || (size_t)piece_index >= num_pieces_ || pieces_[piece_index].is_complete) continue;
+
+            maybe_init(piece_index);
+            auto& piece = pieces_[piece_index];
+            const auto& mask = mask_it->second.as_string();
+
+            for (size_t block = 0; block < piece.block_status.size() && block / 8 < mask.size(); ++block) {
+                if (!((uint8_t)mask[block / 8] & (1 << (7 - block % 8)))) continue;
+
+                size_t begin = block * 16384;
+                size_t block_length = std::min<size_t>(16384, piece.data.size() - begin);
+
+                if (!read_range(piece_index * piece_length_ + begin, piece.data.data() + begin, block_length)) continue;
+
+                piece.block_status[block] = BlockState::Received;
+                piece.bytes_written += block_length;
+                stats_.downloaded_bytes.add(block_length);
+            }
+            ++partial_count;
+        }
+    }
+
+    std::cout << "Found " << piece_count << '/' << num_pieces_ << " pieces, " << partial_count << " partial\n";
     stats_.completed_pieces.store(piece_count, std::memory_order_relaxed);
-    if (piece_count == num_pieces_) {
+
+    if (verify_count > 0) {
+        std::print("{} pieces are in files written after the resume data, checking them\n", verify_count);
+        start_check(std::move(verify));
+    }
+    else if (std::scoped_lock<std::mutex> lock(piece_mutex_); all_wanted_complete()) {
         std::print("Torrent is complete. Seeding...\n");
         is_torrent_complete = true;
     }
+    return true;
 }
 
-void PieceManager::save_resume_data(int piece_index) {
+void PieceManager::save_resume_data() {
     std::scoped_lock<std::mutex> lock(resume_file_mutex_);
-    std::ofstream out(save_file_name_, std::ios::binary | std::ios::out | std::ios::app);
-    out.write(reinterpret_cast<const char*>(&piece_index), sizeof(int));
+    resume_dirty_ = false;
+
+    struct PartialPiece {
+        int index;
+        std::string bitmask;
+        std::vector<std::pair<size_t, std::vector<unsigned char>>> blocks;
+    };
+
+    std::string bitfield((num_pieces_ + 7) / 8, '\0');
+    std::vector<PartialPiece> partials;
+
+    {
+        std::scoped_lock<std::mutex> lock(piece_mutex_);
+
+        for (size_t i = 0; i < num_pieces_; ++i) {
+            const auto& piece = pieces_[i];
+
+            // verified pieces still waiting for the writer are picked up by the next save
+            if (piece.is_complete) {
+                if (piece.data.empty()) bitfield[i / 8] |= (char)(1 << (7 - i % 8));
+                continue;
+            }
+
+            if (piece.data.empty()) continue;
+
+            PartialPiece partial{ (int)i, std::string((piece.block_status.size() + 7) / 8, '\0'), {} };
+            for (size_t block = 0; block < piece.block_status.size(); ++block) {
+                if (piece.block_status[block] != BlockState::Received) continue;
+
+                size_t begin = block * 16384;
+                size_t block_length = std::min<size_t>(16384, piece.data.size() - begin);
+
+                partial.bitmask[block / 8] |= (char)(1 << (7 - block % 8));
+                partial.blocks.emplace_back(begin, std::vector<unsigned char>(piece.data.begin() + begin, piece.data.begin() + begin + block_length));
+            }
+            if (!partial.blocks.empty()) partials.push_back(std::move(partial));
+        }
+    }
+
+    // blocks of unfinished pieces have to be on disk before the file mtimes are taken
+    BEncodeValue::List unfinished;
+    for (const auto& partial : partials) {
+        for (const auto& [begin, block] : partial.blocks) write_range(partial.index * piece_length_ + begin, block.data(), block.size());
+
+        BEncodeValue::Dict entry;
+        entry["piece"] = BEncodeValue{ (int64_t)partial.index };
+        entry["bitmask"] = BEncodeValue{ partial.bitmask };
+        unfinished.push_back(BEncodeValue{ std::move(entry) });
+    }
+
+    // what the snapshot claims has to survive a power cut
+    sync_files();
+
+    BEncodeValue::List sizes;
+    for (const auto& f : files_) {
+        std::error_code ec;
+        auto size = std::filesystem::file_size(f.path, ec);
+        auto mtime = file_mtime(f.path, ec);
+        sizes.push_back(BEncodeValue{ BEncodeValue::List{ BEncodeValue{ ec ? -1 : (int64_t)size }, BEncodeValue{ ec ? -1 : mtime } } });
+    }
+
+    BEncodeValue::Dict root;
+    root["file-format"] = BEncodeValue{ std::string("ctorrent resume file") };
+    root["file-version"] = BEncodeValue{ (int64_t)resume_file_version_ };
+    root["num pieces"] = BEncodeValue{ (int64_t)num_pieces_ };
+    root["piece length"] = BEncodeValue{ (int64_t)piece_length_ };
+    root["pieces"] = BEncodeValue{ std::move(bitfield) };
+    root["unfinished"] = BEncodeValue{ std::move(unfinished) };
+    root["file sizes"] = BEncodeValue{ std::move(sizes) };
+
+    auto encoded = bencode(BEncodeValue{ std::move(root) });
+
+    // write the new snapshot next to the old one, sync it and swap it in, then sync the directory
+    // so the rename itself survives. a crash leaves either the old file or the new one, never a torn one
+    auto tmp_name = save_file_name_ + ".tmp";
+    int fd = ::open(tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    size_t written{};
+    while (fd >= 0 && written < encoded.size()) {
+        auto n = ::write(fd, encoded.data() + written, encoded.size() - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += (size_t)n;
+    }
+    bool ok = fd >= 0 && written == encoded.size() && ::fsync(fd) == 0;
+    if (fd >= 0) ::close(fd);
+    if (!ok) {
+        std::print("Failed to write resume file {}\n", tmp_name);
+        return;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp_name, save_file_name_, ec);
+    if (ec) {
+        std::print("Failed to replace resume file {}: {}\n", save_file_name_, ec.message());
+        return;
+    }
+
+    auto dir = std::filesystem::path(save_file_name_).parent_path();
+    if (dir.empty()) dir = ".";
+    if (int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC); dir_fd >= 0) {
+        ::fsync(dir_fd);
+        ::close(dir_fd);
+    }
 }
 
 void PieceManager::add_block(int piece_index, int begin, const std::span<const unsigned char> block) {
-    bool piece_completed = false;
+    if (checking_) return;  // whatever this piece held is being rebuilt from disk
 
     {
         std::scoped_lock<std::mutex> lock(piece_mutex_);
+        if (piece_index < 0 || (size_t)piece_index >= num_pieces_ || begin < 0 || begin % 16384 != 0) return;
         auto& piece = pieces_[piece_index];
 
-        if (piece.is_complete) return;
+        if (piece.is_complete || piece.verifying) return;
 
-        auto block_index = begin / 16384;
+        // nothing was requested from this piece (no buffer yet) or the block doesn't fit it
+        auto block_index = (size_t)begin / 16384;
+        if (block_index >= piece.block_status.size() || (size_t)begin + block.size() > piece.data.size()) return;
 
         if (piece.block_status[block_index] != BlockState::Received) {
+            if (block_index < piece.in_flight_blocks.size()) {
+                auto sent = piece.in_flight_blocks[block_index].sent_time;
+                if (sent != std::chrono::steady_clock::time_point{}) stats_.block_latency.record(std::chrono::steady_clock::now() - sent);
+            }
             std::copy(block.begin(), block.end(), piece.data.begin() + begin);
             piece.block_status[block_index] = BlockState::Received;
             piece.bytes_written += block.size();
-            stats_.downloaded_bytes.fetch_add(block.size(), std::memory_order_relaxed);
+            stats_.downloaded_bytes.add(block.size());
+            resume_dirty_ = true;
         }
 
-        // Check if the piece is now complete
-        if (std::ranges::all_of(piece.block_status, [](auto b) { return b == BlockState::Received; })) {
-            if (verify_hash(piece_index, piece.data)) {
-                piece.is_complete = true;
-                piece_completed = true;
-            } else {
-                // Hash mismatch, reset piece
-                piece.data.clear();
-                piece.block_status.clear();
-                piece.in_flight_blocks.clear();
-                piece.bytes_written = 0;
-                maybe_init(piece_index);
-            }
-        }
+        if (!std::ranges::all_of(piece.block_status, [](auto b) { return b == BlockState::Received; })) return;
+        piece.verifying = true;
     }
 
-    // Signal to all peers
-    if (piece_completed) {
-        update_my_bitfield(piece_index);
-        notify_all_peers(piece_index);
+    // hash off the io thread, nothing touches the buffer until the result is in
+    post_job(hash_pool_, [this, piece_index] {
+        bool ok = verify_hash(piece_index, pieces_[piece_index].data);
+        piece_verified(piece_index, ok);
+    });
+}
 
-        {
-            std::scoped_lock<std::mutex> lock(write_mutex_);
-            stats_.completed_pieces.fetch_add(1, std::memory_order_relaxed);
-            completed_pieces_.push(piece_index);
+void PieceManager::piece_verified(int piece_index, bool ok) {
+    {
+        std::scoped_lock<std::mutex> lock(piece_mutex_);
+        auto& piece = pieces_[piece_index];
+        piece.verifying = false;
+
+        if (!ok) {
+            // Hash mismatch, reset piece
+            piece.data.clear();
+            piece.block_status.clear();
+            piece.in_flight_blocks.clear();
+            piece.bytes_written = 0;
+            maybe_init(piece_index);
+            return;
         }
-        write_cv_.notify_one();
 
-        save_resume_data(piece_index);
+        piece.is_complete = true;
+        piece_deadlines_.erase(piece_index);
+    }
+
+    // Signal to all peers
+    update_my_bitfield(piece_index);
+    notify_all_peers(piece_index);
+
+    bool schedule = false;
+    {
+        std::scoped_lock<std::mutex> lock(write_mutex_);
+        stats_.completed_pieces.fetch_add(1, std::memory_order_relaxed);
+        completed_pieces_.push(piece_index);
+        write_queue_bytes_ += piece_length_for_index(piece_index);
+        trace::event(trace::Event::PieceQueued, piece_index);
+        stats_.write_queue_depth.store(completed_pieces_.size(), std::memory_order_relaxed);
+        update_write_backlog();
+        schedule = !std::exchange(writer_scheduled_, true);
     }
+    if (schedule) post_disk_job([this] { flush_completed_pieces(); });
 }
 
 bool PieceManager::verify_hash(int index, const std::vector<unsigned char>& data) {
+        trace::event(trace::Event::HashBegin, index);
+        auto start = std::chrono::steady_clock::now();
         unsigned char digest[SHA_DIGEST_LENGTH];
         SHA1(data.data(), data.size(), digest);
+        stats_.piece_verify_time.record(std::chrono::steady_clock::now() - start);
 
-        return std::equal(std::begin(digest), std::end(digest), piece_hashes_[index].begin());
+        bool ok = std::ranges::equal(digest, piece_hashes_[index]);
+        trace::event(trace::Event::HashEnd, index, ok);
+        return ok;
 }
 
 void PieceManager::write_piece(int piece_index, const std::vector<unsigned char>& data) {
+    write_range(piece_index * piece_length_, data.data(), data.size());
+}
+
+void PieceManager::write_range(size_t offset, const unsigned char* data, size_t length) {
+    std::span<const unsigned char> part(data, length);
+    write_range(offset, { &part, 1 });
+}
+
+void PieceManager::write_range(size_t offset, std::span<const std::span<const unsigned char>> parts) {
     std::scoped_lock<std::mutex> file_lock(file_io_mutex_);
 
-    size_t piece_offset = piece_index * piece_length_;
-    size_t remaining = data.size();
-    size_t data_offset = 0;
+    size_t remaining = 0;
+    for (const auto& part : parts) remaining += part.size();
 
-    for (const auto& f : files_) {
-        if (piece_offset >= f.start + f.length) continue;
-        if (piece_offset + remaining <= f.start) break;
+    // where the next file's share starts, part and offset into it
+    size_t part_index = 0;
+    size_t part_offset = 0;
+    std::vector<iovec> iov;
+
+    for (auto& f : files_) {
+        if (offset >= f.start + f.length) continue;
+        if (offset + remaining <= f.start) break;
 
-        size_t file_offset = piece_offset > f.start ? piece_offset - f.start : 0;
+        size_t file_offset = offset > f.start ? offset - f.start : 0;
         size_t write_size = std::min(remaining, f.length - file_offset);
 
-        std::ofstream out(f.path, std::ios::binary | std::ios::in | std::ios::out);
-        out.seekp(file_offset, std::ios::beg);
-        out.write(reinterpret_cast<const char*>(data.data() + data_offset), write_size);
+        // skipped files never get created, their share of boundary pieces goes to the part file
+        bool skipped = f.in_part_file;
+        const auto& path = skipped ? part_file_name_ : f.path;
+        if (skipped) {
+            file_offset += f.start;
+            if (!std::filesystem::exists(path)) std::ofstream create(path, std::ios::binary);
+        }
+        else if (allocation_mode_ == AllocationMode::Lazy && !f.allocated) {
+            if (!preallocate(f.path, f.length)) std::print("Failed to preallocate {}\n", f.path);
+            f.allocated = true;
+        }
+
+        iov.clear();
+        for (size_t left = write_size; left > 0;) {
+            const auto& part = parts[part_index];
+            auto take = std::min(left, part.size() - part_offset);
+            if (take > 0) iov.push_back({ const_cast<unsigned char*>(part.data() + part_offset), take });
+            left -= take;
+            part_offset += take;
+            if (part_offset == part.size()) {
+                ++part_index;
+                part_offset = 0;
+            }
+        }
+        if (!write_file(path, file_offset, iov)) std::print("Failed to write {}\n", path);
+
+        if (skipped) part_file_unsynced_ = true;
+        else f.unsynced = true;
+        unsynced_bytes_ += write_size;
 
         remaining -= write_size;
-        data_offset += write_size;
-        piece_offset += write_size;
+        offset += write_size;
 
         if (remaining == 0) break;
     }
 }
 
+// fdatasync outside the lock, serving reads shouldn't wait for the disk to settle
+void PieceManager::sync_files(size_t min_bytes) {
+    std::vector<std::string> paths;
+    {
+        std::scoped_lock<std::mutex> file_lock(file_io_mutex_);
+        if (unsynced_bytes_ == 0 || unsynced_bytes_ < min_bytes) return;
+
+        for (auto& f : files_)
+            if (std::exchange(f.unsynced, false)) paths.push_back(f.path);
+        if (std::exchange(part_file_unsynced_, false)) paths.push_back(part_file_name_);
+        unsynced_bytes_ = 0;
+    }
+    for (const auto& path : paths) sync_file(path);
+}
+
+bool PieceManager::read_range(size_t offset, unsigned char* out, size_t length) {
+    std::scoped_lock<std::mutex> file_lock(file_io_mutex_);
+
+    size_t remaining = length;
+    size_t data_offset = 0;
+
+    for (const auto& f : files_) {
+        if (offset >= f.start + f.length) continue;
+        if (offset + remaining <= f.start) break;
+
+        size_t file_offset = offset > f.start ? offset - f.start : 0;
+        size_t read_size = std::min(remaining, f.length - file_offset);
+
+        bool skipped = f.in_part_file;
+        const auto& path = skipped ? part_file_name_ : f.path;
+        if (skipped) file_offset += f.start;
+
+        // plain pread, an ifstream allocates a buffer for every block served
+        // a file that isn't there yet is normal while checking, anything else is worth a word
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            if (errno != ENOENT) std::print("Failed to open file: {}\n", path);
+            return false;
+        }
+        size_t done = 0;
+        while (done < read_size) {
+            auto n = ::pread(fd, out + data_offset + done, read_size - done, (off_t)(file_offset + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += (size_t)n;
+        }
+        ::close(fd);
+        if (done < read_size) return false;
+
+        remaining -= read_size;
+        data_offset += read_size;
+        offset += read_size;
+
+        if (remaining == 0) break;
+    }
+    return remaining == 0;
+}
+
 size_t PieceManager::piece_length_for_index(int piece_index) const {
     return piece_index < num_pieces_ - 1 ? piece_length_ : total_length_ - piece_length_ * (num_pieces_ - 1);
 }
 
-void PieceManager::init_files(const std::vector<TorrentFile>& files) {
+void PieceManager::init_files(const std::vector<TorrentFile>& files, AllocationMode mode) {
     files_.clear();
+    allocation_mode_ = mode;
     size_t offset = 0;
 
-    for (const auto& f : files) {
-        std::filesystem::path file_path(f.path);
-        if (file_path.has_parent_path()) {
-            std::filesystem::create_directories(file_path.parent_path());
-        }
-        
+    for (size_t i = 0; i < files.size(); ++i) {
+        const auto& f = files[i];
+
         OutputFile out_file;
         out_file.path = f.path;
         out_file.start = offset;
         out_file.length = f.length;
+        out_file.priority = file_priority(i);
 
-        files_.push_back(out_file);
+        // a skipped file that is already on disk from an earlier session keeps being used as is
+        if (out_file.priority != FilePriority::Skip) create_file(out_file);
+        else out_file.in_part_file = !std::filesystem::exists(f.path);
 
-        // Create the file to ensure it exists (for some reason ios::out | ios::in doesnt create a file on windows)
-        if (!std::filesystem::exists(f.path)) {
-            std::ofstream create(f.path, std::ios::binary | std::ios::trunc);
-            if (!create) throw std::runtime_error("Failed to create file: " + f.path);
-        }
+        files_.push_back(out_file);
         offset += f.length;
     }
     total_length_ = offset;
+    update_piece_priorities();
+
+    // no usable resume data, but something is on disk already: find out what instead of redownloading it.
+    // preallocated files have their full size from the start, only written blocks count
+    if (!load_resume_data()) {
+        bool has_data = std::ranges::any_of(files_, [](const auto& f) { return allocated_bytes(f.path) > 0; });
+        if (has_data) recheck();
+    }
+
+    // after the resume data was validated, allocating may touch the file mtimes
+    allocate_files();
 }
 
-std::optional<std::pair<int, int>> PieceManager::next_block_request(const boost::dynamic_bitset<>& peer_bitfield, std::chrono::steady_clock::time_point sent_time, std::weak_ptr<PeerConnection> peer) {
-    if (is_torrent_complete) return std::nullopt;
+void PieceManager::create_file(const OutputFile& f) {
+    std::filesystem::path file_path(f.path);
+    if (file_path.has_parent_path()) {
+        std::filesystem::create_directories(file_path.parent_path());
+    }
 
-    std::scoped_lock<std::mutex> lock(piece_mutex_);
-    int piece_count{};
+    // Create the file to ensure it exists (for some reason ios::out | ios::in doesnt create a file on windows)
+    if (!std::filesystem::exists(f.path)) {
+        std::ofstream create(f.path, std::ios::binary | std::ios::trunc);
+        if (!create) throw std::runtime_error("Failed to create file: " + f.path);
+    }
+}
+
+void PieceManager::set_file_priorities(std::vector<FilePriority> priorities) {
+    // files coming out of the part file stay skipped until their bytes are moved, a piece of
+    // theirs could otherwise land in the real file and then be overwritten from the part file
+    std::vector<size_t> unskipped;
+    {
+        std::scoped_lock lock(file_io_mutex_, piece_mutex_);
+        file_priorities_ = std::move(priorities);
+        if (files_.empty()) return; // applied by init_files
+
+        for (size_t i = 0; i < files_.size(); ++i) {
+            auto priority = file_priority(i);
+            if (files_[i].in_part_file && priority != FilePriority::Skip) unskipped.push_back(i);
+            else files_[i].priority = priority;
+        }
+        update_piece_priorities();
+        is_torrent_complete = all_wanted_complete();
+    }
+    resume_dirty_ = true;
+    refresh_peer_interest();
+    if (unskipped.empty()) return;
+
+    // the current priorities are read again here, a later call may have skipped the file again
+    post_disk_job([this, unskipped = std::move(unskipped)] {
+        for (auto i : unskipped) {
+            bool wanted{};
+            {
+                std::scoped_lock<std::mutex> lock(piece_mutex_);
+                wanted = file_priority(i) != FilePriority::Skip;
+            }
+            std::scoped_lock<std::mutex> file_lock(file_io_mutex_);
+            if (wanted && files_[i].in_part_file) move_from_part_file(files_[i]);
+        }
+
+        {
+            std::scoped_lock lock(file_io_mutex_, piece_mutex_);
+            for (auto i : unskipped)
+                if (!files_[i].in_part_file) files_[i].priority = file_priority(i);
+            update_piece_priorities();
+            is_torrent_complete = all_wanted_complete();
+        }
+        resume_dirty_ = true;
+        refresh_peer_interest();
+    });
+}
+
+FilePriority PieceManager::file_priority(size_t index) const {
+    return index < file_priorities_.size() ? file_priorities_[index] : FilePriority::Normal;
+}
+
+// every piece we have went to the part file for its share in a skipped file: the ones shared with
+// wanted neighbours, and whatever a stream asked for in between. a piece's bit is set before it is
+// queued, so one that isn't written yet reads as a hole here and lands in the real file afterwards.
+// under file_io_mutex_
+void PieceManager::move_from_part_file(OutputFile& f) {
+    create_file(f);
+    f.in_part_file = false;
+    if (f.length == 0) return;
+
+    size_t end = f.start + f.length;
+    size_t first_piece = f.start / piece_length_, last_piece = (end - 1) / piece_length_;
+
+    // runs of pieces we have, cut to the file
+    std::vector<std::pair<size_t, size_t>> ranges;
+    {
+        std::scoped_lock<std::mutex> lock(my_bitfield_mutex_);
+        for (size_t p = first_piece; p <= last_piece; ++p) {
+            if (!my_bitfield_.test(p)) continue;
+            size_t from = std::max(f.start, p * piece_length_), to = std::min(end, (p + 1) * piece_length_);
+            if (!ranges.empty() && ranges.back().second == from) ranges.back().second = to;
+            else ranges.emplace_back(from, to);
+        }
+    }
+    if (ranges.empty()) return;
+
+    int in = ::open(part_file_name_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return;
+
+    std::vector<unsigned char> buffer(std::min<size_t>(4 << 20, f.length));
+    for (auto [from, to] : ranges) {
+        for (size_t offset = from; offset < to;) {
+            size_t want = std::min(buffer.size(), to - offset), done = 0;
+            while (done < want) {
+                auto n = ::pread(in, buffer.data() + done, want - done, (off_t)(offset + done));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                done += (size_t)n;
+            }
+            if (done == 0) break;   // past the end of the part file, nothing was ever written there
+
+            std::vector<iovec> iov{ { buffer.data(), done } };
+            if (!write_file(f.path, offset - f.start, iov)) std::print("Failed to write {}\n", f.path);
+            f.unsynced = true;
+            unsynced_bytes_ += done;
+            offset += done;
+        }
+    }
+    ::close(in);
+}
+
+void PieceManager::update_piece_priorities() {
+    std::ranges::fill(piece_priorities_, FilePriority::Skip);
+
+    for (const auto& f : files_) {
+        if (f.length == 0) continue;
+        size_t first = f.start / piece_length_, last = (f.start + f.length - 1) / piece_length_;
+        for (size_t p = first; p <= last && p < num_pieces_; ++p) piece_priorities_[p] = std::max(piece_priorities_[p], f.priority);
+    }
+
+    wanted_bits_.clear();
+    high_priority_bits_.clear();
+    for (size_t i = 0; i < num_pieces_; ++i) {
+        if (piece_priorities_[i] != FilePriority::Skip) wanted_bits_.set(i);
+        if (piece_priorities_[i] == FilePriority::High) high_priority_bits_.set(i);
+    }
+
+    wanted_pieces_ = wanted_bits_.count();
+    stats_.total_pieces.store((int)wanted_pieces_, std::memory_order_relaxed);
+}
+
+bool PieceManager::all_wanted_complete() const {
+    for (size_t i = 0; i < num_pieces_; ++i) {
+        if (piece_priorities_[i] != FilePriority::Skip && !pieces_[i].is_complete) return false;
+    }
+    return true;
+}
+
+void PieceManager::allocate_files() {
+    // count the blocks a file really has, a sparse file from an earlier session has its full
+    // size but still needs the space for its holes
+    size_t needed{};
+    for (const auto& f : files_) {
+        if (f.priority == FilePriority::Skip) continue;
+        auto on_disk = allocated_bytes(f.path);
+        if (on_disk < f.length) needed += f.length - on_disk;
+    }
+
+    auto dir = files_.empty() ? std::filesystem::current_path() : std::filesystem::absolute(files_.front().path).parent_path();
+    std::error_code ec;
+    auto space = std::filesystem::space(dir, ec);
+
+    constexpr size_t mb = 1024 * 1024;
+    if (!ec) {
+        std::print("Storage: {} MB still to allocate, {} MB available\n", needed / mb, space.available / mb);
+        if (needed > space.available) {
+            if (allocation_mode_ == AllocationMode::Full)
+                throw std::runtime_error("Not enough disk space for " + dir.string());
+            std::print("Warning: not enough free space to complete the download\n");
+        }
+    }
+
+    switch (allocation_mode_) {
+        case AllocationMode::Full:
+            for (auto& f : files_) {
+                if (f.priority == FilePriority::Skip) continue;
+                if (!preallocate(f.path, f.length)) throw std::runtime_error("Failed to preallocate " + f.path);
+                f.allocated = true;
+            }
+            break;
+
+        case AllocationMode::Sparse:
+            // set the final size, the filesystem leaves holes until the pieces arrive
+            for (const auto& f : files_) {
+                if (f.priority == FilePriority::Skip) continue;
+                std::error_code ec;
+                if (std::filesystem::file_size(f.path, ec) < f.length && !ec) std::filesystem::resize_file(f.path, f.length, ec);
+                if (ec) std::print("Failed to resize {}: {}\n", f.path, ec.message());
+            }
+            break;
+
+        case AllocationMode::Lazy:
+            break; // done by write_range on first touch
+    }
+}
+
+void PieceManager::recheck() {
+    start_check({});
+}
+
+// the check itself runs on a disk thread, the caller (the io thread for a magnet) only queues the
+// pieces. until the queue is worked off nothing is requested or taken in, a full check also drops
+// everything we claimed so peers that connect meanwhile aren't told about unverified pieces
+void PieceManager::start_check(std::vector<char> pieces) {
+    bool full = pieces.empty();
+    if (full) pieces.assign(num_pieces_, 1);
+
+    bool schedule{};
+    {
+        std::scoped_lock lock(piece_mutex_, my_bitfield_mutex_);
+        if (check_queue_.empty()) check_queue_ = std::move(pieces);
+        else for (size_t i = 0; i < num_pieces_; ++i) check_queue_[i] |= pieces[i];
+
+        if (full) {
+            for (auto& piece : pieces_) {
+                recycle_buffer(piece.data);
+                piece = PieceBuffer{};
+            }
+            piece_deadlines_.clear();
+            my_bitfield_.clear();
+            stats_.completed_pieces.store(0, std::memory_order_relaxed);
+            stats_.downloaded_bytes.store(0);
+        }
+
+        checking_ = true;
+        is_torrent_complete = false;
+        schedule = !std::exchange(check_scheduled_, true);
+    }
+    stats_.checking = true;
+
+    if (!schedule) return;
+    post_disk_job([this] {
+        for (;;) {
+            std::vector<char> pieces;
+            {
+                std::scoped_lock<std::mutex> lock(piece_mutex_);
+                if (check_queue_.empty() || stopping_) {
+                    check_scheduled_ = false;
+                    if (stopping_) return;  // checking_ stays set, see the destructor
+                    checking_ = false;
+                    is_torrent_complete = all_wanted_complete();
+                    break;
+                }
+                pieces = std::exchange(check_queue_, {});
+            }
+            check_pieces(std::move(pieces));
+        }
+
+        stats_.checking = false;
+        if (is_torrent_complete) std::print("Torrent is complete. Seeding...\n");
+
+        save_resume_data();
+        refresh_peer_interest();
+    });
+}
+
+// read pieces in large runs and hand them to the hashers, a fixed number of buffers keeps memory
+// bounded while the reader stays ahead. checked pieces start over, the valid ones are announced
+void PieceManager::check_pieces(std::vector<char> pieces) {
+    ThreadPool& hashers = hash_pool_;
+    auto total = (size_t)std::ranges::count(pieces, 1);
+
+    const size_t pieces_per_chunk = std::max<size_t>(1, (4 << 20) / piece_length_);
+    const size_t chunk_bytes = pieces_per_chunk * piece_length_;
+    const size_t max_buffers = hashers.size() * 2;
+
+    struct Chunk {
+        std::unique_ptr<unsigned char[]> data;
+        std::vector<char> readable;
+    };
 
-    for (int i = 0; i < pieces_.size(); ++i) {
-        if (pieces_[i].is_complete) ++piece_count;
-        if (piece_count == num_pieces_) is_torrent_complete = true;
+    std::mutex buffer_mutex;
+    std::condition_variable buffer_cv;
+    std::vector<std::unique_ptr<Chunk>> free_buffers;
+    size_t allocated_buffers{};
+
+    std::vector<char> valid(num_pieces_, 0);
+    std::atomic<size_t> checked{};
+    size_t in_flight{};
+
+    stats_.checked_pieces = 0;
+    std::print("Checking {} pieces on disk...\n", total);
+
+    for (size_t first = 0; first < num_pieces_ && !stopping_;) {
+        // a run of consecutive pieces to check, read in one go
+        if (!pieces[first]) {
+            ++first;
+            continue;
+        }
+        size_t count = 1;
+        while (count < pieces_per_chunk && first + count < num_pieces_ && pieces[first + count]) ++count;
+
+        std::unique_ptr<Chunk> chunk;
+        {
+            std::unique_lock<std::mutex> lock(buffer_mutex);
+            buffer_cv.wait(lock, [&] { return !free_buffers.empty() || allocated_buffers < max_buffers; });
+            if (!free_buffers.empty()) {
+                chunk = std::move(free_buffers.back());
+                free_buffers.pop_back();
+            }
+            else {
+                ++allocated_buffers;
+                chunk = std::make_unique<Chunk>();
+                chunk->data = std::make_unique_for_overwrite<unsigned char[]>(chunk_bytes);
+            }
+            ++in_flight;
+        }
+
+        // missing or short files fail the read, then piece by piece to find what's there
+        size_t run_bytes{};
+        for (size_t i = 0; i < count; ++i) run_bytes += piece_length_for_index((int)(first + i));
+        chunk->readable.assign(count, 1);
+        if (!read_range(first * piece_length_, chunk->data.get(), run_bytes)) {
+            size_t chunk_offset{};
+            for (size_t i = 0; i < count; ++i) {
+                auto length = piece_length_for_index((int)(first + i));
+                chunk->readable[i] = read_range((first + i) * piece_length_, chunk->data.get() + chunk_offset, length);
+                chunk_offset += length;
+            }
+        }
+
+        hashers.post([&, first, count, raw = chunk.release()] {
+            std::unique_ptr<Chunk> chunk(raw);
+            size_t chunk_offset{};
+
+            for (size_t i = 0; i < count; ++i) {
+                auto length = piece_length_for_index((int)(first + i));
+                if (chunk->readable[i]) {
+                    unsigned char digest[SHA_DIGEST_LENGTH];
+                    SHA1(chunk->data.get() + chunk_offset, length, digest);
+                    valid[first + i] = std::ranges::equal(digest, piece_hashes_[first + i]);
+                }
+                chunk_offset += length;
+            }
+
+            stats_.checked_pieces.fetch_add((int)count, std::memory_order_relaxed);
+            checked.fetch_add(count, std::memory_order_relaxed);
+
+            {
+                std::scoped_lock<std::mutex> lock(buffer_mutex);
+                free_buffers.push_back(std::move(chunk));
+                --in_flight;
+            }
+            buffer_cv.notify_all();
+        });
+
+        std::print("\rChecked {}/{} pieces", checked.load(), total);
+        std::flush(std::cout);
+        first += count;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(buffer_mutex);
+        buffer_cv.wait(lock, [&] { return in_flight == 0; });
+    }
+
+    if (stopping_) return;
+
+    std::vector<int> found;
+    {
+        std::scoped_lock lock(piece_mutex_, my_bitfield_mutex_);
+        for (size_t i = 0; i < num_pieces_; ++i) {
+            if (!pieces[i]) continue;
 
-        if (!pieces_[i].is_complete && peer_bitfield.test(i)) {
-            maybe_init(i);
             auto& piece = pieces_[i];
-            for (int j = 0; j < piece.block_status.size(); ++j) {
-                if (piece.block_status[j] == BlockState::NotRequested) {
-                    piece.block_status[j] = BlockState::Requested;
-                    piece.in_flight_blocks[j].peer = peer;              // not sure if this is best
-                    piece.in_flight_blocks[j].sent_time = sent_time;    // maybe we should do it AFTER sending the request?
-                    return std::make_pair(i, j * 16384);
+            recycle_buffer(piece.data);
+            piece = PieceBuffer{};
+            if (!valid[i]) {
+                my_bitfield_.reset(i);
+                continue;
+            }
+
+            piece.is_complete = true;
+            piece.bytes_written = piece_length_for_index((int)i);
+            if (!my_bitfield_.test(i)) found.push_back((int)i);
+            my_bitfield_.set(i);
+        }
+
+        // totals over everything we have, checked just now or trusted from the resume data
+        size_t have_bytes{};
+        for (size_t i = 0; i < num_pieces_; ++i)
+            if (my_bitfield_.test(i)) have_bytes += piece_length_for_index((int)i);
+        stats_.completed_pieces.store((int)my_bitfield_.count(), std::memory_order_relaxed);
+        stats_.downloaded_bytes.store(have_bytes);
+    }
+
+    std::print("\rChecked {}/{} pieces, {} valid\n", total, total, std::ranges::count(valid, 1));
+    for (int i : found) notify_all_peers(i);
+}
+
+std::optional<std::pair<int, int>> PieceManager::next_block_request(const Bitfield& peer_bitfield, std::chrono::steady_clock::time_point sent_time, std::weak_ptr<PeerConnection> peer) {
+    if (is_torrent_complete || checking_) return std::nullopt;
+
+    std::scoped_lock lock(piece_mutex_, my_bitfield_mutex_);
+
+    // time critical pieces first, earliest deadline first
+    if (!piece_deadlines_.empty()) {
+        std::vector<std::pair<std::chrono::steady_clock::time_point, int>> urgent;
+        urgent.reserve(piece_deadlines_.size());
+        for (const auto& [index, deadline] : piece_deadlines_) urgent.emplace_back(deadline, index);
+        std::ranges::sort(urgent);
+
+        for (const auto& [deadline, i] : urgent) {
+            if (pieces_[i].is_complete || !peer_bitfield.test(i)) continue;
+            if (auto block = pick_block(i, sent_time, peer)) return std::make_pair(i, *block * 16384);
+        }
+
+        // everything urgent is requested already: race an overdue block of the earliest piece on this peer
+        // too, once per block. after that this peer goes on with the normal picker below
+        const auto& [deadline, i] = urgent.front();
+        auto& piece = pieces_[i];
+        if (!piece.is_complete && !piece.verifying && peer_bitfield.test(i)) {
+            for (size_t j = 0; j < piece.block_status.size(); ++j) {
+                auto& in_flight = piece.in_flight_blocks[j];
+                bool same_peer = !in_flight.peer.owner_before(peer) && !peer.owner_before(in_flight.peer);
+
+                if (piece.block_status[j] == BlockState::Requested && !in_flight.raced && !same_peer && sent_time - in_flight.sent_time > duplicate_request_after_) {
+                    // leave the original request on record, whichever copy arrives first wins in add_block
+                    in_flight.racer = peer;
+                    in_flight.raced = true;
+                    return std::make_pair(i, (int)j * 16384);
                 }
             }
         }
     }
+
+    // high priority files first, skipped files never. only pieces the peer has and we don't are visited,
+    // 64 at a time
+    auto words = my_bitfield_.word_count();
+    for (bool high : { true, false }) {
+        std::optional<std::pair<int, int>> found;
+        find_bits(words, [&](size_t w) {
+            auto wanted = high ? high_priority_bits_.word(w) : wanted_bits_.word(w) & ~high_priority_bits_.word(w);
+            return peer_bitfield.word(w) & wanted & ~my_bitfield_.word(w);
+        }, [&](size_t i) {
+            if (pieces_[i].is_complete) return false;   // verified, the bitfield catches up right after
+            if (auto block = pick_block((int)i, sent_time, peer)) found = std::make_pair((int)i, *block * 16384);
+            return found.has_value();
+        });
+        if (found) return found;
+    }
+
+    if (!any_bits(words, [&](size_t w) { return wanted_bits_.word(w) & ~my_bitfield_.word(w); })) is_torrent_complete = true;
+
+    return std::nullopt;
+}
+
+std::optional<int> PieceManager::pick_block(int piece_index, std::chrono::steady_clock::time_point sent_time, const std::weak_ptr<PeerConnection>& peer) {
+    maybe_init(piece_index);
+    auto& piece = pieces_[piece_index];
+    for (int j = 0; j < piece.block_status.size(); ++j) {
+        if (piece.block_status[j] == BlockState::NotRequested) {
+            piece.block_status[j] = BlockState::Requested;
+            piece.in_flight_blocks[j].peer = peer;              // not sure if this is best
+            piece.in_flight_blocks[j].sent_time = sent_time;    // maybe we should do it AFTER sending the request?
+            return j;
+        }
+    }
     return std::nullopt;
 }
 
+void PieceManager::set_piece_deadline(int piece_index, std::chrono::steady_clock::time_point deadline) {
+    if (piece_index < 0 || (size_t)piece_index >= num_pieces_) return;
+
+    std::scoped_lock<std::mutex> lock(piece_mutex_);
+    if (pieces_[piece_index].is_complete) return;
+
+    auto [it, inserted] = piece_deadlines_.try_emplace(piece_index, deadline);
+    if (!inserted) it->second = std::min(it->second, deadline);
+}
+
+void PieceManager::clear_piece_deadline(int piece_index) {
+    std::scoped_lock<std::mutex> lock(piece_mutex_);
+    piece_deadlines_.erase(piece_index);
+}
+
+bool PieceManager::wait_for_piece(int piece_index, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(piece_mutex_);
+
+    // verified pieces still hold their buffer until the writer has put them on disk
+    return piece_written_cv_.wait_for(lock, timeout, [&] {
+        const auto& piece = pieces_[piece_index];
+        return piece.is_complete && piece.data.empty();
+    });
+}
+
 void PieceManager::maybe_init(int piece_index) {
         // lazy init
         auto& piece = pieces_[piece_index];
@@ -190,7 +1101,8 @@ void PieceManager::maybe_init(int piece_index) {
             // if (piece.is_complete) std::print("Duplicate maybe init");
             piece.is_complete = false;
             auto curr_length = piece_length_for_index(piece_index);
-            piece.data.resize(curr_length);  // allocate full size buffer
+            if (piece.data.capacity() == 0) piece.data = take_buffer();
+            piece.data.resize(curr_length);  // full size buffer
             size_t num_blocks = (curr_length + 16383) / 16384;
             piece.block_status.resize(num_blocks, BlockState::NotRequested);
             piece.in_flight_blocks.resize(num_blocks);
@@ -198,135 +1110,245 @@ void PieceManager::maybe_init(int piece_index) {
         }
 }
 
+std::vector<unsigned char> PieceManager::take_buffer() {
+    std::vector<unsigned char> buffer;
+    if (idle_buffers_.empty()) buffer.reserve(piece_length_);
+    else {
+        buffer = std::move(idle_buffers_.back());
+        idle_buffers_.pop_back();
+    }
+    return buffer;
+}
+
+void PieceManager::recycle_buffer(std::vector<unsigned char>& data) {
+    data.clear();
+    if (data.capacity() >= piece_length_ && idle_buffers_.size() < std::max<size_t>(1, max_idle_buffer_bytes_ / piece_length_))
+        idle_buffers_.push_back(std::move(data));
+    data = std::vector<unsigned char>();
+}
+
+size_t PieceManager::count_needed(const Bitfield& peer_bitfield) {
+    std::scoped_lock lock(piece_mutex_, my_bitfield_mutex_);
+    return count_bits(my_bitfield_.word_count(), [&](size_t w) {
+        return peer_bitfield.word(w) & wanted_bits_.word(w) & ~my_bitfield_.word(w);
+    });
+}
+
+bool PieceManager::is_needed(int piece_index) {
+    std::scoped_lock lock(piece_mutex_, my_bitfield_mutex_);
+    return wanted_bits_.test(piece_index) && !my_bitfield_.test(piece_index);
+}
+
 bool PieceManager::is_complete(int piece_index) {
     std::scoped_lock<std::mutex> lock(piece_mutex_);
     return pieces_[piece_index].is_complete;
 }
 
-void PieceManager::add_to_peer_list(std::weak_ptr<PeerConnection> peer) {
-    int peer_count{};
-    {
-        std::scoped_lock<std::mutex> lock(peer_list_mutex_);
-        peer_connections.push_back(peer);
-        ++peer_count;
+void PieceManager::add_peer(const std::shared_ptr<PeerConnection>& peer) {
+    std::scoped_lock<std::mutex> lock(peer_list_mutex_);
+    if (!peer_slots_.try_emplace(peer.get(), peer_connections.size()).second) return;
+
+    peer_connections.push_back({ peer.get(), peer });
+    stats_.connected_peers.store((int)peer_connections.size(), std::memory_order_relaxed);
+}
+
+void PieceManager::remove_peer(const PeerConnection* peer) {
+    std::scoped_lock<std::mutex> lock(peer_list_mutex_);
+    auto it = peer_slots_.find(peer);
+    if (it == peer_slots_.end()) return;
+
+    auto slot = it->second;
+    peer_slots_.erase(it);
+    if (slot != peer_connections.size() - 1) {
+        peer_connections[slot] = std::move(peer_connections.back());
+        peer_slots_[peer_connections[slot].key] = slot;
     }
-    stats_.connected_peers.store(peer_count, std::memory_order_relaxed);
+    peer_connections.pop_back();
+    stats_.connected_peers.store((int)peer_connections.size(), std::memory_order_relaxed);
 }
 
-std::vector<uint8_t> PieceManager::fetch_block(uint32_t piece_index, uint32_t begin, uint32_t length) {
-    std::scoped_lock<std::mutex> file_lock(file_io_mutex_);
+// snapshot, so peers are called without holding the registry lock
+std::vector<std::shared_ptr<PeerConnection>> PieceManager::live_peers() {
+    std::vector<std::shared_ptr<PeerConnection>> out;
+    std::scoped_lock<std::mutex> lock(peer_list_mutex_);
+    out.reserve(peer_connections.size());
+    for (const auto& entry : peer_connections) {
+        if (auto p = entry.conn.lock()) out.push_back(std::move(p));
+    }
+    return out;
+}
 
+std::vector<uint8_t> PieceManager::fetch_block(uint32_t piece_index, uint32_t begin, uint32_t length) {
     std::vector<uint8_t> out(length);
-    size_t piece_offset = piece_index * piece_length_ + begin;
-    size_t remaining = length;
-    size_t data_offset = 0;
+    if (!read_block(piece_index, begin, out)) return {};
+    return out;
+}
 
-    for (const auto& f : files_) {
-        if (piece_offset >= f.start + f.length) continue;
-        if (piece_offset + remaining <= f.start) break;
+bool PieceManager::read_block(uint32_t piece_index, uint32_t begin, std::span<uint8_t> out) {
+    if (piece_index >= num_pieces_ || (size_t)begin + out.size() > piece_length_for_index((int)piece_index)) return false;
+    if (!read_range((size_t)piece_index * piece_length_ + begin, out.data(), out.size())) return false;
 
-        size_t file_offset = piece_offset > f.start ? piece_offset - f.start : 0;
-        size_t read_size = std::min(remaining, f.length - file_offset);
+    stats_.uploaded_bytes.add(out.size());
+    return true;
+}
 
-        std::ifstream in(f.path, std::ios::binary);
-        if (!in) { 
-            std::print("Failed to open file: {}", f.path);
-            return {};
-        }
+std::vector<uint8_t> PieceManager::get_my_bitfield() {
+    std::scoped_lock<std::mutex> lock(my_bitfield_mutex_);
+    return my_bitfield_.to_bytes();
+}
 
-        in.seekg(file_offset, std::ios::beg);
-        in.read(reinterpret_cast<char*>(out.data() + data_offset), read_size);
+void PieceManager::set_write_queue_limit(size_t bytes) {
+    bool resume{};
+    {
+        std::scoped_lock<std::mutex> lock(write_mutex_);
+        write_queue_high_ = std::max(bytes, 2 * piece_length_);
+        write_queue_low_ = write_queue_high_ / 2;
+        resume = update_write_backlog();
+    }
+    if (resume) refresh_peer_interest();
+}
 
-        remaining -= read_size;
-        data_offset += read_size;
-        piece_offset += read_size;
-        stats_.uploaded_bytes.fetch_add(read_size, std::memory_order_relaxed);
+// hysteresis between the two marks, so requesting doesn't flap on every piece written
+bool PieceManager::update_write_backlog() {
+    auto depth = completed_pieces_.size();
+    stats_.write_queue_bytes.store(write_queue_bytes_, std::memory_order_relaxed);
 
-        if (remaining == 0) break;
-    }    
-    return out;
+    if (!write_backlogged_ && (write_queue_bytes_ >= write_queue_high_ || depth >= max_write_queue_depth_)) {
+        write_backlogged_ = true;
+        stats_.write_backlogged = true;
+        stats_.write_backlog_events.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (write_backlogged_ && write_queue_bytes_ <= write_queue_low_ && depth <= max_write_queue_depth_ / 2) {
+        write_backlogged_ = false;
+        stats_.write_backlogged = false;
+        return true;
+    }
+    return false;
 }
 
-std::vector<uint8_t> PieceManager::get_my_bitfield() {
-    std::scoped_lock<std::mutex> lock(my_bitfield_mutex_);
-    return my_bitfield_;
-}
+// the whole queue at once, in disk order. pieces that are neighbours on disk go out as one run
+// however far apart they completed, so the disk sees long sequential writes instead of a seek per
+// piece. the longer the disk takes, the more the next batch has to sort and merge
+void PieceManager::flush_completed_pieces() {
+    std::unique_lock<std::mutex> lock(write_mutex_);
+    std::vector<int> batch;
 
-void PieceManager::writer_thread_func() {
-    while (!stop_writer_) {
-        std::unique_lock<std::mutex> lock(write_mutex_);
-        write_cv_.wait(lock, [&]{
-            return stop_writer_ || !completed_pieces_.empty();
-        });
+    while (!completed_pieces_.empty()) {
+        batch.clear();
+        for (; !completed_pieces_.empty(); completed_pieces_.pop()) batch.push_back(completed_pieces_.front());
+        stats_.write_queue_depth.store(0, std::memory_order_relaxed);
+        lock.unlock();
 
-        while (!completed_pieces_.empty()) {
-            int front = completed_pieces_.front(); completed_pieces_.pop();
-            lock.unlock();
-            write_piece(front, pieces_[front].data);
-            // std::cout << "Piece " << front << " verified & written.\n";
-            // clear data
-            {
-                std::scoped_lock<std::mutex> lock(piece_mutex_);
-                auto& piece = pieces_[front];
-                piece.is_complete = true;
-                piece.data.clear();
-                piece.data.shrink_to_fit();
-                piece.block_status.clear();
-                piece.block_status.shrink_to_fit();
-                piece.in_flight_blocks.clear();
-                piece.in_flight_blocks.shrink_to_fit();
-            }
+        // piece order is offset order, the files are laid out back to back
+        std::ranges::sort(batch);
+
+        for (size_t first = 0; first < batch.size();) {
+            auto last = first + 1;
+            while (last < batch.size() && batch[last] == batch[last - 1] + 1) ++last;
+            auto run = std::span(batch).subspan(first, last - first);
+            write_pieces(run);
+            first = last;
+
+            // peers went quiet while the disk was behind, get them going again
             lock.lock();
+            for (auto index : run) write_queue_bytes_ -= piece_length_for_index(index);
+            if (update_write_backlog()) {
+                lock.unlock();
+                refresh_peer_interest();
+                lock.lock();
+            }
+            lock.unlock();
         }
+
+        sync_files(sync_every_bytes_);
+        lock.lock();
     }
+
+    // checked and cleared under the same lock as add_block's push, so nothing is left behind
+    writer_scheduled_ = false;
 }
 
-void PieceManager::timeout_thread_func() {
+void PieceManager::write_pieces(std::span<const int> run) {
+    // verified pieces aren't touched by anyone else until they're released below
+    std::vector<std::span<const unsigned char>> parts;
+    parts.reserve(run.size());
+    for (auto index : run) {
+        trace::event(trace::Event::WriteBegin, index);
+        parts.emplace_back(pieces_[index].data);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    write_range((size_t)run.front() * piece_length_, parts);
+    auto share = (std::chrono::steady_clock::now() - start) / run.size();
+
+    {
+        std::scoped_lock<std::mutex> lock(piece_mutex_);
+        for (auto index : run) {
+            stats_.disk_write_time.record(share);
+            trace::event(trace::Event::WriteEnd, index);
+
+            auto& piece = pieces_[index];
+            piece.is_complete = true;
+            recycle_buffer(piece.data);
+            piece.block_status.clear();
+            piece.block_status.shrink_to_fit();
+            piece.in_flight_blocks.clear();
+            piece.in_flight_blocks.shrink_to_fit();
+        }
+    }
+    piece_written_cv_.notify_all();
+    resume_dirty_ = true;
+}
+
+void PieceManager::tick() {
+    if (checking_) return;  // the check saves when it's done, and nothing is requested meanwhile
+    auto now = std::chrono::steady_clock::now();
+
+    // batch resume updates instead of touching the file for every piece
+    if (resume_dirty_ && !resume_save_scheduled_ && now - last_resume_save_ > resume_save_interval_) {
+        resume_save_scheduled_ = true;
+        last_resume_save_ = now;
+        post_disk_job([this] {
+            save_resume_data();
+            resume_save_scheduled_ = false;
+        });
+    }
+
     if (is_torrent_complete) return;
 
-    while (!stop_timeout_) {
-        std::this_thread::sleep_for(std::chrono::seconds(1));
-
-        auto now = std::chrono::steady_clock::now();
-        // std::cout << "Checking for timeouts\n";
-        for (auto& piece : pieces_) {
-            std::scoped_lock lock(piece_mutex_);
-            if (piece.is_complete) continue;
-            for (size_t i = 0; i < piece.block_status.size(); ++i) {
-                if (piece.block_status[i] == BlockState::Requested) {
-                    if (now - piece.in_flight_blocks[i].sent_time > std::chrono::seconds(3)) {
-                        piece.block_status[i] = BlockState::NotRequested;
-                        if (auto peer = piece.in_flight_blocks[i].peer.lock()) {
-                            peer->decrement_inflight_blocks(); // safely reduce peer in-flight count
-                        }
-
-                        piece.in_flight_blocks[i] = {}; // reset
+    for (auto& piece : pieces_) {
+        std::scoped_lock lock(piece_mutex_);
+        if (piece.is_complete) continue;
+        for (size_t i = 0; i < piece.block_status.size(); ++i) {
+            if (piece.block_status[i] == BlockState::Requested) {
+                if (now - piece.in_flight_blocks[i].sent_time > std::chrono::seconds(3)) {
+                    trace::event(trace::Event::RequestTimeout, (int32_t)(&piece - pieces_.data()), (int32_t)(i * 16384));
+                    piece.block_status[i] = BlockState::NotRequested;
+                    if (auto peer = piece.in_flight_blocks[i].peer.lock()) {
+                        peer->decrement_inflight_blocks(); // safely reduce peer in-flight count
                     }
+                    if (auto racer = piece.in_flight_blocks[i].racer.lock()) racer->decrement_inflight_blocks();
+
+                    piece.in_flight_blocks[i] = {}; // reset
                 }
             }
         }
     }
 }
 
+// called from the hash and disk threads, each peer queues the HAVE on its own executor
 void PieceManager::notify_all_peers(int piece_index) {
-    int peer_count{};
-    {
-        std::scoped_lock<std::mutex> lock(peer_list_mutex_);
-        for (auto& peer: peer_connections) {
-            if (auto p = peer.lock()) {
-                ++peer_count;
-                p->signal_have(piece_index);
-            }
-        }
-    }
-    stats_.connected_peers.store(peer_count, std::memory_order_relaxed);
+    auto peers = live_peers();
+    for (const auto& peer : peers) peer->post_have(piece_index);
+    trace::event(trace::Event::HaveBroadcast, piece_index, (int32_t)peers.size());
+}
+
+void PieceManager::refresh_peer_interest() {
+    for (const auto& peer : live_peers()) peer->refresh_interest();
 }
 
 void PieceManager::update_my_bitfield(int piece_index) {
     std::scoped_lock<std::mutex> lock(my_bitfield_mutex_);
-
-    size_t byte = piece_index / 8;
-    size_t bit = piece_index % 8;
-
-    my_bitfield_[byte] |= (1 << (7 - bit));
+    my_bitfield_.set(piece_index);
 }
\ No newline at end of file
@@ -0,0 +1,234 @@
+#include <Session.hpp>
+#include <TrackerFactory.hpp>
+#include <Trace.hpp>
+
+// one dual stack socket for both families where the host has IPv6, plain IPv4 otherwise
+static tcp::acceptor open_acceptor(boost::asio::io_context& io, uint16_t port) {
+    tcp::acceptor acceptor(io);
+    boost::system::error_code ec;
+
+    acceptor.open(tcp::v6(), ec);
+    if (!ec) acceptor.set_option(tcp::acceptor::reuse_address(true), ec);
+    if (!ec) acceptor.set_option(boost::asio::ip::v6_only(false), ec);
+    if (!ec) acceptor.bind(tcp::endpoint(tcp::v6(), port), ec);
+    if (!ec) acceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
+    if (!ec) return acceptor;
+
+    return tcp::acceptor(io, tcp::endpoint(tcp::v4(), port));
+}
+
+Session::Session(const SessionOptions& options)
+    : options_(options),
+      io_(),
+      disk_pool_(options.disk_threads, "disk"),
+      hash_pool_(std::max(1u, std::thread::hardware_concurrency()), "hash"),
+      tracker_pool_(options.tracker_threads, "tracker"),
+      acceptor_(open_acceptor(io_, options.listen_port)),
+      listen_port_(acceptor_.local_endpoint().port()),
+      tick_timer_(io_)
+{}
+
+Session::~Session() {
+    for (auto& [hash, torrent] : torrents_) torrent->stop();
+}
+
+std::shared_ptr<Torrent> Session::add_torrent(Metadata metadata, const TorrentOptions& options) {
+    std::string key(reinterpret_cast<const char*>(metadata.info_hash.data()), metadata.info_hash.size());
+    if (auto it = torrents_.find(key); it != torrents_.end()) return it->second;
+
+    auto torrent = std::make_shared<Torrent>(*this, std::move(metadata), options);
+    torrents_.emplace(std::move(key), torrent);
+
+    boost::asio::post(io_, [torrent] { torrent->start(); });
+    return torrent;
+}
+
+void Session::run() {
+    if (!options_.trace.empty()) {
+        trace::set_thread_name("io");
+        trace::start();
+    }
+
+    if (!options_.metrics.empty()) {
+        metrics_ = std::make_unique<MetricsServer>(io_, options_.metrics, [this] { return render_metrics(); });
+        metrics_->start();
+    }
+
+    if (options_.utp || options_.dht) {
+        try {
+            udp_ = std::make_unique<UdpSocket>(io_, listen_port_);
+        } catch (const std::exception& e) {
+            std::cerr << "uTP and DHT disabled, no UDP port: " << e.what() << "\n";
+        }
+    }
+
+    if (udp_ && options_.utp) {
+        utp_ = std::make_unique<UtpContext>(io_, *udp_);
+        utp_->on_accept([this](std::shared_ptr<UtpStream> stream) {
+            if (!stopped_) read_handshake(std::make_shared<PeerSocket>(std::move(stream)));
+        });
+    }
+
+    if (udp_ && options_.dht) {
+        try {
+            dht_ = std::make_unique<Dht>(io_, *udp_, DhtOptions{ options_.dht_bootstrap, options_.dht_state });
+            dht_->start();
+        } catch (const std::exception& e) {
+            std::cerr << "DHT disabled: " << e.what() << "\n";
+            dht_.reset();
+        }
+    }
+
+    if (udp_) udp_->start();
+
+    if (options_.lsd) {
+        try {
+            lsd_ = std::make_unique<Lsd>(io_, listen_port_);
+            lsd_->start();
+        } catch (const std::exception& e) {
+            std::cerr << "Local service discovery disabled: " << e.what() << "\n";
+            lsd_.reset();
+        }
+    }
+
+    start_accept();
+    tick();
+
+    io_.run();
+
+    if (!options_.trace.empty()) {
+        trace::stop();
+        if (trace::write_chrome_json(options_.trace)) std::println("Trace written to {}", options_.trace);
+        else std::cerr << "Failed to write trace to " << options_.trace << "\n";
+    }
+}
+
+void Session::stop() {
+    boost::asio::post(io_, [this] {
+        if (std::exchange(stopped_, true)) return;
+
+        std::cout << "\nShutting down...\n";
+
+        // queued announces are pointless now, running ones finish on their own
+        tracker_pool_.clear();
+
+        boost::system::error_code ec;
+        acceptor_.close(ec);
+        tick_timer_.cancel();
+        if (metrics_) metrics_->stop();
+        if (dht_) dht_->stop();
+        if (lsd_) lsd_->stop();
+        for (auto& [hash, torrent] : torrents_) torrent->stop();
+        if (udp_) udp_->close();    // after the peers, their uTP FINs go out on it
+
+        io_.stop();
+    });
+}
+
+std::shared_ptr<BaseTracker> Session::tracker(const std::string& url) {
+    std::scoped_lock<std::mutex> lock(trackers_mutex_);
+
+    auto& tracker = trackers_[url];
+    if (!tracker) {
+        try { tracker = make_tracker(url); }
+        catch (...) { trackers_.erase(url); throw; }
+    }
+    return tracker;
+}
+
+bool Session::can_connect() const {
+    size_t open{};
+    for (const auto& [hash, torrent] : torrents_) open += torrent->open_connections();
+    return open + pending_handshakes_ < options_.max_connections;
+}
+
+void Session::start_accept() {
+    auto socket = std::make_shared<tcp::socket>(io_);
+
+    acceptor_.async_accept(*socket, [this, socket](boost::system::error_code ec) {
+        if (ec == boost::asio::error::operation_aborted || stopped_) return;
+        if (!ec) read_handshake(std::make_shared<PeerSocket>(std::move(*socket)));
+        start_accept();
+    });
+}
+
+// read the inbound handshake here so the connection can be handed to the torrent it asks for.
+// a peer that connects and then says nothing is dropped after a while, and over the
+// connection limit nobody gets to hold a socket open that way in the first place
+void Session::read_handshake(std::shared_ptr<PeerSocket> socket) {
+    if (!can_connect()) return;
+
+    auto handshake = std::make_shared<std::array<char, 68>>();
+    auto timer = std::make_shared<boost::asio::steady_timer>(io_, handshake_timeout_);
+    timer->async_wait([socket](boost::system::error_code ec) {
+        if (!ec) socket->close();
+    });
+    ++pending_handshakes_;
+
+    boost::asio::async_read(*socket, boost::asio::buffer(*handshake),
+        [this, socket, handshake, timer](boost::system::error_code ec, size_t) {
+            --pending_handshakes_;  // before attach_inbound, the connection takes its own slot there
+            timer->cancel();
+            if (ec || stopped_) return;
+
+            const auto& buf = *handshake;
+            if (buf[0] != 19 || std::memcmp(&buf[1], "BitTorrent protocol", 19) != 0) return;
+
+            auto it = torrents_.find(std::string(buf.data() + 28, 20));
+            if (it == torrents_.end()) return; // not one of ours, drop it
+
+            it->second->attach_inbound(std::move(*socket), buf);
+        });
+}
+
+void Session::tick() {
+    if (stopped_) return;
+
+    for (auto& [hash, torrent] : torrents_) torrent->tick();
+    display_stats();
+
+    tick_timer_.expires_after(std::chrono::seconds(1));
+    tick_timer_.async_wait([this](const boost::system::error_code& ec) {
+        if (!ec) tick();
+    });
+}
+
+void Session::display_stats() {
+    if (torrents_.size() == 1) {
+        torrents_.begin()->second->stats().display();
+        return;
+    }
+
+    int peers{}, seeding{};
+    size_t down{}, up{};
+    double down_rate{}, up_rate{};
+    for (auto& [hash, torrent] : torrents_) {
+        auto& stats = torrent->stats();
+        peers += stats.connected_peers.load();
+        down += stats.downloaded_bytes.load();
+        up += stats.uploaded_bytes.load();
+        down_rate += stats.download_rate.rate();
+        up_rate += stats.upload_rate.rate();
+        if (!stats.fetching_metadata.load() && stats.completed_pieces.load() >= stats.total_pieces.load()) ++seeding;
+    }
+
+    std::print("\rTorrents: {} ({} complete), Peers: {}, Downloaded: {} MB, Uploaded: {} MB, Down: {}, Up: {}",
+        torrents_.size(), seeding, peers, down / (1024 * 1024), up / (1024 * 1024),
+        Stats::format_rate(down_rate), Stats::format_rate(up_rate));
+    std::flush(std::cout);
+}
+
+std::string Session::render_metrics() {
+    MetricsWriter w;
+
+    w.gauge("ctorrent_torrents", "Torrents in the session", {}, (double)torrents_.size());
+    w.gauge("ctorrent_pool_queue_depth", "Jobs waiting for a worker", { { "pool", "disk" } }, (double)disk_pool_.pending());
+    w.gauge("ctorrent_pool_queue_depth", "Jobs waiting for a worker", { { "pool", "hash" } }, (double)hash_pool_.pending());
+    w.gauge("ctorrent_pool_queue_depth", "Jobs waiting for a worker", { { "pool", "tracker" } }, (double)tracker_pool_.pending());
+    if (dht_) w.gauge("ctorrent_dht_nodes", "Nodes in the DHT routing table", {}, (double)dht_->node_count());
+    if (utp_) w.gauge("ctorrent_utp_connections", "Open uTP connections", {}, (double)utp_->connection_count());
+    if (lsd_) w.counter("ctorrent_lsd_peers_total", "Peers found by local service discovery", {}, (double)lsd_->peers_discovered());
+
+    for (auto& [hash, torrent] : torrents_) torrent->write_metrics(w);
+    return w.str();
+}
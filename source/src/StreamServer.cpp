@@ -0,0 +1,226 @@
+#include <StreamServer.hpp>
+
+#include <charconv>
+
+namespace beast = boost::beast;
+namespace http  = beast::http;
+
+StreamServer::StreamServer(PieceManager& pm, const Metadata& metadata, uint16_t port)
+    : piece_manager_(pm), port_(port), acceptor_(io_) 
+{
+    size_t offset{};
+    for (const auto& f : metadata.files) {
+        files_.push_back({ f.path, offset, f.length });
+        offset += f.length;
+    }
+}
+
+StreamServer::~StreamServer() {
+    stop();
+}
+
+void StreamServer::start() {
+    tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), port_);
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(tcp::acceptor::reuse_address(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+
+    std::print("Streaming on http://127.0.0.1:{}/\n", port_);
+    accept_thread_ = std::thread(&StreamServer::accept_loop, this);
+}
+
+void StreamServer::stop() {
+    if (stopped_.exchange(true)) return;
+
+    // a blocking accept() doesn't notice the acceptor closing, poke it with a connection instead
+    boost::system::error_code ec;
+    if (accept_thread_.joinable()) {
+        tcp::socket wake(io_);
+        wake.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port_), ec);
+        accept_thread_.join();
+    }
+    acceptor_.close(ec);
+
+    std::list<Connection> connections;
+    {
+        std::scoped_lock<std::mutex> lock(connections_mutex_);
+        for (auto& c : connections_) {
+            if (auto socket = c.socket.lock()) socket->shutdown(tcp::socket::shutdown_both, ec);
+        }
+        connections = std::move(connections_);
+    }
+    for (auto& c : connections) if (c.thread.joinable()) c.thread.join();
+}
+
+void StreamServer::accept_loop() {
+    while (!stopped_) {
+        auto socket = std::make_shared<tcp::socket>(io_);
+        boost::system::error_code ec;
+        acceptor_.accept(*socket, ec);
+        if (stopped_) return;
+        if (ec) continue;
+
+        // a thread per reader, players open a handful at most. the ones that are done go first
+        std::scoped_lock<std::mutex> lock(connections_mutex_);
+        std::erase_if(connections_, [](auto& c) {
+            if (!c.done) return false;
+            c.thread.join();
+            return true;
+        });
+
+        auto& connection = connections_.emplace_back();
+        connection.socket = socket;
+        connection.thread = std::thread(&StreamServer::serve, this, socket, std::ref(connection.done));
+    }
+}
+
+void StreamServer::serve(std::shared_ptr<tcp::socket> socket, std::atomic<bool>& done) {
+    try {
+        beast::flat_buffer buffer;
+
+        while (!stopped_) {
+            http::request<http::empty_body> req;
+            http::read(*socket, buffer, req);
+
+            auto target = std::string(req.target());
+
+            if (target == "/") {
+                http::response<http::string_body> res{ http::status::ok, req.version() };
+                res.set(http::field::content_type, "text/plain");
+                for (size_t i = 0; i < files_.size(); ++i)
+                    res.body() += std::to_string(i) + "\t" + std::to_string(files_[i].length) + "\t" + files_[i].path + "\n";
+                res.prepare_payload();
+                http::write(*socket, res);
+                if (!req.keep_alive()) break;
+                continue;
+            }
+
+            size_t index{};
+            auto [ptr, ec] = std::from_chars(target.data() + 1, target.data() + target.size(), index);
+            if (ec != std::errc() || index >= files_.size()) {
+                http::response<http::string_body> res{ http::status::not_found, req.version() };
+                res.body() = "no such file\n";
+                res.prepare_payload();
+                http::write(*socket, res);
+                break;
+            }
+
+            const auto& file = files_[index];
+            size_t first = 0, last = file.length ? file.length - 1 : 0;
+            bool ranged = false;
+
+            // "bytes=first-[last]" or "bytes=-suffix" for the tail, a single range is all players send
+            auto range = req[http::field::range];
+            bool satisfiable = true;
+            if (range.starts_with("bytes=")) {
+                std::string spec(range.substr(6));
+                auto dash = spec.find('-');
+                if (dash != std::string::npos && dash > 0) {
+                    first = std::stoull(spec.substr(0, dash));
+                    if (dash + 1 < spec.size()) last = std::min<size_t>(std::stoull(spec.substr(dash + 1)), last);
+                    ranged = true;
+                }
+                else if (dash == 0 && spec.size() > 1) {
+                    auto suffix = std::stoull(spec.substr(1));
+                    first = file.length - std::min<size_t>(suffix, file.length);
+                    satisfiable = suffix > 0;
+                    ranged = true;
+                }
+            }
+
+            if (file.length == 0 || first > last || !satisfiable) {
+                http::response<http::empty_body> res{ http::status::range_not_satisfiable, req.version() };
+                res.set(http::field::content_range, "bytes */" + std::to_string(file.length));
+                res.content_length(0);
+                http::write(*socket, res);
+                continue;
+            }
+
+            http::response<http::empty_body> res{ ranged ? http::status::partial_content : http::status::ok, req.version() };
+            res.set(http::field::content_type, "application/octet-stream");
+            res.set(http::field::accept_ranges, "bytes");
+            if (ranged) res.set(http::field::content_range, "bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(file.length));
+            res.content_length(last - first + 1);
+            res.keep_alive(req.keep_alive());
+
+            http::response_serializer<http::empty_body> sr{ res };
+            http::write_header(*socket, sr);
+
+            if (!stream_range(*socket, file, first, last) || !req.keep_alive()) break;
+        }
+    }
+    catch (const std::exception&) {
+        // client went away or sent garbage, nothing to clean up
+    }
+
+    boost::system::error_code ec;
+    socket->shutdown(tcp::socket::shutdown_both, ec);
+    socket->close(ec);
+    done = true;
+}
+
+bool StreamServer::stream_range(tcp::socket& socket, const FileEntry& file, size_t first, size_t last) {
+    const size_t piece_length = piece_manager_.piece_length();
+    std::vector<unsigned char> chunk(256 * 1024);
+
+    size_t offset = file.start + first;
+    size_t end = file.start + last + 1;
+
+    // once this reader is gone its read-ahead window isn't urgent anymore, unless another reader wants it too
+    struct ReleaseWindow {
+        StreamServer& server;
+        std::set<int> window;
+        ~ReleaseWindow() { server.release(window); }
+    } reader{ *this, {} };
+
+    while (offset < end && !stopped_) {
+        int piece_index = (int)(offset / piece_length);
+        prioritize(reader.window, offset);
+
+        // wait in short slices so shutdown isn't held up by a stalled swarm
+        while (!piece_manager_.wait_for_piece(piece_index, std::chrono::milliseconds(200))) {
+            if (stopped_) return false;
+        }
+
+        size_t piece_end = std::min(end, (size_t)(piece_index + 1) * piece_length);
+        size_t length = std::min(chunk.size(), piece_end - offset);
+
+        if (!piece_manager_.read_data(offset, chunk.data(), length)) return false;
+
+        boost::system::error_code ec;
+        boost::asio::write(socket, boost::asio::buffer(chunk.data(), length), ec);
+        if (ec) return false;
+
+        offset += length;
+    }
+    return offset == end;
+}
+
+void StreamServer::prioritize(std::set<int>& window, size_t offset) {
+    auto now = std::chrono::steady_clock::now();
+    int first_piece = (int)(offset / piece_manager_.piece_length());
+
+    // the pieces this reader moved past are its own business no more
+    release(window, first_piece);
+
+    std::scoped_lock<std::mutex> lock(deadlines_mutex_);
+    for (size_t k = 0; k < read_ahead_pieces_; ++k) {
+        int piece_index = first_piece + (int)k;
+        if ((size_t)piece_index >= piece_manager_.num_pieces_) break;
+
+        if (window.insert(piece_index).second) ++deadline_readers_[piece_index];
+        piece_manager_.set_piece_deadline(piece_index, now + first_piece_deadline_ + per_piece_deadline_ * k);
+    }
+}
+
+void StreamServer::release(std::set<int>& window, int below) {
+    std::scoped_lock<std::mutex> lock(deadlines_mutex_);
+    for (auto it = window.begin(); it != window.end() && *it < below; it = window.erase(it)) {
+        auto readers = deadline_readers_.find(*it);
+        if (readers == deadline_readers_.end() || --readers->second > 0) continue;
+
+        deadline_readers_.erase(readers);
+        piece_manager_.clear_piece_deadline(*it);
+    }
+}
@@ -0,0 +1,367 @@
+#include <Torrent.hpp>
+#include <Session.hpp>
+
+Torrent::Torrent(Session& session, Metadata metadata, const TorrentOptions& options)
+    : session_(session),
+      metadata_(std::move(metadata)),
+      options_(options),
+      announce_timer_(session.io())
+{
+    if (metadata_.has_info()) init_storage();
+    else {
+        metadata_fetcher_ = std::make_unique<MetadataFetcher>(metadata_.info_hash);
+        stats_.fetching_metadata = true;
+    }
+
+    // initialize trackers
+    for (const auto& tier : metadata_.announce_list)
+        for (const auto& url : tier) {
+            try { trackers_.push_back(session_.tracker(url)); }
+            catch (const std::exception& e) { std::cerr << e.what() << '\n'; }
+        }
+
+    if (metadata_.announce_list.empty() && !metadata_.announce.empty()) {
+        try { trackers_.push_back(session_.tracker(metadata_.announce)); }
+        catch (const std::exception& e) { std::cerr << e.what() << '\n'; }
+    }
+}
+
+Torrent::~Torrent() {
+    stop();
+}
+
+void Torrent::init_storage() {
+    pm_ = make_piece_manager();
+    if (options_.stream_port) stream_server_ = std::make_unique<StreamServer>(*pm_, metadata_, *options_.stream_port);
+}
+
+// touches the filesystem and throws if the files can't be created or allocated
+std::unique_ptr<PieceManager> Torrent::make_piece_manager() {
+    auto pm = std::make_unique<PieceManager>(
+        metadata_.total_size,
+        metadata_.piece_hashes.size(),
+        metadata_.piece_length,
+        metadata_.piece_hashes,
+        (options_.save_path / metadata_.name).string(),
+        stats_,
+        session_.disk_pool(),
+        session_.hash_pool()
+    );
+    pm->set_write_queue_limit(options_.max_write_queue_bytes);
+
+    if (!options_.file_priorities.empty()) {
+        std::vector<FilePriority> priorities(metadata_.files.size(), FilePriority::Normal);
+        for (const auto& [index, priority] : options_.file_priorities)
+            if (index < priorities.size()) priorities[index] = priority;
+        pm->set_file_priorities(std::move(priorities));
+    }
+    auto files = metadata_.files;
+    for (auto& f : files) f.path = (options_.save_path / f.path).string();
+
+    pm->init_files(files, options_.allocation);
+    if (options_.force_recheck) pm->recheck();
+    return pm;
+}
+
+// a busy port costs us the stream, not the download
+void Torrent::start_stream_server() {
+    try { stream_server_->start(); }
+    catch (const std::exception& e) {
+        std::cerr << "Streaming for " << metadata_.name << " failed: " << e.what() << "\n";
+        stream_server_.reset();
+    }
+}
+
+void Torrent::start() {
+    started_ = true;
+    if (stream_server_) start_stream_server();
+
+    // the LAN hears about us right away and we about it, no tracker in between
+    if (auto* lsd = session_.lsd(); lsd && !metadata_.is_private) {
+        lsd->add(metadata_.info_hash, [self = weak_from_this()](const std::vector<Peer>& peers) {
+            if (auto torrent = self.lock()) torrent->add_peers(peers, true);
+        });
+    }
+    announce();
+}
+
+void Torrent::stop() {
+    if (std::exchange(stopped_, true)) return;
+
+    if (auto* lsd = session_.lsd()) lsd->remove(metadata_.info_hash);
+    announce_timer_.cancel();
+    if (stream_server_) stream_server_->stop();
+    for (auto& conn : connections_) conn->stop();
+}
+
+void Torrent::tick() {
+    auto now = std::chrono::steady_clock::now();
+    if (pm_) pm_->tick();
+    if (metadata_fetcher_) metadata_fetcher_->tick(now);
+
+    stats_.update_rates();
+    for (auto& conn : connections_) {
+        if (conn && conn->is_alive()) conn->update_rates(now);
+    }
+
+    // refill the slots of peers that went away
+    connect_candidates();
+
+    // private torrents keep their swarm to what the tracker hands out
+    if (pm_ && !metadata_.is_private) {
+        auto live = pm_->live_peers();
+        for (auto& conn : live) conn->maybe_send_pex(live, now);
+    }
+}
+
+void Torrent::add_peers(const std::vector<Peer>& peers, bool local) {
+    if (stopped_) return;
+
+    if (local) {
+        for (const auto& peer : peers)
+            if (std::ranges::find(lan_addresses_, peer.addr()) == lan_addresses_.end()) lan_addresses_.push_back(peer.addr());
+    }
+
+    for (const auto& peer : peers) {
+        // an inbound peer is known by its listen port once its extended handshake told us
+        auto existing = std::find_if(connections_.begin(), connections_.end(), [&peer](const auto& conn) {
+            return conn && (conn->peer() == peer || conn->listen_peer() == peer);
+        });
+
+        if (existing != connections_.end()) {
+            if (local) (*existing)->set_local(true);
+            continue;
+        }
+        if (std::ranges::find(candidates_, peer) != candidates_.end()) continue;
+
+        // LAN peers are dialed first, they answer first and carry the most
+        if (is_local(peer)) candidates_.push_front(peer);
+        else if (candidates_.size() < max_candidates_) candidates_.push_back(peer);
+    }
+
+    connect_candidates();
+}
+
+void Torrent::connect_candidates() {
+    if (stopped_ || candidates_.empty()) return;
+
+    std::erase_if(connections_, [](const auto& conn) { return !conn || !conn->is_alive(); });
+
+    while (!candidates_.empty() && connections_.size() < options_.max_connections && session_.can_connect()) {
+        auto peer = candidates_.front();
+        candidates_.pop_front();
+
+        auto conn = std::make_shared<PeerConnection>(
+            session_.io(), peer, metadata_.info_hash, session_.peer_id(), pm_.get(), session_.utp()
+        );
+        conn->set_extensions(extensions());
+        conn->set_local(is_local(peer));
+        connections_.push_back(conn);
+        conn->start();
+    }
+}
+
+size_t Torrent::open_connections() const {
+    return (size_t)std::ranges::count_if(connections_, [](const auto& conn) { return conn && conn->is_alive(); });
+}
+
+bool Torrent::is_local(const Peer& peer) const {
+    return peer.is_lan() || std::ranges::find(lan_addresses_, peer.addr()) != lan_addresses_.end();
+}
+
+void Torrent::attach_inbound(PeerSocket socket, const std::array<char, 68>& handshake) {
+    if (stopped_) return;
+
+    // inbound peers count against the same limits, over them the socket just closes
+    std::erase_if(connections_, [](const auto& conn) { return !conn || !conn->is_alive(); });
+    if (connections_.size() >= options_.max_connections || !session_.can_connect()) return;
+
+    auto conn = std::make_shared<PeerConnection>(std::move(socket), handshake, metadata_.info_hash, session_.peer_id(), pm_.get());
+    conn->set_extensions(extensions());
+    conn->set_local(is_local(conn->peer()));
+
+    connections_.push_back(conn);
+    conn->start();
+}
+
+// PEX feeds the same intake as the trackers, so new peers are dialed as soon as a connected peer
+// mentions them instead of at the next announce
+PeerConnection::Extensions Torrent::extensions() {
+    auto self = weak_from_this();
+
+    PeerConnection::Extensions extensions{
+        .listen_port = session_.listen_port(),
+        .pex = {},
+        // served once we have it, a magnet's connections keep these after the metadata came in
+        .metadata = [self]() -> std::string_view {
+            auto torrent = self.lock();
+            return torrent ? torrent->metadata_.info_bytes : std::string_view{};
+        },
+        .metadata_source = {},
+        .metadata_piece = {},
+    };
+
+    if (!metadata_.is_private) {
+        extensions.pex = [self](const std::vector<Peer>& peers) {
+            if (auto torrent = self.lock()) torrent->add_peers(peers);
+        };
+    }
+    if (metadata_fetcher_) {
+        extensions.metadata_source = [self](const std::shared_ptr<PeerConnection>& peer, size_t size) {
+            auto torrent = self.lock();
+            if (torrent && torrent->metadata_fetcher_) torrent->metadata_fetcher_->add_source(peer, size);
+        };
+        extensions.metadata_piece = [self](const std::shared_ptr<PeerConnection>& peer, int piece, std::span<const uint8_t> data) {
+            if (auto torrent = self.lock()) torrent->on_metadata_piece(*peer, piece, data);
+        };
+    }
+    return extensions;
+}
+
+void Torrent::on_metadata_piece(const PeerConnection& peer, int piece, std::span<const uint8_t> data) {
+    if (stopped_ || !metadata_fetcher_) return;
+    if (metadata_fetcher_->on_piece(peer, piece, data)) on_metadata();
+}
+
+// the info dictionary hashed to the magnet's info hash: set up storage like a .torrent would have
+// and hand the piece manager to the connections we already have, nobody reconnects.
+// creating and allocating the files can take a while, that happens on a disk thread
+void Torrent::on_metadata() {
+    auto info = metadata_fetcher_->take();
+    metadata_fetcher_.reset();
+
+    Metadata metadata;
+    try { metadata = parse_info(info); }
+    catch (const std::exception& e) {
+        std::cerr << "Bad metadata for " << metadata_.name << ": " << e.what() << "\n";
+        return;
+    }
+    metadata.announce = std::move(metadata_.announce);
+    metadata.announce_list = std::move(metadata_.announce_list);
+    metadata_ = std::move(metadata);
+    if (auto* lsd = session_.lsd(); lsd && metadata_.is_private) lsd->remove(metadata_.info_hash);
+
+    std::print("Metadata received: {}, {} pieces\n", metadata_.name, metadata_.piece_hashes.size());
+
+    session_.disk_pool().post([self = shared_from_this(), &io = session_.io()] {
+        std::unique_ptr<PieceManager> pm;
+        std::string error;
+        try { pm = self->make_piece_manager(); }
+        catch (const std::exception& e) { error = e.what(); }
+
+        boost::asio::post(io, [self, pm = std::move(pm), error = std::move(error)]() mutable {
+            self->on_storage(std::move(pm), error);
+        });
+    });
+}
+
+void Torrent::on_storage(std::unique_ptr<PieceManager> pm, const std::string& error) {
+    stats_.fetching_metadata = false;
+    if (stopped_) return;
+
+    // without files there is nothing to download into, the torrent is done for
+    if (!pm) {
+        std::cerr << "Failed to set up storage for " << metadata_.name << ": " << error << "\n";
+        stop();
+        return;
+    }
+
+    pm_ = std::move(pm);
+    if (options_.stream_port) {
+        stream_server_ = std::make_unique<StreamServer>(*pm_, metadata_, *options_.stream_port);
+        if (started_) start_stream_server();
+    }
+
+    for (auto& conn : connections_)
+        if (conn && conn->is_alive()) conn->attach(*pm_);
+}
+
+void Torrent::announce() {
+    if (stopped_) return;
+
+    // kick stale peers off the pool
+    connections_.erase(
+        std::remove_if(connections_.begin(), connections_.end(), [](const auto& conn) {
+            return (conn == nullptr || !conn->is_alive());
+        }),
+        connections_.end()
+    );
+
+    // announces block, so they run on the session's tracker workers and hand their peers back to the io thread
+    auto self = weak_from_this();
+    auto& io = session_.io();
+
+    // a magnet doesn't know its size yet, and left=0 would make it look like a seed
+    size_t total = pm_ ? stats_.total_size.load() : 1;
+
+    for (auto& tracker : trackers_) {
+        session_.tracker_pool().post([self, &io, tracker,
+                                      info_hash = metadata_.info_hash,
+                                      peer_id = session_.peer_id(),
+                                      port = session_.listen_port(),
+                                      up = stats_.uploaded_bytes.load(),
+                                      down = stats_.downloaded_bytes.load(),
+                                      total] {
+            try {
+                auto response = tracker->announce(info_hash, peer_id, port, up, down, total);
+
+                boost::asio::post(io, [self, peers = std::move(response.peers)] {
+                    if (auto torrent = self.lock()) torrent->add_peers(peers);
+                });
+
+            } catch (const std::exception& e) {
+                std::cerr << "Tracker " << tracker->name() << " failed: " << e.what() << "\n";
+            }
+        });
+    }
+
+    // the DHT feeds the same intake as the trackers, and keeps working when they are down
+    if (auto* dht = session_.dht(); dht && !metadata_.is_private) {
+        dht->get_peers(metadata_.info_hash, session_.listen_port(), [self](const std::vector<Peer>& peers) {
+            if (auto torrent = self.lock()) torrent->add_peers(peers);
+        });
+    }
+
+    // schedule next announce
+    announce_timer_.expires_after(std::chrono::seconds(180));
+    announce_timer_.async_wait([self](const boost::system::error_code& ec) {
+        if (auto torrent = self.lock(); torrent && !ec) torrent->announce();
+    });
+}
+
+void Torrent::write_metrics(MetricsWriter& w) const {
+    MetricsWriter::Labels labels{ { "torrent", metadata_.name } };
+
+    w.gauge("ctorrent_peers", "Connected peers", labels, stats_.connected_peers.load());
+    w.gauge("ctorrent_local_peers", "Open connections to LAN peers", labels,
+            (double)std::ranges::count_if(connections_, [](const auto& conn) { return conn && conn->is_alive() && conn->is_local(); }));
+    w.gauge("ctorrent_pieces_completed", "Wanted pieces verified and on disk", labels, stats_.completed_pieces.load());
+    w.gauge("ctorrent_pieces_wanted", "Pieces of files not skipped", labels, stats_.total_pieces.load());
+    w.counter("ctorrent_downloaded_bytes_total", "Payload bytes received", labels, (double)stats_.downloaded_bytes.load());
+    w.counter("ctorrent_uploaded_bytes_total", "Payload bytes sent", labels, (double)stats_.uploaded_bytes.load());
+    w.gauge("ctorrent_download_rate_bytes", "Download rate, bytes per second", labels, stats_.download_rate.rate());
+    w.gauge("ctorrent_upload_rate_bytes", "Upload rate, bytes per second", labels, stats_.upload_rate.rate());
+    w.gauge("ctorrent_write_queue_depth", "Verified pieces waiting to be written", labels, (double)stats_.write_queue_depth.load());
+    w.gauge("ctorrent_write_queue_bytes", "Data of verified pieces waiting to be written", labels, (double)stats_.write_queue_bytes.load());
+    w.gauge("ctorrent_write_backlogged", "1 while requesting is paused for the disk to catch up", labels, stats_.write_backlogged.load() ? 1.0 : 0.0);
+    w.counter("ctorrent_write_backlog_total", "Times requesting was paused for the disk", labels, (double)stats_.write_backlog_events.load());
+    w.gauge("ctorrent_disk_jobs_pending", "Disk jobs queued or running", labels, (double)stats_.pending_disk_jobs.load());
+
+    w.histogram("ctorrent_block_latency_seconds", "Time from sending a block request to receiving the block", labels, stats_.block_latency);
+    w.histogram("ctorrent_piece_verify_seconds", "Time to hash a completed piece", labels, stats_.piece_verify_time);
+    w.histogram("ctorrent_disk_write_seconds", "Time to write a verified piece to disk, its share of a coalesced write", labels, stats_.disk_write_time);
+
+    for (const auto& conn : connections_) {
+        if (!conn || !conn->is_alive()) continue;
+
+        MetricsWriter::Labels peer_labels{ { "torrent", metadata_.name }, { "peer", std::format("{}:{}", conn->peer().ip(), conn->peer().port()) },
+                                           { "transport", conn->is_utp() ? "utp" : "tcp" } };
+
+        w.counter("ctorrent_peer_downloaded_bytes_total", "Payload bytes received from the peer", peer_labels, (double)conn->downloaded());
+        w.counter("ctorrent_peer_uploaded_bytes_total", "Payload bytes sent to the peer", peer_labels, (double)conn->uploaded());
+        w.gauge("ctorrent_peer_download_rate_bytes", "Download rate from the peer, bytes per second", peer_labels, conn->download_rate());
+        w.gauge("ctorrent_peer_upload_rate_bytes", "Upload rate to the peer, bytes per second", peer_labels, conn->upload_rate());
+        w.gauge("ctorrent_peer_requests_in_flight", "Block requests sent and not yet answered", peer_labels, conn->in_flight_blocks());
+        w.gauge("ctorrent_peer_send_queue_bytes", "Bytes handed to the socket and not yet sent", peer_labels, (double)conn->send_queue_bytes());
+    }
+}
@@ -1,10 +1,30 @@
 #include <TorrentFile.hpp>
+#include <Utils.hpp>
 
-Metadata parse_torrent(const std::string& in) {
+#include <algorithm>
+#include <charconv>
+#include <format>
 
-	BEncodeParser parser(in);
+// the mapping only lives for the parse. what outlives it is the info dictionary,
+// copied out with the piece hashes it contains
+Metadata load_torrent(const std::string& path) {
+    MappedFile file(path);
+    auto meta = parse_torrent(file.view());
 
-	auto dict = parser.parse().as_dict();
+    auto info = std::make_shared<const std::string>(meta.info_bytes);
+    meta.piece_hashes = meta.piece_hashes.rebased(meta.info_bytes, *info);
+    meta.info_bytes = *info;
+    meta.storage = std::move(info);
+
+    return meta;
+}
+
+Metadata parse_torrent(std::string_view in) {
+
+	BEncodeParser parser(in, true);
+
+	auto root = parser.parse();
+	const auto& dict = root.as_dict();
 
     Metadata meta{};
 
@@ -55,17 +75,17 @@ Metadata parse_torrent(const std::string& in) {
     }
         
 
-    // Pieces (concatenated SHA1 hashes)
+    // Pieces (concatenated SHA1 hashes), referenced in place
     auto pieces_it = info.find("pieces");
     if (pieces_it != info.end() && pieces_it->second.is_string()) {
-        const std::string& pieces_str = pieces_it->second.as_string();
-        size_t n = pieces_str.size() / 20;
-        meta.piece_hashes.resize(n);
-        for (size_t i = 0; i < n; ++i) {
-            std::memcpy(meta.piece_hashes[i].data(), pieces_str.data() + i * 20, 20);
-        }
+        const auto& [pieces_start, pieces_end] = parser.get_pieces_start_end();
+        meta.piece_hashes = PieceHashes({ reinterpret_cast<const uint8_t*>(in.data()) + pieces_start, pieces_end - pieces_start });
     }
 
+    auto private_it = info.find("private");
+    if (private_it != info.end() && private_it->second.is_int())
+        meta.is_private = private_it->second.as_int() == 1;
+
     // Files
     auto files_it = info.find("files");
     if (files_it != info.end() && files_it->second.is_list()) {
@@ -127,9 +147,119 @@ Metadata parse_torrent(const std::string& in) {
 
 	const auto& [start, end] = parser.get_info_start_end();
 
-	std::string info_bencoded = in.substr(start, end - start);
+	meta.info_bytes = in.substr(start, end - start);
+
+    SHA1(reinterpret_cast<const unsigned char*>(meta.info_bytes.data()), meta.info_bytes.size(), meta.info_hash.data());
+
+    return meta;
+}
+
+static std::string percent_decode(std::string_view in) {
+    std::string out;
+    out.reserve(in.size());
+
+    for (size_t i = 0; i < in.size(); ++i) {
+        if (in[i] == '%' && i + 2 < in.size()) {
+            out += (char)std::stoi(std::string(in.substr(i + 1, 2)), nullptr, 16);
+            i += 2;
+        }
+        else if (in[i] == '+') out += ' ';
+        else out += in[i];
+    }
+    return out;
+}
+
+// 40 hex digits, or 32 base32 characters in older magnets
+static std::array<uint8_t, 20> parse_btih(std::string_view hash) {
+    std::array<uint8_t, 20> out{};
+
+    if (hash.size() == 40) {
+        for (size_t i = 0; i < 20; ++i) {
+            auto [ptr, ec] = std::from_chars(hash.data() + i * 2, hash.data() + i * 2 + 2, out[i], 16);
+            if (ec != std::errc{} || ptr != hash.data() + i * 2 + 2) throw std::runtime_error("Invalid info hash in magnet link");
+        }
+        return out;
+    }
+
+    if (hash.size() == 32) {
+        uint64_t bits{};
+        int count{};
+        size_t o{};
+        for (char c : hash) {
+            int v;
+            if (c >= 'A' && c <= 'Z') v = c - 'A';
+            else if (c >= 'a' && c <= 'z') v = c - 'a';
+            else if (c >= '2' && c <= '7') v = c - '2' + 26;
+            else throw std::runtime_error("Invalid info hash in magnet link");
+
+            bits = (bits << 5) | (uint64_t)v;
+            count += 5;
+            if (count >= 8) {
+                count -= 8;
+                out[o++] = (uint8_t)(bits >> count);
+            }
+        }
+        return out;
+    }
+
+    throw std::runtime_error("Invalid info hash in magnet link");
+}
+
+Metadata parse_magnet(std::string_view uri) {
+    if (!uri.starts_with("magnet:?")) throw std::runtime_error("Not a magnet link");
+
+    Metadata meta{};
+    bool have_hash{ false };
+    std::vector<std::string> trackers;
+
+    auto query = uri.substr(8);
+    while (!query.empty()) {
+        auto amp = query.find('&');
+        auto pair = query.substr(0, amp);
+        query = amp == std::string_view::npos ? std::string_view{} : query.substr(amp + 1);
+
+        auto eq = pair.find('=');
+        if (eq == std::string_view::npos) continue;
+        auto key = pair.substr(0, eq);
+        auto value = pair.substr(eq + 1);
+
+        if (key == "xt" && value.starts_with("urn:btih:")) {
+            meta.info_hash = parse_btih(value.substr(9));
+            have_hash = true;
+        }
+        else if (key == "dn") meta.name = percent_decode(value);
+        else if (key == "tr" || key.starts_with("tr.")) {
+            auto tracker = percent_decode(value);
+            if (std::ranges::find(trackers, tracker) == trackers.end()) trackers.push_back(std::move(tracker));
+        }
+    }
+
+    if (!have_hash) throw std::runtime_error("Magnet link without a BitTorrent info hash");
+
+    // all in one tier, every torrent announces to every tracker it has anyway
+    if (!trackers.empty()) meta.announce_list.push_back(std::move(trackers));
+    // saved under the info hash until the info dictionary names it
+    if (meta.name.empty())
+        for (auto byte : meta.info_hash) meta.name += std::format("{:02x}", (unsigned)byte);
+    return meta;
+}
+
+Metadata parse_torrent(std::string&& in) {
+    auto storage = std::make_shared<const std::string>(std::move(in));
+    auto meta = parse_torrent(std::string_view(*storage));
+    meta.storage = std::move(storage);
+    return meta;
+}
 
-    SHA1(reinterpret_cast<const unsigned char*>(info_bencoded.data()), info_bencoded.size(), meta.info_hash.data());
+Metadata parse_info(std::string_view info) {
+    // wrapped up as a torrent without trackers, so the info dictionary is parsed the one way
+    auto storage = std::make_shared<std::string>();
+    storage->reserve(info.size() + 8);
+    *storage += "d4:info";
+    *storage += info;
+    *storage += 'e';
 
+    auto meta = parse_torrent(*storage);
+    meta.storage = std::move(storage);
     return meta;
-}
\ No newline at end of file
+}
@@ -0,0 +1,197 @@
+#include <Trace.hpp>
+
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace trace {
+
+namespace {
+    using clock = std::chrono::steady_clock;
+
+    struct Record {
+        uint64_t ts_ns;
+        int32_t piece;
+        int32_t arg;
+        Event event;
+    };
+
+    // single producer ring, only its thread writes. head counts every record ever written,
+    // so a reader can tell which slots were overwritten while it was copying
+    struct Ring {
+        explicit Ring(size_t capacity, uint32_t tid) : records(capacity), mask(capacity - 1), tid(tid) {}
+
+        std::vector<Record> records;
+        size_t mask;
+        uint32_t tid;
+        std::atomic<uint64_t> head{};
+    };
+
+    std::mutex registry_mutex;
+    std::vector<std::shared_ptr<Ring>> rings;       // never shrinks, threads keep raw pointers
+    std::map<uint32_t, std::string> thread_names;
+    size_t ring_capacity{ 1 << 16 };
+    clock::time_point epoch{ clock::now() };
+
+    std::atomic<uint32_t> next_tid{ 1 };
+    thread_local uint32_t this_tid = next_tid.fetch_add(1, std::memory_order_relaxed);
+    thread_local Ring* this_ring = nullptr;
+
+    Ring* register_thread() {
+        std::scoped_lock<std::mutex> lock(registry_mutex);
+        rings.push_back(std::make_shared<Ring>(ring_capacity, this_tid));
+        return rings.back().get();
+    }
+
+    size_t round_up_pow2(size_t n) {
+        size_t out = 1;
+        while (out < n) out <<= 1;
+        return out;
+    }
+
+    const char* event_name(Event e) {
+        switch (e) {
+            case Event::RequestSent:    return "request";
+            case Event::BlockReceived:  return "block";
+            case Event::HashBegin:
+            case Event::HashEnd:        return "hash";
+            case Event::PieceQueued:    return "queued";
+            case Event::WriteBegin:
+            case Event::WriteEnd:       return "write";
+            case Event::HaveBroadcast:  return "have";
+            case Event::RequestTimeout: return "timeout";
+        }
+        return "unknown";
+    }
+
+    const char* phase(Event e) {
+        switch (e) {
+            case Event::HashBegin:
+            case Event::WriteBegin: return "B";
+            case Event::HashEnd:
+            case Event::WriteEnd:   return "E";
+            default:                return "i";
+        }
+    }
+
+    const char* arg_name(Event e) {
+        switch (e) {
+            case Event::RequestSent:
+            case Event::BlockReceived:
+            case Event::RequestTimeout: return "begin";
+            case Event::HashEnd:        return "ok";
+            case Event::HaveBroadcast:  return "peers";
+            default:                    return nullptr;
+        }
+    }
+
+    std::string escape(const std::string& in) {
+        std::string out;
+        for (char c : in) {
+            if (c == '"' || c == '\\') out += '\\';
+            out += c;
+        }
+        return out;
+    }
+}
+
+std::atomic<bool> detail::enabled{ false };
+
+void start(size_t events_per_thread) {
+    {
+        std::scoped_lock<std::mutex> lock(registry_mutex);
+        if (rings.empty()) {
+            ring_capacity = round_up_pow2(std::max<size_t>(events_per_thread, 1024));
+            epoch = clock::now();
+        }
+    }
+    detail::enabled.store(true, std::memory_order_relaxed);
+}
+
+void stop() {
+    detail::enabled.store(false, std::memory_order_relaxed);
+}
+
+void set_thread_name(const std::string& name) {
+    std::scoped_lock<std::mutex> lock(registry_mutex);
+    thread_names[this_tid] = name;
+}
+
+void detail::record(Event event, int32_t piece, int32_t arg) {
+    if (!this_ring) this_ring = register_thread();
+
+    auto ts = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - epoch).count();
+    auto head = this_ring->head.load(std::memory_order_relaxed);
+
+    this_ring->records[head & this_ring->mask] = { ts, piece, arg, event };
+    this_ring->head.store(head + 1, std::memory_order_release);
+}
+
+bool write_chrome_json(const std::string& path) {
+    std::vector<std::shared_ptr<Ring>> snapshot;
+    std::map<uint32_t, std::string> names;
+    {
+        std::scoped_lock<std::mutex> lock(registry_mutex);
+        snapshot = rings;
+        names = thread_names;
+    }
+
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) return false;
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    auto separator = [&] {
+        if (!first) out << ",\n";
+        first = false;
+    };
+
+    for (const auto& [tid, name] : names) {
+        separator();
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid << ",\"args\":{\"name\":\"" << escape(name) << "\"}}";
+    }
+
+    for (const auto& ring : snapshot) {
+        auto capacity = ring->records.size();
+        auto head = ring->head.load(std::memory_order_acquire);
+        auto begin = head > capacity ? head - capacity : 0;
+
+        std::vector<Record> records;
+        records.reserve(head - begin);
+        for (auto i = begin; i < head; ++i) records.push_back(ring->records[i & ring->mask]);
+
+        // anything the writer lapped while we copied is garbage
+        auto head_after = ring->head.load(std::memory_order_acquire);
+        auto valid_from = head_after > capacity ? head_after - capacity : 0;
+
+        for (auto i = begin; i < head; ++i) {
+            if (i < valid_from) continue;
+            const auto& r = records[i - begin];
+            auto ts_us = (double)r.ts_ns / 1000.0;
+
+            separator();
+            out << "{\"name\":\"" << event_name(r.event) << "\",\"cat\":\"piece\",\"ph\":\"" << phase(r.event) << "\""
+                << ",\"ts\":" << std::fixed << ts_us << ",\"pid\":1,\"tid\":" << ring->tid;
+            if (phase(r.event)[0] == 'i') out << ",\"s\":\"t\"";
+            out << ",\"args\":{\"piece\":" << r.piece;
+            if (auto name = arg_name(r.event)) out << ",\"" << name << "\":" << r.arg;
+            out << "}}";
+
+            // flow arrows from a verified piece to its write, usually on another thread
+            if (r.event == Event::PieceQueued || r.event == Event::WriteBegin) {
+                separator();
+                out << "{\"name\":\"piece\",\"cat\":\"piece\",\"ph\":\"" << (r.event == Event::PieceQueued ? "s" : "f") << "\""
+                    << (r.event == Event::WriteBegin ? ",\"bp\":\"e\"" : "")
+                    << ",\"id\":" << r.piece << ",\"ts\":" << ts_us << ",\"pid\":1,\"tid\":" << ring->tid << "}";
+            }
+        }
+    }
+
+    out << "\n]}\n";
+    return (bool)out;
+}
+
+}
@@ -1,28 +1,31 @@
 #include <UdpTracker.hpp>
 
-TrackerResponse UdpTracker::announce(const std::array<uint8_t, 20>& infoHash, const std::string& peerId, const std::atomic<size_t>& uploaded, const std::atomic<size_t>& downloaded, const std::atomic<size_t>& total) {
+TrackerResponse UdpTracker::announce(const std::array<uint8_t, 20>& infoHash, const std::string& peerId, uint16_t port, size_t uploaded, size_t downloaded, size_t total) {
     uint32_t interval{};
     try {
         uint32_t event = 0;
 
-        auto up = uploaded.load();
-        auto down = downloaded.load();
-        auto tot = total.load();
+        auto up = uploaded;
+        auto down = downloaded;
+        auto tot = total;
 
         if (down == 0) event = 2; // started
         else if (down >= tot) event = 1; // completed
 
         const std::string host = parsed.host;
-        const std::string port = parsed.port.empty() ? "6969" : parsed.port; // fallback
-        const uint16_t my_port = 31616;
+        const std::string tracker_port = parsed.port.empty() ? "6969" : parsed.port; // fallback
+        const uint16_t my_port = port;
 
         boost::asio::io_context io;
         udp::resolver resolver(io);
-        auto endpoints = resolver.resolve(udp::v4(), host, port);
+        auto endpoints = resolver.resolve(host, tracker_port);
         udp::endpoint ep = *endpoints.begin();
         // udp::socket socket(io, udp::endpoint(udp::v4(), my_port));
         udp::socket socket(io);
-        socket.open(udp::v4());
+        socket.open(ep.protocol());
+
+        // BEP 15: the peers come in the tracker's own address family, 18 bytes each over IPv6
+        const bool v6 = ep.address().is_v6();
 
         const int max_retries = 3;
         const std::chrono::seconds timeout(5);
@@ -70,16 +73,7 @@ TrackerResponse UdpTracker::announce(const std::array<uint8_t, 20>& infoHash, co
 
             interval = read_be32(announce_resp.data() + 8);
 
-            std::vector<unsigned char> peer_blob(announce_resp.begin() + 20, announce_resp.end());
-            size_t num_peers = peer_blob.size() / 6;
-
-            for (size_t i = 0; i < num_peers; ++i) {
-                const unsigned char* p = peer_blob.data() + i * 6;
-                std::string ip = std::to_string(p[0]) + "." + std::to_string(p[1]) + "." +
-                                 std::to_string(p[2]) + "." + std::to_string(p[3]);
-                uint16_t port = (static_cast<uint16_t>(p[4]) << 8) | static_cast<uint16_t>(p[5]);
-                peers.emplace_back(boost::asio::ip::make_address(ip), port);
-            }
+            parse_compact_peers(std::span<const uint8_t>(announce_resp).subspan(20), v6, peers);
 
             if (!peers.empty()) break; // stop retries if we got peers
         }
@@ -104,7 +98,7 @@ TrackerResponse UdpTracker::announce(const std::array<uint8_t, 20>& infoHash, co
         auto fut = prom.get_future();
 
         boost::asio::deadline_timer timer(io);
-        std::vector<unsigned char> resp_buf(1500); //
+        std::vector<unsigned char> resp_buf(65536);    // an announce answer with thousands of peers doesn't fit an MTU
 
         // send
         socket.async_send_to(boost::asio::buffer(out_buf), ep,
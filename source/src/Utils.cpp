@@ -17,6 +17,21 @@ std::string read_from_file(const std::string& path) {
     return data;
 }
 
+MappedFile::MappedFile(const std::string& path) {
+    namespace bip = boost::interprocess;
+
+    try {
+        bip::file_mapping mapping(path.c_str(), bip::read_only);
+        region_ = bip::mapped_region(mapping, bip::read_only);
+    }
+    catch (const bip::interprocess_exception& e) {
+        throw std::runtime_error("Could not map file: " + path + " (" + e.what() + ")");
+    }
+
+    // the parser walks the file front to back exactly once
+    region_.advise(bip::mapped_region::advice_sequential);
+}
+
 ParsedUrl parse_url(const std::string& url) {
 	ParsedUrl result;
 
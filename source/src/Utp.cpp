@@ -0,0 +1,743 @@
+#include <Utp.hpp>
+
+#include <boost/endian/conversion.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <optional>
+
+namespace {
+    enum : uint8_t { st_data = 0, st_fin = 1, st_state = 2, st_reset = 3, st_syn = 4 };
+    constexpr uint8_t utp_version = 1;
+    constexpr uint8_t ext_sack = 1;
+
+    // the low 32 bits of a microsecond clock, only ever compared with wrap around
+    uint32_t now_micros() {
+        return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // a comes before b in 16 bit sequence space
+    bool seq_before(uint16_t a, uint16_t b) { return (int16_t)(uint16_t)(a - b) < 0; }
+
+    bool ts_before(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+}
+
+// -- stream --
+
+UtpStream::UtpStream(UtpContext& context, const udp::endpoint& remote, uint16_t recv_id, uint16_t send_id)
+    : context_(&context),
+      remote_(remote),
+      recv_id_(recv_id),
+      send_id_(send_id),
+      pacing_timer_(context.io_) {
+    last_sent_ = last_received_ = Clock::now();
+}
+
+UtpStream::executor_type UtpStream::get_executor() {
+    return pacing_timer_.get_executor();
+}
+
+bool UtpStream::is_open() const {
+    return !user_closed_ && state_ != State::Closed;
+}
+
+void UtpStream::complete(Handler handler, boost::system::error_code ec, size_t bytes) {
+    // never from inside the initiating call, the composed operations rely on that
+    boost::asio::post(pacing_timer_.get_executor(), [handler = std::move(handler), ec, bytes]() mutable { handler(ec, bytes); });
+}
+
+void UtpStream::start_read(std::vector<boost::asio::mutable_buffer> buffers, Handler handler) {
+    if (user_closed_) return complete(std::move(handler), boost::asio::error::bad_descriptor, 0);
+    if (read_handler_) return complete(std::move(handler), boost::asio::error::in_progress, 0);
+    if (boost::asio::buffer_size(buffers) == 0) return complete(std::move(handler), {}, 0);
+
+    read_buffers_ = std::move(buffers);
+    read_handler_ = std::move(handler);
+    deliver_read();
+}
+
+void UtpStream::start_write(std::vector<boost::asio::const_buffer> buffers, Handler handler) {
+    if (user_closed_ || fin_queued_ || state_ == State::FinSent || state_ == State::Closed) {
+        return complete(std::move(handler), error_ ? error_ : boost::asio::error::broken_pipe, 0);
+    }
+
+    auto size = boost::asio::buffer_size(buffers);
+    if (size == 0) return complete(std::move(handler), {}, 0);
+
+    pending_writes_.push_back({ std::move(buffers), size, std::move(handler) });
+    pump_writes();
+}
+
+// move pending writes into the send buffer while it has room
+void UtpStream::pump_writes() {
+    if (send_offset_ == send_buffer_.size()) {
+        send_buffer_.clear();
+        send_offset_ = 0;
+    } else if (send_offset_ > send_buffer_.size() / 2) {
+        send_buffer_.erase(send_buffer_.begin(), send_buffer_.begin() + (ptrdiff_t)send_offset_);
+        send_offset_ = 0;
+    }
+
+    bool wrote = false;
+    while (!pending_writes_.empty()) {
+        auto& write = pending_writes_.front();
+        auto queued = send_buffer_.size() - send_offset_ + unacked_bytes_;
+        auto room = send_buffer_limit > queued ? send_buffer_limit - queued : 0;
+
+        // writes are taken whole so messages from interleaved writers stay apart, only one
+        // bigger than the whole buffer is split
+        auto take = write.size <= room ? write.size : queued == 0 ? room : 0;
+        if (take == 0) break;
+
+        auto at = send_buffer_.size();
+        send_buffer_.resize(at + take);
+        boost::asio::buffer_copy(boost::asio::buffer(send_buffer_.data() + at, take), write.buffers);
+
+        complete(std::move(write.handler), {}, take);
+        pending_writes_.pop_front();
+        wrote = true;
+    }
+
+    if (wrote) flush();
+}
+
+void UtpStream::deliver_read() {
+    if (!read_handler_) return;
+
+    if (auto available = recv_buffer_.size() - recv_offset_) {
+        auto copied = boost::asio::buffer_copy(read_buffers_, boost::asio::buffer(recv_buffer_.data() + recv_offset_, available));
+        recv_offset_ += copied;
+        if (recv_offset_ == recv_buffer_.size()) {
+            recv_buffer_.clear();
+            recv_offset_ = 0;
+        } else if (recv_offset_ > recv_buffer_.size() / 2) {
+            recv_buffer_.erase(recv_buffer_.begin(), recv_buffer_.begin() + (ptrdiff_t)recv_offset_);
+            recv_offset_ = 0;
+        }
+
+        read_buffers_.clear();
+        complete(std::exchange(read_handler_, nullptr), {}, copied);
+
+        // a sender that stopped on our window doesn't hear it reopen unless we say so
+        if (last_wnd_sent_ < recv_window / 2 && advertised_window() >= recv_window / 2) send_ack();
+        return;
+    }
+
+    if (eof_) complete(std::exchange(read_handler_, nullptr), boost::asio::error::eof, 0);
+    else if (error_) complete(std::exchange(read_handler_, nullptr), error_, 0);
+    else return;
+    read_buffers_.clear();
+}
+
+void UtpStream::close() {
+    if (std::exchange(user_closed_, true)) return;
+
+    if (read_handler_) complete(std::exchange(read_handler_, nullptr), boost::asio::error::operation_aborted, 0);
+    read_buffers_.clear();
+    for (auto& write : pending_writes_) complete(std::move(write.handler), boost::asio::error::operation_aborted, 0);
+    pending_writes_.clear();
+
+    if (state_ == State::SynSent) fail(boost::asio::error::operation_aborted);
+    else if (state_ == State::Connected) {
+        fin_queued_ = true;
+        flush();
+    }
+}
+
+void UtpStream::fail(boost::system::error_code ec) {
+    if (state_ == State::Closed) return;
+    error_ = ec;
+
+    if (auto handler = std::exchange(connect_handler_, nullptr)) handler(ec);
+    if (read_handler_) complete(std::exchange(read_handler_, nullptr), ec, 0);
+    read_buffers_.clear();
+    for (auto& write : pending_writes_) complete(std::move(write.handler), ec, 0);
+    pending_writes_.clear();
+
+    set_closed();
+}
+
+void UtpStream::set_closed() {
+    state_ = State::Closed;
+    rto_armed_ = false;
+    pacing_timer_.cancel();
+    outgoing_.clear();
+    send_buffer_.clear();
+    send_offset_ = unacked_bytes_ = bytes_in_flight_ = 0;
+    if (context_) context_->remove(*this);
+}
+
+void UtpStream::detach() {
+    context_ = nullptr;
+    state_ = State::Closed;
+}
+
+// -- connection setup --
+
+void UtpStream::connect(std::function<void(boost::system::error_code)> handler) {
+    connect_handler_ = std::move(handler);
+    state_ = State::SynSent;
+
+    outgoing_.push_back({ st_syn, seq_nr_++, std::vector<uint8_t>(header_size) });
+    transmit(outgoing_.back(), Clock::now());
+}
+
+// the SYN's ack carries our first sequence number, which the initiator takes as the one
+// before our first data packet
+void UtpStream::accept(const Header& syn) {
+    state_ = State::Connected;
+    ack_nr_ = syn.seq_nr;
+    seq_nr_ = (uint16_t)context_->rng_();
+    last_ack_seen_ = (uint16_t)(seq_nr_ - 1);
+    reply_micro_ = now_micros() - syn.timestamp;
+    peer_wnd_ = syn.wnd_size;
+    send_ack();
+}
+
+void UtpStream::incoming(const Header& header, std::span<const uint8_t> sack, std::span<const uint8_t> payload) {
+    if (state_ == State::Closed) return;
+
+    auto now = Clock::now();
+    last_received_ = now;
+
+    if (header.type == st_reset) {
+        fail(boost::asio::error::connection_reset);
+        return;
+    }
+
+    reply_micro_ = now_micros() - header.timestamp;
+    peer_wnd_ = header.wnd_size;
+    if (header.timestamp_diff) on_delay_sample(header.timestamp_diff, now);
+
+    if (state_ == State::SynSent) {
+        if (header.type != st_state) return;
+
+        state_ = State::Connected;
+        ack_nr_ = (uint16_t)(header.seq_nr - 1);
+        process_ack(header, sack, now);
+        if (auto handler = std::exchange(connect_handler_, nullptr)) handler({});
+        flush();
+        return;
+    }
+
+    // the initiator didn't get our ack of its SYN
+    if (header.type == st_syn) {
+        send_ack();
+        return;
+    }
+
+    process_ack(header, sack, now);
+
+    if (header.type == st_data) receive_data(header.seq_nr, payload);
+    else if (header.type == st_fin) receive_fin(header.seq_nr);
+    if (state_ == State::Closed) return;
+
+    pump_writes();
+    flush();
+
+    if (state_ == State::FinSent && outgoing_.empty()) set_closed();
+}
+
+void UtpStream::tick(Clock::time_point now) {
+    if (state_ == State::Closed) return;
+
+    if (rto_armed_ && now >= rto_deadline_) {
+        on_timeout();
+        if (state_ == State::Closed) return;
+    }
+
+    if (state_ == State::SynSent) return;
+    if (now - last_received_ > idle_timeout) fail(boost::asio::error::timed_out);
+    else if (now - last_sent_ > keepalive_interval) send_ack();
+}
+
+// -- acks and congestion control --
+
+void UtpStream::process_ack(const Header& header, std::span<const uint8_t> sack, Clock::time_point now) {
+    auto ack_nr = header.ack_nr;
+
+    // acks outside what's in flight are stale or bogus
+    auto first = (uint16_t)(seq_nr_ - outgoing_.size());
+    auto newly = (size_t)(uint16_t)(ack_nr - (uint16_t)(first - 1));
+    if (newly > outgoing_.size()) return;
+
+    auto flight_before = bytes_in_flight_;
+    size_t acked_bytes{};
+
+    for (size_t i = 0; i < newly; ++i) {
+        packet_acked(outgoing_.front(), now, acked_bytes);
+        outgoing_.pop_front();
+    }
+
+    // bit i acks ack_nr + 2 + i, and ack_nr + 1 is the new front
+    for (size_t i = 0; i < sack.size() * 8; ++i) {
+        if (!(sack[i / 8] >> (i % 8) & 1)) continue;
+        if (i + 1 >= outgoing_.size()) break;
+        packet_acked(outgoing_[i + 1], now, acked_bytes);
+    }
+
+    if (newly > 0) {
+        timeouts_ = 0;
+        dup_acks_ = 0;
+        rto_armed_ = bytes_in_flight_ > 0;
+        rto_deadline_ = now + rto_;
+    } else if (header.type == st_state && !outgoing_.empty() && ack_nr == last_ack_seen_) {
+        // only bare acks, data from a peer that's sending too repeats the ack without meaning anything
+        ++dup_acks_;
+    }
+    last_ack_seen_ = ack_nr;
+
+    // walks the whole window, only worth it once something arrived out of order
+    if (!sack.empty() || dup_acks_ >= 3) detect_losses();
+    if (acked_bytes) grow_window(acked_bytes, flight_before);
+}
+
+void UtpStream::packet_acked(OutPacket& packet, Clock::time_point now, size_t& acked_bytes) {
+    if (std::exchange(packet.acked, true)) return;
+
+    if (packet.in_flight) bytes_in_flight_ -= packet.data.size();
+    packet.in_flight = false;
+    unacked_bytes_ -= packet.data.size() - header_size;
+    acked_bytes += packet.data.size();
+
+    // Karn: a resent packet's ack could be for either copy
+    if (packet.transmissions != 1) return;
+
+    auto sample = std::chrono::duration_cast<std::chrono::microseconds>(now - packet.sent);
+    if (rtt_.count() == 0) {
+        rtt_ = sample;
+        rtt_var_ = sample / 2;
+    } else {
+        rtt_var_ += (std::chrono::abs(rtt_ - sample) - rtt_var_) / 4;
+        rtt_ += (sample - rtt_) / 8;
+    }
+    rto_ = std::max<Clock::duration>(rtt_ + 4 * rtt_var_, min_rto);
+}
+
+void UtpStream::mark_lost(OutPacket& packet) {
+    if (packet.in_flight) bytes_in_flight_ -= packet.data.size();
+    packet.in_flight = false;
+    packet.fast_resent = true;
+}
+
+// a packet with three acked packets after it is gone, resend it now instead of waiting out the
+// timeout. peers that don't send selective acks get the same from three duplicate acks
+void UtpStream::detect_losses() {
+    std::optional<uint16_t> lost;
+    size_t acked_after{};
+
+    for (size_t i = outgoing_.size(); i-- > 0;) {
+        auto& packet = outgoing_[i];
+        if (packet.acked) {
+            ++acked_after;
+            continue;
+        }
+        if (acked_after >= 3 && packet.in_flight && !packet.fast_resent) {
+            mark_lost(packet);
+            lost = packet.seq;
+        }
+    }
+
+    if (dup_acks_ >= 3 && !outgoing_.empty() && outgoing_.front().in_flight && !outgoing_.front().fast_resent) {
+        mark_lost(outgoing_.front());
+        lost = outgoing_.front().seq;
+        dup_acks_ = 0;
+    }
+
+    if (lost) loss_event(*lost, false);
+}
+
+// at most one cut per window: losses among packets sent before the last cut are the same event
+void UtpStream::loss_event(uint16_t seq, bool timeout) {
+    if (!timeout && recovering_ && seq_before(seq, loss_seq_)) return;
+
+    recovering_ = true;
+    loss_seq_ = seq_nr_;
+    ssthresh_ = std::max((size_t)(cwnd_ / 2), min_window);
+    cwnd_ = timeout ? (double)min_window : std::max(cwnd_ / 2, (double)min_window);
+}
+
+// the peer timestamps how long our packets took to reach it. the smallest such delay over the
+// last couple of minutes is the path without queues (and without the clock offset between us),
+// anything above it is queueing we caused or share
+void UtpStream::on_delay_sample(uint32_t delay, Clock::time_point now) {
+    if (!have_base_) {
+        base_history_ = { delay, delay };
+        base_rotated_ = now;
+        have_base_ = true;
+    } else if (now - base_rotated_ >= std::chrono::minutes(1)) {
+        base_history_[1] = base_history_[0];
+        base_history_[0] = delay;
+        base_rotated_ = now;
+    } else if (ts_before(delay, base_history_[0])) {
+        base_history_[0] = delay;
+    }
+
+    auto base = ts_before(base_history_[1], base_history_[0]) ? base_history_[1] : base_history_[0];
+    our_delay_ = ts_before(delay, base) ? 0 : delay - base;
+}
+
+// LEDBAT: slow start while the queue is empty, then grow or shrink by up to
+// max_cwnd_increase_per_rtt per round trip in proportion to how far the delay is off target
+void UtpStream::grow_window(size_t acked_bytes, size_t flight_before) {
+    // an application that doesn't fill the window says nothing about the path
+    if (flight_before + packet_size < cwnd_) return;
+
+    if (cwnd_ < (double)ssthresh_ && our_delay_ < target_delay_us / 2) {
+        cwnd_ += (double)acked_bytes;
+    } else {
+        if (cwnd_ < (double)ssthresh_) ssthresh_ = (size_t)cwnd_;
+
+        auto off_target = std::clamp(((double)target_delay_us - (double)our_delay_) / target_delay_us, -1.0, 1.0);
+        auto window_factor = std::min((double)acked_bytes, cwnd_) / std::max(cwnd_, (double)acked_bytes);
+        cwnd_ += max_cwnd_increase_per_rtt * off_target * window_factor;
+    }
+    cwnd_ = std::clamp(cwnd_, (double)min_window, (double)max_window);
+}
+
+void UtpStream::on_timeout() {
+    rto_armed_ = false;
+    if (outgoing_.empty()) return;
+
+    if (++timeouts_ > (state_ == State::SynSent ? max_syn_retries : max_retries)) {
+        fail(boost::asio::error::timed_out);
+        return;
+    }
+
+    rto_ = std::min<Clock::duration>(rto_ * 2, max_rto);
+    for (auto& packet : outgoing_) packet.in_flight = false;
+    bytes_in_flight_ = 0;
+
+    loss_event(seq_nr_, true);
+    flush();
+}
+
+// -- receiving --
+
+void UtpStream::receive_data(uint16_t seq, std::span<const uint8_t> payload) {
+    if (got_fin_ && !seq_before(seq, eof_seq_)) return;
+
+    auto distance = (uint16_t)(seq - (uint16_t)(ack_nr_ + 1));
+    if (distance >= 0x8000) {
+        // a duplicate, our ack must have been lost
+        send_ack();
+        return;
+    }
+    if (distance >= max_reorder) return;
+
+    // no room, the sender resends once we ack more
+    if (recv_buffer_.size() - recv_offset_ + reorder_bytes_ + payload.size() > recv_window) return;
+
+    if (distance > 0) {
+        if (reorder_.emplace(seq, std::vector<uint8_t>(payload.begin(), payload.end())).second) reorder_bytes_ += payload.size();
+        send_ack();
+        return;
+    }
+
+    // nobody reads after close, the bytes are still acked so the peer can finish
+    if (!user_closed_) recv_buffer_.insert(recv_buffer_.end(), payload.begin(), payload.end());
+    ++ack_nr_;
+
+    for (auto it = reorder_.find((uint16_t)(ack_nr_ + 1)); it != reorder_.end(); it = reorder_.find((uint16_t)(ack_nr_ + 1))) {
+        if (!user_closed_) recv_buffer_.insert(recv_buffer_.end(), it->second.begin(), it->second.end());
+        reorder_bytes_ -= it->second.size();
+        reorder_.erase(it);
+        ++ack_nr_;
+    }
+
+    if (got_fin_ && (uint16_t)(ack_nr_ + 1) == eof_seq_) {
+        ack_nr_ = eof_seq_;
+        eof_ = true;
+    }
+
+    deliver_read();
+    if (reorder_.empty() && !eof_) schedule_ack();
+    else send_ack();
+}
+
+void UtpStream::receive_fin(uint16_t seq) {
+    if (!got_fin_) {
+        got_fin_ = true;
+        eof_seq_ = seq;
+        if (seq == (uint16_t)(ack_nr_ + 1)) {
+            ack_nr_ = seq;
+            eof_ = true;
+            deliver_read();
+        }
+    }
+    send_ack();
+}
+
+uint32_t UtpStream::advertised_window() const {
+    auto buffered = recv_buffer_.size() - recv_offset_ + reorder_bytes_;
+    return (uint32_t)(recv_window - std::min(buffered, recv_window));
+}
+
+// every other packet is acked straight away, a lone one at the end of the current batch of
+// handlers, which is usually right away too but lets a reply carry the ack instead
+void UtpStream::schedule_ack() {
+    if (++unacked_packets_ >= 2) {
+        send_ack();
+        return;
+    }
+    if (std::exchange(ack_posted_, true)) return;
+
+    boost::asio::post(pacing_timer_.get_executor(), [weak = weak_from_this()] {
+        auto self = weak.lock();
+        if (!self) return;
+        self->ack_posted_ = false;
+        if (self->unacked_packets_ > 0 && self->state_ != State::Closed) self->send_ack();
+    });
+}
+
+// -- sending --
+
+void UtpStream::fill_header(uint8_t* out, uint8_t type, uint16_t seq_nr, bool sack) const {
+    out[0] = (uint8_t)(type << 4 | utp_version);
+    out[1] = sack ? ext_sack : 0;
+    boost::endian::store_big_u16(out + 2, type == st_syn ? recv_id_ : send_id_);
+    boost::endian::store_big_u32(out + 4, now_micros());
+    boost::endian::store_big_u32(out + 8, reply_micro_);
+    boost::endian::store_big_u32(out + 12, advertised_window());
+    boost::endian::store_big_u16(out + 16, seq_nr);
+    boost::endian::store_big_u16(out + 18, ack_nr_);
+}
+
+void UtpStream::send_ack() {
+    if (!context_) return;
+
+    std::array<uint8_t, header_size + 2 + 32> buf{};
+    auto size = header_size;
+    fill_header(buf.data(), st_state, seq_nr_, !reorder_.empty());
+
+    if (!reorder_.empty()) {
+        // bit i is ack_nr + 2 + i, packets further out than the mask reaches wait for a later ack
+        size_t last_bit{};
+        for (const auto& [seq, payload] : reorder_) {
+            auto bit = (size_t)(uint16_t)(seq - (uint16_t)(ack_nr_ + 2));
+            if (bit >= 32 * 8) continue;
+            buf[header_size + 2 + bit / 8] |= (uint8_t)(1 << (bit % 8));
+            last_bit = std::max(last_bit, bit);
+        }
+        auto len = (last_bit / 32 + 1) * 4;
+        buf[header_size] = 0;
+        buf[header_size + 1] = (uint8_t)len;
+        size += 2 + len;
+    }
+
+    context_->send(remote_, { buf.data(), size });
+    last_sent_ = Clock::now();
+    unacked_packets_ = 0;
+    last_wnd_sent_ = advertised_window();
+}
+
+bool UtpStream::window_allows(size_t bytes) const {
+    // one packet always goes, it doubles as the probe of a zero window
+    return bytes_in_flight_ == 0 || bytes_in_flight_ + bytes <= std::min((size_t)cwnd_, (size_t)peer_wnd_);
+}
+
+void UtpStream::transmit(OutPacket& packet, Clock::time_point now) {
+    fill_header(packet.data.data(), packet.type, packet.seq, false);
+    if (!packet.in_flight) bytes_in_flight_ += packet.data.size();
+    packet.in_flight = true;
+    packet.sent = now;
+    ++packet.transmissions;
+
+    context_->send(remote_, packet.data);
+    last_sent_ = now;
+    unacked_packets_ = 0;   // it carries our ack too
+
+    if (!rto_armed_) {
+        rto_armed_ = true;
+        rto_deadline_ = now + rto_;
+    }
+
+    // pacing: a window's worth of packets spread over one round trip
+    if (rtt_.count() > 0) {
+        auto gap = std::chrono::duration<double, std::micro>((double)rtt_.count() * (double)packet.data.size() / cwnd_);
+        next_send_ = std::max(next_send_, now) + std::chrono::duration_cast<Clock::duration>(gap);
+    }
+}
+
+void UtpStream::flush() {
+    if (!context_ || state_ == State::Closed) return;
+
+    auto now = Clock::now();
+
+    // a millisecond of slack keeps the timer out of it on short paths
+    auto paced = [&] {
+        if (next_send_ <= now + std::chrono::milliseconds(1)) return true;
+        if (!std::exchange(pacing_armed_, true)) {
+            pacing_timer_.expires_at(next_send_);
+            pacing_timer_.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
+                auto self = weak.lock();
+                if (!self) return;
+                self->pacing_armed_ = false;
+                if (!ec) self->flush();
+            });
+        }
+        return false;
+    };
+
+    // lost packets first, in order
+    for (auto& packet : outgoing_) {
+        if (packet.acked || packet.in_flight) continue;
+        if (!window_allows(packet.data.size()) || !paced()) return;
+        transmit(packet, now);
+    }
+
+    if (state_ != State::Connected) return;
+
+    while (send_offset_ < send_buffer_.size()) {
+        auto n = std::min(send_buffer_.size() - send_offset_, max_payload);
+        if (!window_allows(header_size + n) || !paced()) return;
+        if (outgoing_.size() >= 0x7fff) return;     // half the sequence space, acks would be ambiguous
+
+        OutPacket packet{ st_data, seq_nr_++, std::vector<uint8_t>(header_size + n) };
+        std::memcpy(packet.data.data() + header_size, send_buffer_.data() + send_offset_, n);
+        send_offset_ += n;
+        unacked_bytes_ += n;
+
+        outgoing_.push_back(std::move(packet));
+        transmit(outgoing_.back(), now);
+    }
+
+    // the FIN goes once everything before it is packetized, and isn't held back by the window
+    if (fin_queued_) {
+        fin_queued_ = false;
+        state_ = State::FinSent;
+        outgoing_.push_back({ st_fin, seq_nr_++, std::vector<uint8_t>(header_size) });
+        transmit(outgoing_.back(), now);
+    }
+}
+
+// -- context --
+
+UtpContext::UtpContext(boost::asio::io_context& io, UdpSocket& socket)
+    : io_(io),
+      socket_(socket),
+      tick_timer_(io),
+      rng_(std::random_device{}()) {
+    socket_.add_handler([this](const udp::endpoint& from, std::span<const uint8_t> packet) { return incoming(from, packet); });
+    tick();
+}
+
+UtpContext::~UtpContext() {
+    // streams can outlive us in handlers still queued on the io_context
+    for (auto& [key, stream] : streams_) stream->detach();
+}
+
+void UtpContext::connect(const udp::endpoint& remote, ConnectHandler handler) {
+    uint16_t recv_id;
+    do recv_id = (uint16_t)rng_();
+    while (streams_.contains({ remote, recv_id }));
+
+    auto stream = std::make_shared<UtpStream>(*this, remote, recv_id, (uint16_t)(recv_id + 1));
+    streams_.emplace(Key{ remote, recv_id }, stream);
+
+    stream->connect([this, weak = std::weak_ptr<UtpStream>(stream), handler = std::move(handler)](boost::system::error_code ec) {
+        boost::asio::post(io_, [handler, ec, stream = weak.lock()] { handler(ec, ec ? nullptr : stream); });
+    });
+}
+
+bool UtpContext::incoming(const udp::endpoint& from, std::span<const uint8_t> packet) {
+    if (packet.size() < UtpStream::header_size) return false;
+
+    auto type = (uint8_t)(packet[0] >> 4);
+    if ((packet[0] & 0xf) != utp_version || type > st_syn) return false;
+
+    UtpStream::Header header;
+    header.type = type;
+    header.connection_id = boost::endian::load_big_u16(packet.data() + 2);
+    header.timestamp = boost::endian::load_big_u32(packet.data() + 4);
+    header.timestamp_diff = boost::endian::load_big_u32(packet.data() + 8);
+    header.wnd_size = boost::endian::load_big_u32(packet.data() + 12);
+    header.seq_nr = boost::endian::load_big_u16(packet.data() + 16);
+    header.ack_nr = boost::endian::load_big_u16(packet.data() + 18);
+
+    // extension chain: next type, length, data
+    std::span<const uint8_t> sack;
+    auto at = UtpStream::header_size;
+    for (auto ext = packet[1]; ext; ) {
+        if (at + 2 > packet.size()) return true;
+        auto next = packet[at];
+        size_t len = packet[at + 1];
+        at += 2;
+        if (at + len > packet.size()) return true;
+        if (ext == ext_sack) sack = packet.subspan(at, len);
+        ext = next;
+        at += len;
+    }
+    auto payload = packet.subspan(at);
+
+    if (type == st_syn) {
+        Key key{ from, (uint16_t)(header.connection_id + 1) };
+        if (auto it = streams_.find(key); it != streams_.end()) {
+            auto stream = it->second;
+            stream->incoming(header, sack, payload);
+            return true;
+        }
+        if (!accept_handler_) {
+            send_reset(from, header.connection_id);
+            return true;
+        }
+
+        auto stream = std::make_shared<UtpStream>(*this, from, key.second, header.connection_id);
+        streams_.emplace(key, stream);
+        stream->accept(header);
+        accept_handler_(stream);
+        return true;
+    }
+
+    if (auto it = streams_.find({ from, header.connection_id }); it != streams_.end()) {
+        auto stream = it->second;
+        stream->incoming(header, sack, payload);
+        return true;
+    }
+
+    if (type != st_reset) {
+        send_reset(from, header.connection_id);
+        return true;
+    }
+
+    // a reset echoes whichever id the other side saw last, ours for sending included
+    for (auto& [key, stream] : streams_) {
+        if (key.first == from && stream->send_id_ == header.connection_id) {
+            auto keep = stream;
+            keep->incoming(header, sack, payload);
+            break;
+        }
+    }
+    return true;
+}
+
+void UtpContext::send(const udp::endpoint& to, std::span<const uint8_t> packet) {
+    socket_.send(to, packet);
+}
+
+void UtpContext::send_reset(const udp::endpoint& to, uint16_t connection_id) {
+    std::array<uint8_t, UtpStream::header_size> buf{};
+    buf[0] = (uint8_t)(st_reset << 4 | utp_version);
+    boost::endian::store_big_u16(buf.data() + 2, connection_id);
+    boost::endian::store_big_u32(buf.data() + 4, now_micros());
+    socket_.send(to, buf);
+}
+
+void UtpContext::remove(const UtpStream& stream) {
+    streams_.erase({ stream.remote_, stream.recv_id_ });
+}
+
+void UtpContext::tick() {
+    auto now = std::chrono::steady_clock::now();
+
+    // a copy, streams leave the map as they close
+    std::vector<std::shared_ptr<UtpStream>> streams;
+    streams.reserve(streams_.size());
+    for (auto& [key, stream] : streams_) streams.push_back(stream);
+    for (auto& stream : streams) stream->tick(now);
+
+    tick_timer_.expires_after(std::chrono::milliseconds(50));
+    tick_timer_.async_wait([this](boost::system::error_code ec) {
+        if (!ec) tick();
+    });
+}
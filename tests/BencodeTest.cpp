@@ -0,0 +1,110 @@
+// encode(decode(x)) has to give back x byte for byte for anything canonical, or info hashes of
+// re-encoded info dictionaries drift. plain asserts, `ctest` runs it
+
+#include <Bencode.hpp>
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+    int failures{};
+
+    void check(bool ok, std::string_view what) {
+        if (ok) return;
+        ++failures;
+        std::fprintf(stderr, "FAILED: %.*s\n", (int)what.size(), what.data());
+    }
+
+    std::string printable(std::string_view in) {
+        std::string out;
+        for (unsigned char c : in) {
+            if (c >= 0x20 && c < 0x7f) out += (char)c;
+            else {
+                char hex[5];
+                std::snprintf(hex, sizeof(hex), "\\x%02x", c);
+                out += hex;
+            }
+        }
+        return out;
+    }
+
+    void round_trip(std::string_view in) {
+        auto value = BEncodeParser(in).parse();
+        auto out = bencode(value);
+        check(out == in, "round trip of " + printable(in) + " gave " + printable(out));
+        check(BEncodeWriter::encoded_size(value) == in.size(), "encoded_size of " + printable(in));
+    }
+
+    void encodes_to(const BEncodeValue& value, std::string_view expected) {
+        auto out = bencode(value);
+        check(out == expected, "encoding gave " + printable(out) + ", expected " + printable(expected));
+    }
+}
+
+int main() {
+    using namespace std::string_view_literals;
+
+    // integers
+    round_trip("i0e");
+    round_trip("i42e");
+    round_trip("i-1e");
+    round_trip("i-9223372036854775808e");
+    round_trip("i9223372036854775807e");
+
+    // strings, binary ones included: NULs, high bytes and bencode's own delimiters
+    round_trip("0:");
+    round_trip("4:spam");
+    round_trip("10:\0\x01\xff\xfe:ei5ed"sv);
+    round_trip("20:\x9a\x1b\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\x7f"sv);
+
+    // empty containers, alone and nested
+    round_trip("le");
+    round_trip("de");
+    round_trip("llelee");
+    round_trip("d0:lee");
+    round_trip("d1:ade1:blee");
+
+    // sorted keys compare as raw bytes: upper case before lower case, high bytes last
+    round_trip("d1:Bi1e1:ai2e2:aai3e1:bi4e1:\xffi5ee"sv);
+
+    // nested dicts and lists with a bit of everything
+    round_trip("d8:announce9:udp://x:14:infod5:filesld6:lengthi-3e4:pathl1:a1:beed6:lengthi0e4:pathl0:eee"
+               "4:name3:abc12:piece lengthi16384e6:pieces20:\0\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f\x10\x11\x12\x13"
+               "ee"sv);
+    round_trip("li1ei-2eli3eld1:xlleeeeee");
+
+    // the tree encodes in canonical order whatever order it was built in
+    BEncodeValue::Dict dict;
+    dict.emplace("zz", BEncodeValue{ (int64_t)-7 });
+    dict.emplace("a", BEncodeValue{ BEncodeValue::List{} });
+    dict.emplace("M", BEncodeValue{ std::string("\0x"sv) });
+    encodes_to(BEncodeValue{ std::move(dict) }, "d1:M2:\0x1:ale2:zzi-7ee"sv);
+
+    // the streaming interface writes the same bytes as the tree
+    std::string streamed;
+    BEncodeWriter writer(streamed);
+    writer.begin_dict();
+    writer.write_string("a");
+    writer.begin_list();
+    writer.write_int(-1);
+    writer.write_string(""sv);
+    writer.end();
+    writer.write_string("b");
+    writer.begin_dict();
+    writer.end();
+    writer.end();
+    check(streamed == "d1:ali-1e0:e1:bdee", "streaming writer gave " + printable(streamed));
+    round_trip(streamed);
+
+    // the info dictionary inside a torrent hashes the same after a round trip through the parser
+    auto torrent = "d4:infod6:lengthi5e4:name1:x12:piece lengthi16384e6:pieces20:aaaaaaaaaaaaaaaaaaaaee"sv;
+    BEncodeParser parser(torrent);
+    auto root = parser.parse();
+    auto [start, end] = parser.get_info_start_end();
+    check(bencode(root.as_dict().at("info")) == torrent.substr(start, end - start), "info dictionary re-encoding");
+
+    if (failures == 0) std::puts("bencode: all round trips ok");
+    return failures == 0 ? 0 : 1;
+}